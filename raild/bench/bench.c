@@ -0,0 +1,177 @@
+#include "../src/raild.h"
+#include <sys/socket.h>
+#include <luajit-2.0/lua.h>
+#include <hub_opcodes.h>
+
+/**
+ * Microbenchmarks of the raild hot paths
+ *
+ * Linked with every raild objects, main() of raild being renamed, and run
+ * from the raild directory:
+ *
+ *   make bench
+ *
+ * raild is set up without any hardware: a single offline hub, made ready
+ * right away and fed with uart_feed(), no API server and no shared-memory segment, so that it can
+ * run next to a live raild. bench/bench.lua provides the Lua side.
+ *
+ * Results are printed as one JSON object per line:
+ *   {"bench":"<name>","ops":<n>,"ns_per_op":<mean time of one op>}
+ */
+
+extern lua_State *L;
+
+static uint64_t now_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static void report(const char *name, long ops, uint64_t elapsed) {
+    printf("{\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f}\n", name, ops, (double) elapsed / ops);
+    fflush(stdout);
+}
+
+/**
+ * Parsing of RailHub input, without any state change
+ */
+static void bench_uart_process(long n) {
+    // 256 frames, so that sequence numbers carry on from one chunk to the next
+    rbyte frames[256 * 3];
+    for(int i = 0; i < 256; i++) {
+        frames[i * 3]     = SENSORS_2;
+        frames[i * 3 + 1] = i;
+        frames[i * 3 + 2] = 0x00;
+    }
+
+    long ops = 0;
+    uint64_t begin = now_ns();
+    for(; ops < n; ops += 256) {
+        uart_feed(0, frames, sizeof(frames), raild_now);
+    }
+    report("uart_process", ops, now_ns() - begin);
+}
+
+/**
+ * A sensor edge, from the hub state table to its Lua handler
+ * Every iteration toggles sensor 1, the hub must be ready.
+ */
+static void bench_sensor_dispatch(long n) {
+    uint64_t begin = now_ns();
+    for(long i = 0; i < n; i++) {
+        set_hub_sensors(0, RHUB_SENSORS1, !(i & 1), raild_now);
+    }
+    report("sensor_to_lua", n, now_ns() - begin);
+
+    lua_getglobal(L, "BenchEdges");
+    lua_call(L, 0, 1);
+    long edges = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    if(edges != n) {
+        fprintf(stderr, "sensor_to_lua: %ld edges reached Lua, expected %ld\n", edges, n);
+        exit(1);
+    }
+}
+
+/**
+ * The '\f' framing loop of API clients, chunks going to the worker
+ */
+static void bench_socket_framing(long n) {
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    raild_event *client = socket_attach(fds[1], false);
+    client->readable = true;
+
+    // Batches small enough for the worker queue
+    const char chunk[] = "x = 1\f";
+    const int  batch = 32;
+    char buffer[sizeof(chunk) * 32];
+    for(int i = 0; i < batch; i++) {
+        memcpy(buffer + i * (sizeof(chunk) - 1), chunk, sizeof(chunk) - 1);
+    }
+    int len = batch * (sizeof(chunk) - 1);
+
+    long ops = 0;
+    uint64_t elapsed = 0;
+    for(; ops < n; ops += batch) {
+        if(write(fds[0], buffer, len) != len) {
+            perror("write");
+            exit(1);
+        }
+
+        uint64_t begin = now_ns();
+        socket_handle_client(client);
+        elapsed += now_ns() - begin;
+
+        // Let the worker drain its queue, out of the measure
+        struct timespec pause = { 0, 200000 };
+        nanosleep(&pause, NULL);
+    }
+    report("socket_framing", ops, elapsed);
+
+    close(fds[0]);
+}
+
+/**
+ * Creation and cancellation of a one-shot timer
+ */
+static void bench_timers(long n) {
+    uint64_t begin = now_ns();
+    for(long i = 0; i < n; i++) {
+        raild_timer_delete(raild_timer_create(1000, 0, RAILD_EV_LUA_TIMER));
+
+        // Recycled at the end of every loop iteration by raild
+        if((i & 1023) == 1023) raild_epoll_collect();
+    }
+    raild_epoll_collect();
+    report("timer_create_cancel", n, now_ns() - begin);
+}
+
+/**
+ * Encoding of a Sync message, with the Lua and native encoders
+ */
+static void bench_json(const char *name, const char *fn, long n) {
+    lua_getglobal(L, fn);
+    lua_pushnumber(L, n);
+
+    uint64_t begin = now_ns();
+    if(lua_pcall(L, 1, 0, 0) != 0) {
+        fprintf(stderr, "%s: %s\n", fn, lua_tostring(L, -1));
+        exit(1);
+    }
+    report(name, n, now_ns() - begin);
+}
+
+int main(int argc, char **argv) {
+    long n = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    setup_logger();
+    logger_set_level(LOG_ERROR);
+
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    raild_now = tp.tv_sec + tp.tv_nsec / 1e9;
+
+    raild_epoll_create();
+    uart_add_offline();
+    setup_interlock();
+    setup_lua("bench/bench.lua");
+    setup_worker();
+
+    // Sensor edges are only dispatched once the hub is ready
+    set_hub_readiness(0, true);
+
+    bench_uart_process(n);
+    bench_sensor_dispatch(n);
+    bench_socket_framing(n / 100);
+    bench_timers(n);
+    bench_json("json_encode_lua", "BenchJSONLua", n / 100);
+    bench_json("json_encode_native", "BenchJSONNative", n / 100);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+--
+-- Lua side of the microbenchmarks, see bench.c
+--
+load "lua/json.lua"
+load "lua/sensors.lua"
+
+-- Edges reach Lua right away
+Sensors.debounce = 0
+
+-- Sensor 1 edges go through the Sensors objects, like scripts use them
+local edges = 0
+Sensors[1].On("Edge", function() edges = edges + 1 end)
+
+-- Checked by bench.c, so that the benchmark does not measure a no-op
+function BenchEdges()
+    return edges
+end
+
+-- A Sync message of RailMon
+local sync = {
+    event = "Sync",
+    sensors = {},
+    switches = {},
+    locks = {},
+    ready = true,
+    power = true
+}
+for i = 1, SensorsCount() do sync.sensors[i] = (i % 3 == 0) end
+for i = 1, SwitchesCount() do
+    sync.switches[i] = (i % 2 == 0)
+    sync.locks[i] = false
+end
+
+function BenchJSONLua(n)
+    local encode = JSON.Encode
+    for _ = 1, n do encode(sync) end
+end
+
+function BenchJSONNative(n)
+    local encode = JSON.EncodeFast
+    for _ = 1, n do encode(sync) end
+end
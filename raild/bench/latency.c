@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <hub_opcodes.h>
+
+/**
+ * End-to-end latency harness
+ *
+ * Plays a RailHub on a pseudo-terminal, like sim/hubsim.c, and runs raild
+ * on it with bench/latency.lua, where switch 1 follows sensor 1:
+ *
+ *   ./bench/latency -n 10000 -- ./raild -u /tmp/raild-bench-hub bench/latency.lua
+ *
+ * Each sample toggles sensor 1 with a SENSORS_1 frame and measures the
+ * time until raild writes the matching SET_SWITCH_ON/OFF command. This
+ * covers the whole path: tty read, parsing, hub state, Lua dispatch, the
+ * switch command and the output flush at the end of the loop iteration.
+ *
+ * Results are printed as a single JSON object, latencies in µs.
+ */
+
+// Interval between KEEP_ALIVE sent to raild (ms)
+#define KEEP_ALIVE_INTERVAL 250
+
+// A sample without answer after this delay is lost (ms)
+#define SAMPLE_TIMEOUT 1000
+
+// Options
+static int         opt_samples  = 10000;
+static int         opt_interval = 2; // ms between samples
+static int         opt_warmup   = 1000; // ms after READY
+static const char *opt_link     = "/tmp/raild-bench-hub";
+
+static int   pty = -1;
+static pid_t child = -1;
+
+// Opcode waiting for its argument byte, 0 if none
+static uint8_t pending_opcode = 0;
+
+// Last switch command seen for switch 1: -1 none, 0 off, 1 on
+static int last_command = -1;
+
+// Sequence number of the next state frame
+static uint8_t state_seq = 0;
+
+static bool   ready = false;
+static double next_keep_alive = 0;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void fatal(const char *msg) {
+    perror(msg);
+    if(child > 0) kill(child, SIGTERM);
+    exit(1);
+}
+
+static void send_bytes(const uint8_t *data, int len) {
+    while(len > 0) {
+        ssize_t n = write(pty, data, len);
+        if(n < 0) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            fatal("write");
+        }
+        data += n;
+        len  -= n;
+    }
+}
+
+static void send_byte(uint8_t c) {
+    send_bytes(&c, 1);
+}
+
+/**
+ * Startup sequence of the firmware, with every sensors off
+ */
+static void hello() {
+    uint8_t frames[] = { HELLO, FULL_STATE, state_seq++, 0, 0, 0, 0, READY };
+    send_bytes(frames, sizeof(frames));
+    ready = true;
+}
+
+static void handle_input(uint8_t c) {
+    if(pending_opcode) {
+        if(c == 0 && pending_opcode == SET_SWITCH_ON)  last_command = 1;
+        if(c == 0 && pending_opcode == SET_SWITCH_OFF) last_command = 0;
+        pending_opcode = 0;
+        return;
+    }
+
+    switch(c) {
+        case SET_SWITCHES:
+        case SET_SWITCH_ON:
+        case SET_SWITCH_OFF:
+            pending_opcode = c;
+            break;
+
+        case RESET:
+            hello();
+            break;
+    }
+}
+
+/**
+ * Handles raild output for up to `timeout` ms
+ * Returns as soon as `command` is seen if it is not -1.
+ */
+static bool wait_input(double timeout, int command) {
+    double deadline = now_ms() + timeout;
+
+    while(1) {
+        double now = now_ms();
+        if(now >= next_keep_alive) {
+            next_keep_alive = now + KEEP_ALIVE_INTERVAL;
+            if(ready) send_byte(KEEP_ALIVE);
+        }
+
+        int left = (int) (deadline - now);
+        if(left < 0) return false;
+
+        struct pollfd pfd = { .fd = pty, .events = POLLIN };
+        if(poll(&pfd, 1, left < KEEP_ALIVE_INTERVAL ? left : KEEP_ALIVE_INTERVAL) < 0 && errno != EINTR) {
+            fatal("poll");
+        }
+
+        if(pfd.revents & POLLIN) {
+            uint8_t buffer[256];
+            ssize_t len = read(pty, buffer, sizeof(buffer));
+            if(len < 0 && errno != EAGAIN && errno != EIO) fatal("read");
+            for(ssize_t i = 0; i < len; i++) {
+                handle_input(buffer[i]);
+            }
+
+            if(command >= 0 && last_command == command) return true;
+        }
+    }
+}
+
+static const char *open_pty() {
+    pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0) fatal("posix_openpt");
+
+    const char *path = ptsname(pty);
+    if(!path) fatal("ptsname");
+
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if(slave < 0) fatal(path);
+
+    struct termios options;
+    tcgetattr(slave, &options);
+    cfmakeraw(&options);
+    tcsetattr(slave, TCSANOW, &options);
+
+    return path;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int) (p / 100 * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options] -- raild [raild options]\n"
+        "  -n samples  number of samples (default 10000)\n"
+        "  -i ms       interval between samples (default 2)\n"
+        "  -w ms       warm-up delay after READY (default 1000)\n"
+        "  -l path     symlink the pty to this path (default /tmp/raild-bench-hub)\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "n:i:w:l:")) != -1) {
+        switch(opt) {
+            case 'n': opt_samples = atoi(optarg); break;
+            case 'i': opt_interval = atoi(optarg); break;
+            case 'w': opt_warmup = atoi(optarg); break;
+            case 'l': opt_link = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(optind >= argc || opt_samples < 1) usage(argv[0]);
+
+    const char *path = open_pty();
+    unlink(opt_link);
+    if(symlink(path, opt_link) < 0) fatal(opt_link);
+
+    child = fork();
+    if(child < 0) fatal("fork");
+    if(child == 0) {
+        // raild logs would mix with results
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0) dup2(null, STDOUT_FILENO);
+        execvp(argv[optind], argv + optind);
+        perror(argv[optind]);
+        _exit(1);
+    }
+
+    // raild resets the hub on startup
+    next_keep_alive = now_ms() + KEEP_ALIVE_INTERVAL;
+    double deadline = now_ms() + 10000;
+    while(!ready) {
+        if(now_ms() > deadline) {
+            fprintf(stderr, "latency: raild did not reset the hub\n");
+            kill(child, SIGTERM);
+            return 1;
+        }
+        wait_input(100, -1);
+    }
+    wait_input(opt_warmup, -1);
+
+    double *samples = malloc(opt_samples * sizeof(double));
+    int count = 0, lost = 0;
+
+    for(int i = 0; i < opt_samples; i++) {
+        int state = !(i & 1);
+        uint8_t frame[] = { SENSORS_1, state_seq++, state };
+
+        last_command = -1;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        send_bytes(frame, sizeof(frame));
+
+        if(wait_input(SAMPLE_TIMEOUT, state)) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples[count++] = (end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_nsec - begin.tv_nsec) / 1e3;
+        } else {
+            lost++;
+        }
+
+        wait_input(opt_interval, -1);
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    unlink(opt_link);
+
+    if(count == 0) {
+        printf("{\"bench\":\"sensor_to_switch\",\"samples\":0,\"lost\":%d}\n", lost);
+        return 1;
+    }
+
+    double sum = 0;
+    for(int i = 0; i < count; i++) sum += samples[i];
+    qsort(samples, count, sizeof(double), compare);
+
+    printf("{\"bench\":\"sensor_to_switch\",\"samples\":%d,\"lost\":%d,"
+           "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           count, lost, sum / count,
+           percentile(samples, count, 50), percentile(samples, count, 99),
+           percentile(samples, count, 99.9), samples[count - 1]);
+    return 0;
+}
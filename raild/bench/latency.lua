@@ -0,0 +1,14 @@
+--
+-- Script of the end-to-end latency harness, see latency.c
+--
+-- Switch 1 follows sensor 1: the harness measures the time between a
+-- sensor frame and the matching SET_SWITCH_* command.
+--
+load "lua/sensors.lua"
+
+-- Measure the event path, not the debounce delay
+Sensors.debounce = 0
+
+Sensors[1].On("Edge", function(state)
+    SetSwitch(1, state)
+end)
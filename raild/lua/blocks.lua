@@ -0,0 +1,69 @@
+--
+-- Blocks of track
+--
+-- A block is a set of sensors, occupied while any of them is active.
+-- Occupancy is tracked by raild itself (see interlock.c), blocks emit
+-- "Occupied" and "Free" events, as does the global Blocks object.
+--
+Blocks = EventEmitter()
+
+local block_mt = { __tostring = function() return "[object Block]" end }
+
+-- Returns the id of a sensor given by id or object
+local function sensor_id(sen)
+    if type(sen) == "number" then return sen end
+    if not Sensors.IsSensor(sen) then
+        error("invalid sensor given to Blocks.Define()")
+    end
+    return sen.GetId()
+end
+
+-- Declare a new block from its sensors
+function Blocks.Define(...)
+    local ids = {}
+    for i = 1, select("#", ...) do
+        ids[i] = sensor_id(select(i, ...))
+    end
+
+    local id = InterlockBlock(unpack(ids))
+    local self = setmetatable(EventEmitter(), block_mt)
+
+    function self.GetId() return id end
+    function self.IsOccupied() return IsBlockOccupied(id) end
+
+    Blocks[id] = self
+    return self
+end
+
+On("Interlock", function(event, id)
+    if event == "Occupied" or event == "Free" then
+        local block = Blocks[id]
+        if block then
+            block.Emit(event)
+            Blocks.Emit(event, block)
+        end
+    end
+end)
+
+--
+-- Declarative circuit topology
+--
+--   Topology {
+--       switches = { [1] = { 1, 9, 17 }, [2] = { 2, 10, 18 } },
+--       blocks   = { { 6, 7 }, { 14, 15 } }
+--   }
+--
+-- Switches are enabled with their A, B and C sensors, and blocks are
+-- defined in order. Returns the list of blocks.
+--
+function Topology(def)
+    for id, sensors in pairs(def.switches or {}) do
+        Switches[id].Enable(unpack(sensors))
+    end
+
+    local blocks = {}
+    for i, sensors in ipairs(def.blocks or {}) do
+        blocks[i] = Blocks.Define(unpack(sensors))
+    end
+    return blocks
+end
@@ -6,20 +6,33 @@ JSON = {}
 -- Null value
 -- Used as placeholder for nil in tables because Lua tables
 -- cannot hold a nil value
-JSON.null = {}
+-- The __json field of metatables is used by the native encoder
+JSON.null = setmetatable({}, { __json = "null" })
 
 -- Mark table as object
-local object_mt = { __tostring = function() return "[object JSONObject]" end }
+local object_mt = { __tostring = function() return "[object JSONObject]" end, __json = "object" }
 function JSON.Object(table)
     return setmetatable(table, object_mt)
 end
 
 -- Mark table as array
-local array_mt = { __tostring = function() return "[object JSONArray]" end }
+local array_mt = { __tostring = function() return "[object JSONArray]" end, __json = "array" }
 function JSON.Array(table)
     return setmetatable(table, array_mt)
 end
 
+--
+-- JSON.EncodeFast
+-- Native encoder, writes into a reusable buffer and escapes strings
+--
+JSON.EncodeFast = JSONEncode
+
+--
+-- JSON.EncodeEvent(event, id[, state])
+-- Native encoder for fixed-shape { event, id, state } messages
+--
+JSON.EncodeEvent = JSONEncodeEvent
+
 --
 -- JSON.Encode
 --
@@ -4,6 +4,7 @@ load "lua/time.lua"
 -- Model utilities
 load "lua/sensors.lua"
 load "lua/switches.lua"
+load "lua/blocks.lua"
 
 -- RailMon bindings
 load "lua/json.lua"
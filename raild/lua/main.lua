@@ -27,18 +27,18 @@ Sensors[22].On("Rising", function()
     end
 end)
 
-Sensors[17].On("Rising", function()
-    segment.Push()
+Sensors[17].On("Rising", function(time)
+    segment.Push(time)
 end)
 
-Switches[2].On("EnterC", function()
+Switches[2].On("EnterC", function(time)
     local fast
-    local t = segment.Shift()
+    local t = segment.Shift(time)
     if t < segment.Mean() then
         print("Fast", t, segment.Mean())
         if mayday then
             print("Mayday!")
-        elseif diff.Time() < (segment.Mean() * 2) then
+        elseif diff.Time(time) < (segment.Mean() * 2) then
             print("Too close")
             ok = false
         else
@@ -52,7 +52,7 @@ Switches[2].On("EnterC", function()
         else
             print("Slow", t, segment.Mean())
         end
-        diff.Reset()
+        diff.Reset(time)
         slow_loco = true
         Switches[2].SetState(true and not mayday)
     end
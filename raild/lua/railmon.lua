@@ -10,7 +10,15 @@ function RailMon.Bind()
     end)
 end
 
+-- Forward event loop statistics to this client every second
+function RailMon.BindStats()
+    On("Stats", function(stats)
+        send(JSON.EncodeFast({ event = "Stats", stats = stats }), "\n")
+    end)
+end
+
 -- Local Sync() cache
+-- Holds the encoded Sync message
 local sync_cache
 
 -- Emit event object with proper formatting
@@ -21,44 +29,66 @@ local function emit(event, obj, keep_cache)
     -- Delete cache if not told to keep it
     if not keep_cache then sync_cache = nil end
 
+    -- Nobody is listening, do not bother encoding
+    if not RailMon.HasHandlers("JSON") then return end
+
     -- Add event name and emit JSON
     obj.event = event
-    RailMon.Emit("JSON", JSON.Encode(obj))
+    RailMon.Emit("JSON", JSON.EncodeFast(obj))
+end
+
+-- Emit a fixed-shape { event, id, state } message without building a table
+local function emit_event(event, id, state)
+    sync_cache = nil
+    if not RailMon.HasHandlers("JSON") then return end
+    RailMon.Emit("JSON", JSON.EncodeEvent(event, id, state))
 end
 
 -- Emit from anywhere
 function RailMon.Send(event, obj)
     emit(event, obj, true)
+
+    -- Clients of the native WebSocket endpoint only receive circuit events
+    -- from C, custom events are forwarded from here
+    if WebSocketClients() > 0 then
+        obj = obj or {}
+        obj.event = event
+        WebSocketSend(JSON.EncodeFast(obj))
+    end
 end
 
 -- Get full circuit state for RailMon
 function RailMon.Sync()
     -- Check if cache is available
-    if sync_cache then emit("Sync", sync_cache, true) end
+    if sync_cache then
+        RailMon.Emit("JSON", sync_cache)
+        return
+    end
 
     local _sensors = {}
-    for i = 1, 24 do
+    for i = 1, SensorsCount() do
         _sensors[i] = Sensors[i].GetState()
     end
 
     local _switches = {}
     local _locks = {}
-    for i = 1, 8 do
+    for i = 1, SwitchesCount() do
         local switch = Switches[i]
         _switches[i] = switch:GetState()
         _locks[i] = switch:IsLocked()
     end
 
     -- Build cache
-    sync_cache = {
+    sync_cache = JSON.EncodeFast({
+        event = "Sync",
         switches = _switches,
         sensors = _sensors,
         locks = _locks,
         ready = IsHubReady(),
         power = IsPowered()
-    }
+    })
 
-    emit("Sync", sync_cache, true)
+    RailMon.Emit("JSON", sync_cache)
 end
 
 -------------------------------------------------------------------------------
@@ -77,23 +107,23 @@ On("Power", function(state)
 end)
 
 On("SwitchChange", function(i, s)
-    emit("SwitchChange", { id = i, state = s })
+    emit_event("SwitchChange", i, s)
 end)
 
 -------------------------------------------------------------------------------
 -- Bindings to Sensors
 -------------------------------------------------------------------------------
 Sensors.On("Edge", function(sen, s)
-    emit("SensorChange", { id = sen.GetId(), state = s })
+    emit_event("SensorChange", sen.GetId(), s)
 end)
 
 -------------------------------------------------------------------------------
 -- Bindings to Switches
 -------------------------------------------------------------------------------
 Switches.On("Lock", function(switch)
-    emit("SwitchLock", { id = switch.GetId() })
+    emit_event("SwitchLock", switch.GetId())
 end)
 
 Switches.On("Unlock", function(switch)
-    emit("SwitchUnlock", { id = switch.GetId() })
+    emit_event("SwitchUnlock", switch.GetId())
 end)
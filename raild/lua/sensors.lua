@@ -1,10 +1,14 @@
 --
 -- High-level sensors with built-in debounce
 --
-Sensors = EventEmitter({
-    -- Debounce delay (ms)
-    debounce = 50
-})
+-- Debounce is done by raild itself, edges only reach Lua once stable.
+-- Sensors.debounce is the default delay (ms) and can be changed at any time.
+--
+Sensors = EventEmitter()
+
+-- Default debounce delay (ms)
+local debounce = 50
+SetDefaultDebounce(debounce)
 
 local sensor_mt = { __tostring = function() return "[object Sensor]" end }
 
@@ -13,17 +17,39 @@ local sensor_mt = { __tostring = function() return "[object Sensor]" end }
 local handlers = {}
 
 -- Bind the event handler
-On("SensorChange", function(id, state)
-    if handlers[id] then
-        handlers[id](state)
+-- Every changed sensors of the port are dispatched from a single event
+local band, lshift = bit.band, bit.lshift
+On("SensorBatch", function(port, changed, value, time)
+    local base = (port - 1) * 8
+    for i = 0, 7 do
+        local mask = lshift(1, i)
+        if band(changed, mask) ~= 0 then
+            local handler = handlers[base + i + 1]
+            if handler then
+                handler(band(value, mask) ~= 0, time)
+            end
+        end
     end
 end)
 
 -- Create sensors lazily
 setmetatable(Sensors, {
+    __newindex = function(t, key, value)
+        if key == "debounce" then
+            debounce = value
+            SetDefaultDebounce(value)
+        else
+            rawset(t, key, value)
+        end
+    end,
+
     __index = function(_, id)
+        if id == "debounce" then
+            return debounce
+        end
+
         if type(id) ~= "number"
-        or id < 1 or id > 24 then
+        or id < 1 or id > SensorsCount() then
             error("invalid sensor id: " .. tostring(id))
         end
 
@@ -44,31 +70,27 @@ setmetatable(Sensors, {
         end
 
         -- Change cached state and emit event
-        local function update(new_state)
+        -- The time of the raw edge is given to handlers
+        local function update(new_state, time)
             state = new_state
-            emit("Edge", new_state)
-            emit(new_state and "Rising" or "Falling")
+            emit("Edge", new_state, time)
+            emit(new_state and "Rising" or "Falling", time)
         end
 
-        -- Debounce sensor state change
-        local delay
-        local function handler(new_state)
-            -- Cancel previous timer
-            CancelTimer(delay)
-
-            -- Update state if needed
+        -- Edges are already debounced by raild
+        local function handler(new_state, time)
             if state ~= new_state then
-                local debounce = Sensors.debounce
-                if debounce > 0 then
-                    delay = CreateTimer(debounce, 0, function()
-                        update(new_state)
-                    end)
-                else
-                    update(new_state)
-                end
+                update(new_state, time)
             end
         end
 
+        -- Set a specific debounce delay (ms) for this sensor
+        -- A nil delay reverts to Sensors.debounce
+        function self.SetDebounce(ms)
+            SetSensorDebounce(id, ms)
+            return self
+        end
+
         -- Enable this sensor
         function self.Enable()
             if enabled then return else enabled = true end
@@ -1,13 +1,30 @@
 --
 -- Auto-managed switches
 --
-Switches = EventEmitter({
-    -- Delay before unlocking the switch (ms)
-    debounce = 50
-})
+-- Locking is done by raild itself (see interlock.c): switches are locked
+-- by trains going through them and the power is cut if another train
+-- shows up meanwhile. Switch objects receive the resulting events to
+-- implement the routing policy.
+--
+Switches = EventEmitter()
+
+-- Delay before unlocking a switch (ms)
+local debounce = 50
+SetInterlockDelay(debounce)
 
 local switch_mt = { __tostring = function() return "[object Switch]" end }
 
+-- Dispatch engine events to switch objects
+-- Block events are handled by blocks.lua
+local handlers = {}
+On("Interlock", function(event, id, arg, time)
+    local handler = handlers[event]
+    if handler then
+        local switch = rawget(Switches, id)
+        if switch then handler(switch, arg, time) end
+    end
+end)
+
 -- Lazy sensor creation
 --
 --      (A) (B)
@@ -19,102 +36,49 @@ local switch_mt = { __tostring = function() return "[object Switch]" end }
 --      (C)
 --
 setmetatable(Switches, {
+    __newindex = function(t, key, value)
+        if key == "debounce" then
+            debounce = value
+            SetInterlockDelay(value)
+        else
+            rawset(t, key, value)
+        end
+    end,
+
     __index = function(_, id)
+        if id == "debounce" then
+            return debounce
+        end
+
         if type(id) ~= "number"
-        or id < 1 or id > 8 then
-            error("invalid switch id: " .. id)
+        or id < 1 or id > SwitchesCount() then
+            error("invalid switch id: " .. tostring(id))
         end
 
         -- The switch object
         local self = setmetatable(EventEmitter(), switch_mt)
-        local enabled = false
-        local state = false
-        local pending_state = false
-        local locked = false
-
-        local senA, senB, senC
-        local enter_sensor, exit_sensor
-        local delay
 
         -- Accessors
         function self.GetId() return id end
-        function self.GetState() return state end
-        function self.IsEnabled() return enabled end
-        function self.IsLocked() return locked end
+        function self.GetState()
+            local enabled, state = InterlockGetSwitch(id)
+            if enabled then return state else return GetSwitch(id) end
+        end
+        function self.IsEnabled() return (InterlockGetSwitch(id)) end
+        function self.IsLocked()
+            local _, _, locked = InterlockGetSwitch(id)
+            return locked
+        end
 
         -- Emit event on both the switch itself and the global Switches object
-        local function emit(event, ...)
+        function self.__emit(event, ...)
             self.Emit(event, ...)
             Switches.Emit(event, self, ...)
         end
 
-        -- Unlock this switch
-        local function unlock()
-            locked = false
-            enter_sensor = nil
-            exit_sensor = nil
-            emit("Unlock")
-            self.SetState(pending_state)
-        end
-
-        -- Handle sensor events
-        local function handler(sen, rising)
-            -- Only react to related sensors
-            if sen == senA
-            or sen == senB
-            or sen == senC then
-                if locked then
-                    if sen == exit_sensor then
-                        -- Falling or rising edge on exit sensor
-                        if rising then
-                            -- Rising edge, cancel the unlock delay
-                            CancelTimer(delay)
-                        else
-                            -- Falling edge, delay unlock
-                            delay = CreateTimer(Switches.debounce, 0, unlock)
-                        end
-                    else
-                        -- Activity on another sensor
-                        if  rising
-                        and sen ~= enter_sensor
-                        and sen ~= exit_sensor then
-                            -- The current train has nothing to do with this
-                            -- sensor, power-offing
-                            SetPower(false)
-                            print("detected activity on bad sensorID, power-offing")
-                            emit("BadSensor", sen)
-                        end
-                    end
-                elseif rising then
-                    -- Rising edge,  lock this switch
-                    if sen == senA then
-                        -- (A) -> (C)
-                        emit("EnterA")
-                        enter_sensor = senA
-                        exit_sensor = senC
-                        self.SetState(false)
-                    elseif sen == senB then
-                        -- (B) -> (C)
-                        emit("EnterB")
-                        enter_sensor = senB
-                        exit_sensor = senC
-                        self.SetState(true)
-                    else
-                        -- (C) -> (A|B)
-                        emit("EnterC")
-                        enter_sensor = senC
-                        exit_sensor = state and senB or senA
-                    end
-
-                    locked = true
-                    emit("Lock")
-                end
-            end
-        end
-
         -- Enable this switch and bind it to given sensors
         function self.Enable(a, b, c)
-            if enabled then
+            if self.IsEnabled() then
                 error("attempt to enable an already enabled switch")
             end
 
@@ -130,49 +94,34 @@ setmetatable(Switches, {
                 error("invalid arguments given to switch.Enable()")
             end
 
-            -- Save them
-            senA, senB, senC = a, b, c
-
-            -- Sync switch state
-            enabled = true
-            state = GetSwitch(id)
-            pending_state = state
-            locked = false
-
-            -- Register handler
-            Sensors.On("Edge", handler)
-
-            emit("Enable")
+            InterlockSwitch(id, a.GetId(), b.GetId(), c.GetId())
+            self.__emit("Enable")
             return self
         end
 
-        -- Disable this switch
+        -- Disable this switch, unlocking it
         function self.Disable()
-            -- Remove binding to sensors
-            Sensors.Off("Edge", handler)
-
-            -- Cleanup potential timer
-            CancelTimer(delay)
-
-            -- Unlock this switch
-            unlock()
-
-            enabled = false
-            emit("Disable")
+            InterlockRelease(id)
+            self.__emit("Disable")
             return self
         end
 
+        -- Suspends the running task until this switch is unlocked
+        -- Returns false if still locked after `timeout` milliseconds
+        function self.WaitUnlock(timeout)
+            if not self.IsLocked() then return true end
+            return (WaitEvent(self, "Unlock", timeout))
+        end
+
         -- Set the switch in a given position
+        -- A locked switch only moves once unlocked
         function self.SetState(new_state)
-            if locked then
-                -- Store the state for later
-                pending_state = new_state
-            elseif state ~= new_state then
-                -- Update state
-                state = new_state
-                pending_state = new_state
+            new_state = new_state and true or false
+            if self.IsEnabled() then
+                InterlockSetState(id, new_state)
+            elseif GetSwitch(id) ~= new_state then
                 SetSwitch(id, new_state)
-                emit("Change", new_state)
+                self.__emit("Change", new_state)
             end
             return self
         end
@@ -182,3 +131,12 @@ setmetatable(Switches, {
         return self
     end
 })
+
+-- Engine events, with the arguments given to handlers
+handlers.EnterA = function(switch, _, time) switch.__emit("EnterA", time) end
+handlers.EnterB = function(switch, _, time) switch.__emit("EnterB", time) end
+handlers.EnterC = function(switch, _, time) switch.__emit("EnterC", time) end
+handlers.Lock   = function(switch) switch.__emit("Lock") end
+handlers.Unlock = function(switch) switch.__emit("Unlock") end
+handlers.Change = function(switch, state) switch.__emit("Change", state ~= 0) end
+handlers.BadSensor = function(switch, sensor) switch.__emit("BadSensor", Sensors[sensor]) end
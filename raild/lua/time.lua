@@ -1,5 +1,6 @@
 --
--- Get current time
+-- Get current wall-clock time
+-- Use Now() for durations, this one jumps on clock adjustments
 --
 local ffi = require("ffi")
 ffi.cdef[[
@@ -23,44 +24,65 @@ end
 --
 -- Chrono helper
 --
+-- Chrono uses the monotonic time from Now(). Every functions accept an
+-- optional timestamp, such as the one given with sensor events, to measure
+-- when things happened instead of when the handler runs.
+--
+-- Measured durations are kept in a native Rolling window, so reading
+-- statistics takes constant time whatever the window size. Pending pushes
+-- wait in a FIFO of their own, never dropped, so that every shift is paired
+-- with its own push.
+--
 function Chrono(window)
     window = window or 10
 
     local self = {}
-    local start = Time()
-    local history = {}
-    local queue = {}
-    local cache_mean = nil
+    local start = Now()
+    local history = Rolling(window)
+    local queue, first, last = {}, 1, 0
 
-    function self.Reset()
-        start = Time()
+    function self.Reset(now)
+        start = now or Now()
     end
 
-    function self.Time()
-        return Time() - start
+    function self.Time(now)
+        return (now or Now()) - start
     end
 
-    function self.Push()
-        table.insert(queue, Time())
+    function self.Push(now)
+        last = last + 1
+        queue[last] = now or Now()
     end
 
-    function self.Shift()
-        if #queue < 1 then return 0/0 end
-        local t = Time() - table.remove(queue, 1)
-        table.insert(history, t)
-        cache_mean = nil
-        if #history > window then
-            table.remove(history, 1)
-        end
+    function self.Shift(now)
+        if first > last then return 0/0 end
+        local t = (now or Now()) - queue[first]
+        queue[first] = nil
+        first = first + 1
+        history:Push(t)
         return t
     end
 
+    -- Statistics of the last `window` durations, NaN until the first shift
     function self.Mean()
-        if cache_mean then return cache_mean end
-        local sum = 0
-        for i = 1, #history do sum = sum + history[i] end
-        cache_mean = sum / #history
-        return cache_mean
+        return history:Mean()
+    end
+
+    function self.Variance()
+        return history:Variance()
+    end
+
+    function self.Min()
+        return history:Min()
+    end
+
+    function self.Max()
+        return history:Max()
+    end
+
+    -- Approximate p-th percentile, 0 to 100
+    function self.Percentile(p)
+        return history:Percentile(p)
     end
 
     return self
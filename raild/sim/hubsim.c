@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <hub_opcodes.h>
+
+/**
+ * RailHub simulator
+ *
+ * Speaks the RailHub protocol on a pseudo-terminal so that raild can be
+ * run and load tested without any hardware:
+ *
+ *   ./hubsim -l /tmp/railhub -t 4 -x 10 &
+ *   ./raild -u /tmp/railhub lua/load.lua
+ *
+ * The simulated hub behaves like the firmware: it sends HELLO on startup
+ * and after every RESET, then a FULL_STATE frame and READY. It exchanges
+ * KEEP_ALIVE with raild and stops sending state if raild goes silent.
+ * Switch commands update the switches port and are echoed back in the
+ * next FULL_STATE frame.
+ *
+ * Sensor traffic comes from virtual trains running on a topology, either
+ * a loop over the 24 sensors or one read from a file (-f). Topology files
+ * have one node per line, lines starting with # are ignored:
+ *
+ *   <label> sensor <id> <length> <next>
+ *   <label> switch <id> <next if false> <next if true>
+ *   train <label>
+ *
+ * Sensor nodes are followed by <length> cm of track up to the next node.
+ * Switch nodes have no length and send trains to one of their exits
+ * depending on the current state of the switch. Train lines set the node
+ * where each train starts, trains are spread over the layout otherwise.
+ *
+ * A sensor is active while the head of a train is less than the train
+ * length past it. Trains only run while track power is on, at their speed
+ * multiplied by the acceleration factor (-x).
+ *
+ * The number of sensor edges generated is reported every second.
+ */
+
+// Limits
+#define MAX_NODES   128
+#define MAX_TRAINS  32
+#define LABEL_LEN   32
+
+// Interval between KEEP_ALIVE sent to raild (ms)
+#define KEEP_ALIVE_INTERVAL 250
+
+// Number of KEEP_ALIVE without answer before the hub is dead
+#define KEEP_ALIVE_MISSES 3
+
+typedef enum {
+    NODE_SENSOR,
+    NODE_SWITCH
+} node_type;
+
+typedef struct {
+    char      label[LABEL_LEN];
+    node_type type;
+    int       id;       // Sensor (1-24) or switch (1-8) id
+    double    length;   // Track length after a sensor node (cm)
+    int       next[2];  // Next node, or exits of a switch
+    char      next_label[2][LABEL_LEN];
+} node;
+
+typedef struct {
+    int    node; // Last sensor node passed
+    double pos;  // Distance travelled since this node (cm)
+} train;
+
+static node nodes[MAX_NODES];
+static int  nodes_count = 0;
+
+static train trains[MAX_TRAINS];
+static int   trains_count = 0;
+
+// Options
+static int    opt_trains = 1;
+static double opt_speed  = 30;  // cm/s
+static double opt_accel  = 1;
+static double opt_length = 20;  // cm
+static int    opt_tick   = 1;   // ms
+static bool   opt_verbose = false;
+
+// Pty master
+static int pty = -1;
+
+// Hub state
+static bool    ready = false;
+static bool    dead = false;
+static bool    power = false;
+static uint8_t sensors[3];
+static uint8_t switches = 0x00;
+static uint8_t state_seq = 0;
+static int     keep_alive_misses = 0;
+
+// Opcode waiting for its argument byte, 0 if none
+static uint8_t pending_opcode = 0;
+
+// Statistics
+static unsigned long edges = 0;
+static unsigned long frames = 0;
+
+/**
+ * Current monotonic time in milliseconds
+ */
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void fatal(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+//---------------------------------------------------------------------------//
+// Topology
+//---------------------------------------------------------------------------//
+
+static int find_node(const char *label) {
+    for(int i = 0; i < nodes_count; i++) {
+        if(strcmp(nodes[i].label, label) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Default topology: a single loop over every sensors
+ */
+static void default_topology() {
+    for(int i = 0; i < 24; i++) {
+        node *n = &nodes[nodes_count++];
+        snprintf(n->label, LABEL_LEN, "s%d", i + 1);
+        n->type    = NODE_SENSOR;
+        n->id      = i + 1;
+        n->length  = 50;
+        n->next[0] = (i + 1) % 24;
+    }
+}
+
+/**
+ * Loads a topology file
+ */
+static void load_topology(const char *path) {
+    FILE *file = fopen(path, "r");
+    if(!file) fatal(path);
+
+    char start[MAX_TRAINS][LABEL_LEN];
+    int  starts = 0;
+
+    char line[256];
+    int  lineno = 0;
+    while(fgets(line, sizeof(line), file)) {
+        lineno++;
+
+        char label[LABEL_LEN], kind[16];
+        if(line[0] == '#' || sscanf(line, "%31s", label) != 1) continue;
+
+        if(strcmp(label, "train") == 0) {
+            if(starts < MAX_TRAINS && sscanf(line, "%*s %31s", start[starts]) == 1) {
+                starts++;
+            }
+            continue;
+        }
+
+        if(nodes_count == MAX_NODES) {
+            fprintf(stderr, "%s: too many nodes\n", path);
+            exit(1);
+        }
+
+        node *n = &nodes[nodes_count];
+        bool ok = false;
+        if(sscanf(line, "%*s %15s", kind) == 1) {
+            strcpy(n->label, label);
+            if(strcmp(kind, "sensor") == 0) {
+                n->type = NODE_SENSOR;
+                ok = sscanf(line, "%*s %*s %d %lf %31s", &n->id, &n->length, n->next_label[0]) == 3
+                  && n->id >= 1 && n->id <= 24 && n->length > 0;
+            } else if(strcmp(kind, "switch") == 0) {
+                n->type = NODE_SWITCH;
+                ok = sscanf(line, "%*s %*s %d %31s %31s", &n->id, n->next_label[0], n->next_label[1]) == 3
+                  && n->id >= 1 && n->id <= 8;
+            }
+        }
+
+        if(!ok) {
+            fprintf(stderr, "%s:%d: invalid node\n", path, lineno);
+            exit(1);
+        }
+        nodes_count++;
+    }
+    fclose(file);
+
+    // Resolve labels
+    for(int i = 0; i < nodes_count; i++) {
+        node *n = &nodes[i];
+        for(int j = 0; j < (n->type == NODE_SWITCH ? 2 : 1); j++) {
+            if((n->next[j] = find_node(n->next_label[j])) < 0) {
+                fprintf(stderr, "%s: unknown node '%s'\n", path, n->next_label[j]);
+                exit(1);
+            }
+        }
+    }
+
+    for(int i = 0; i < starts; i++) {
+        int id = find_node(start[i]);
+        if(id < 0 || nodes[id].type != NODE_SENSOR) {
+            fprintf(stderr, "%s: trains must start on a sensor node\n", path);
+            exit(1);
+        }
+        trains[trains_count].node = id;
+        trains[trains_count].pos = 0;
+        trains_count++;
+    }
+}
+
+/**
+ * Spreads trains over sensor nodes when none were placed by the topology
+ */
+static void place_trains() {
+    if(trains_count > 0) return;
+
+    int sensor_nodes[MAX_NODES];
+    int count = 0;
+    for(int i = 0; i < nodes_count; i++) {
+        if(nodes[i].type == NODE_SENSOR) sensor_nodes[count++] = i;
+    }
+
+    if(count == 0) {
+        fprintf(stderr, "topology has no sensor\n");
+        exit(1);
+    }
+
+    for(int i = 0; i < opt_trains && i < MAX_TRAINS; i++) {
+        trains[i].node = sensor_nodes[i * count / opt_trains];
+        trains[i].pos  = 0;
+        trains_count++;
+    }
+}
+
+/**
+ * Returns the sensor node following a node, going through switches
+ */
+static int next_sensor(int id) {
+    // Bounded to protect against loops made only of switches
+    for(int hops = 0; hops <= nodes_count; hops++) {
+        node *n = &nodes[id];
+        if(n->type == NODE_SWITCH) {
+            id = n->next[(switches >> (n->id - 1)) & 1];
+        } else if(hops > 0) {
+            return id;
+        } else {
+            id = n->next[0];
+        }
+    }
+
+    fprintf(stderr, "topology has a loop without sensor\n");
+    exit(1);
+}
+
+/**
+ * Moves trains forward by `dt` ms and computes the sensors state
+ */
+static void run_trains(double dt, uint8_t *state) {
+    memset(state, 0, 3);
+
+    for(int i = 0; i < trains_count; i++) {
+        train *t = &trains[i];
+
+        if(power) {
+            t->pos += opt_speed * opt_accel * dt / 1000.0;
+            while(t->pos >= nodes[t->node].length) {
+                t->pos -= nodes[t->node].length;
+                t->node = next_sensor(t->node);
+            }
+        }
+
+        if(t->pos < opt_length) {
+            int sid = nodes[t->node].id - 1;
+            state[sid / 8] |= 1 << (sid % 8);
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Protocol
+//---------------------------------------------------------------------------//
+
+static void send_bytes(const uint8_t *data, int len) {
+    while(len > 0) {
+        ssize_t n = write(pty, data, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) {
+                // raild is not reading, drop the rest like a saturated line
+                return;
+            }
+            fatal("write");
+        }
+        data += n;
+        len  -= n;
+    }
+}
+
+static void send_byte(uint8_t c) {
+    send_bytes(&c, 1);
+}
+
+static void send_port(uint8_t opcode, uint8_t value) {
+    uint8_t frame[] = { opcode, state_seq++, value };
+    send_bytes(frame, sizeof(frame));
+    frames++;
+}
+
+static void send_state() {
+    uint8_t frame[] = {
+        FULL_STATE, state_seq++, sensors[0], sensors[1], sensors[2], switches
+    };
+    send_bytes(frame, sizeof(frame));
+    frames++;
+}
+
+/**
+ * Startup sequence of the firmware
+ */
+static void hello() {
+    ready = false;
+    dead = false;
+    pending_opcode = 0;
+    keep_alive_misses = 0;
+
+    if(opt_verbose) fprintf(stderr, "hubsim: HELLO\n");
+    send_byte(HELLO);
+    send_state();
+    send_byte(READY);
+    ready = true;
+}
+
+static void handle_input(uint8_t c) {
+    // Argument of a previous opcode
+    if(pending_opcode) {
+        uint8_t old = switches;
+        switch(pending_opcode) {
+            case SET_SWITCHES:   switches = c; break;
+            case SET_SWITCH_ON:  if(c < 8) switches |= (1 << c); break;
+            case SET_SWITCH_OFF: if(c < 8) switches &= ~(1 << c); break;
+        }
+        pending_opcode = 0;
+
+        if(switches != old && ready && !dead) send_state();
+        return;
+    }
+
+    switch(c) {
+        case GET_SENSORS_1: send_port(SENSORS_1, sensors[0]); break;
+        case GET_SENSORS_2: send_port(SENSORS_2, sensors[1]); break;
+        case GET_SENSORS_3: send_port(SENSORS_3, sensors[2]); break;
+        case GET_SWITCHES:  send_port(SWITCHES,  switches);   break;
+
+        case SET_SWITCHES:
+        case SET_SWITCH_ON:
+        case SET_SWITCH_OFF:
+            pending_opcode = c;
+            break;
+
+        case POWER_ON:  power = true;  break;
+        case POWER_OFF: power = false; break;
+
+        case KEEP_ALIVE:
+            keep_alive_misses = 0;
+            break;
+
+        case RESET:
+            if(opt_verbose) fprintf(stderr, "hubsim: RESET\n");
+            hello();
+            break;
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Main
+//---------------------------------------------------------------------------//
+
+/**
+ * Opens the pty and returns the path of its slave side
+ */
+static const char *open_pty() {
+    pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0) fatal("posix_openpt");
+
+    const char *path = ptsname(pty);
+    if(!path) fatal("ptsname");
+
+    // Keep the slave open ourselves so that the master does not hang up
+    // while raild is restarted, and make it raw until raild configures it
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if(slave < 0) fatal(path);
+
+    struct termios options;
+    tcgetattr(slave, &options);
+    cfmakeraw(&options);
+    tcsetattr(slave, TCSANOW, &options);
+
+    return path;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -l path    symlink the pty to this path\n"
+        "  -f file    topology file, defaults to a loop over the 24 sensors\n"
+        "  -t trains  number of trains (default 1)\n"
+        "  -s speed   train speed in cm/s (default 30)\n"
+        "  -L length  train length in cm (default 20)\n"
+        "  -x factor  acceleration factor (default 1)\n"
+        "  -r tick    simulation step in ms (default 1)\n"
+        "  -p         start with track power on\n"
+        "  -v         verbose\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *link_path = NULL;
+    const char *topology = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "l:f:t:s:L:x:r:pv")) != -1) {
+        switch(opt) {
+            case 'l': link_path = optarg; break;
+            case 'f': topology = optarg; break;
+            case 't': opt_trains = atoi(optarg); break;
+            case 's': opt_speed = atof(optarg); break;
+            case 'L': opt_length = atof(optarg); break;
+            case 'x': opt_accel = atof(optarg); break;
+            case 'r': opt_tick = atoi(optarg); break;
+            case 'p': power = true; break;
+            case 'v': opt_verbose = true; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(opt_trains < 0 || opt_trains > MAX_TRAINS || opt_tick < 1) usage(argv[0]);
+
+    if(topology) {
+        load_topology(topology);
+    } else {
+        default_topology();
+    }
+    place_trains();
+
+    const char *path = open_pty();
+    if(link_path) {
+        unlink(link_path);
+        if(symlink(path, link_path) < 0) fatal(link_path);
+        path = link_path;
+    }
+
+    fprintf(stderr, "hubsim: listening on %s, %d train(s), %d node(s)\n",
+            path, trains_count, nodes_count);
+
+    hello();
+
+    double last = now_ms();
+    double next_keep_alive = last + KEEP_ALIVE_INTERVAL;
+    double next_report = last + 1000;
+
+    while(1) {
+        struct pollfd pfd = { .fd = pty, .events = POLLIN };
+        if(poll(&pfd, 1, opt_tick) < 0 && errno != EINTR) fatal("poll");
+
+        if(pfd.revents & POLLIN) {
+            uint8_t buffer[256];
+            ssize_t len = read(pty, buffer, sizeof(buffer));
+            if(len < 0 && errno != EAGAIN && errno != EIO) fatal("read");
+            for(ssize_t i = 0; i < len; i++) {
+                handle_input(buffer[i]);
+            }
+        }
+
+        double now = now_ms();
+
+        // Move trains and send every ports changed during this step at once
+        uint8_t state[3];
+        run_trains(now - last, state);
+        last = now;
+
+        bool changed = false;
+        for(int i = 0; i < 3; i++) {
+            if(state[i] != sensors[i]) {
+                edges += __builtin_popcount(state[i] ^ sensors[i]);
+                sensors[i] = state[i];
+                changed = true;
+            }
+        }
+
+        if(changed && ready && !dead) {
+            send_state();
+        }
+
+        if(now >= next_keep_alive) {
+            next_keep_alive = now + KEEP_ALIVE_INTERVAL;
+            if(ready && !dead) {
+                if(++keep_alive_misses > KEEP_ALIVE_MISSES) {
+                    // Like the firmware, only wait for a RESET from now on
+                    fprintf(stderr, "hubsim: raild gone, waiting for RESET\n");
+                    dead = true;
+                } else {
+                    send_byte(KEEP_ALIVE);
+                }
+            }
+        }
+
+        if(now >= next_report) {
+            next_report = now + 1000;
+            fprintf(stderr, "hubsim: %lu edges/s, %lu frames/s%s%s\n",
+                    edges, frames, power ? "" : " (power off)", dead ? " (dead)" : "");
+            edges = 0;
+            frames = 0;
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#include "raild.h"
+#include <luajit-2.0/lua.h>
+#include <luajit-2.0/lauxlib.h>
+
+/**
+ * Compiled chunks cache
+ *
+ * API clients send the same commands over and over again. Compiled chunks
+ * are kept in a small LRU cache indexed by the FNV-1a hash of their source,
+ * so that they are only parsed once.
+ *
+ * A cache belongs to a single Lua state, whose registry holds references
+ * to the compiled functions: the control state has one for chunks running
+ * in the event loop, and every API client state of the worker has its own.
+ * Caches are thus never shared between threads.
+ */
+
+// Number of compiled chunks kept in cache
+#define CHUNK_CACHE_SIZE 32
+
+// Bigger chunks are always compiled and never cached
+#define CHUNK_CACHE_MAX_CHUNK 1024
+
+// A compiled chunk
+typedef struct {
+    uint32_t  hash;   // FNV-1a hash of the source
+    size_t    length; // Source length
+    char     *source; // Copy of the source, to check for hash collisions
+    int       ref;    // Registry reference to the compiled function
+    uint32_t  used;   // Last use time, for LRU eviction
+} chunk_entry;
+
+struct chunk_cache {
+    chunk_entry entries[CHUNK_CACHE_SIZE];
+    uint32_t    clock;
+    uint32_t    hits;
+    uint32_t    misses;
+};
+
+/**
+ * FNV-1a hash of a buffer
+ */
+static uint32_t hash_chunk(const char *buffer, size_t length) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) buffer[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Pushes the cached compiled function for a chunk
+ * Returns false if the chunk is not in cache.
+ */
+static bool cache_get(lua_State *L, chunk_cache *cache, uint32_t hash, const char *buffer, size_t length) {
+    for(int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+        chunk_entry *entry = &cache->entries[i];
+        if(entry->source
+        && entry->hash == hash
+        && entry->length == length
+        && memcmp(entry->source, buffer, length) == 0) {
+            entry->used = ++cache->clock;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Stores the compiled function on top of the stack in cache,
+ * evicting the least recently used chunk if needed
+ */
+static void cache_put(lua_State *L, chunk_cache *cache, uint32_t hash, const char *buffer, size_t length) {
+    if(length > CHUNK_CACHE_MAX_CHUNK) return;
+
+    chunk_entry *entry = &cache->entries[0];
+    for(int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+        if(!cache->entries[i].source) {
+            entry = &cache->entries[i];
+            break;
+        } else if(cache->entries[i].used < entry->used) {
+            entry = &cache->entries[i];
+        }
+    }
+
+    if(entry->source) {
+        luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+        free(entry->source);
+    }
+
+    entry->hash   = hash;
+    entry->length = length;
+    entry->source = malloc(length);
+    entry->used   = ++cache->clock;
+    memcpy(entry->source, buffer, length);
+
+    lua_pushvalue(L, -1);
+    entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+chunk_cache *chunk_cache_create() {
+    chunk_cache *cache = calloc(1, sizeof(chunk_cache));
+    if(!cache) {
+        perror("calloc");
+        exit(1);
+    }
+    return cache;
+}
+
+/**
+ * Frees a cache, its Lua state being closed
+ */
+void chunk_cache_free(chunk_cache *cache) {
+    for(int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+        free(cache->entries[i].source);
+    }
+    free(cache);
+}
+
+/**
+ * Pushes the compiled function of a chunk, from the cache or compiled
+ * Returns false with the error message pushed instead if it does not
+ * compile, like luaL_loadbuffer().
+ */
+bool chunk_cache_load(lua_State *L, chunk_cache *cache, const char *buffer, size_t length, const char *name) {
+    uint32_t hash = hash_chunk(buffer, length);
+
+    if(cache_get(L, cache, hash, buffer, length)) {
+        cache->hits++;
+        return true;
+    }
+
+    cache->misses++;
+    if(luaL_loadbuffer(L, buffer, length, name) != 0) {
+        return false;
+    }
+
+    cache_put(L, cache, hash, buffer, length);
+    return true;
+}
+
+void chunk_cache_stats(chunk_cache *cache, uint32_t *hits, uint32_t *misses) {
+    *hits   = cache->hits;
+    *misses = cache->misses;
+}
@@ -6,6 +6,15 @@
  *
  * This file contains helpers functions to encapsulate the epoll() API
  * to a simpler API restricted for usages required in raild.
+ *
+ * Events of watched fds are kept in a table indexed by fd, which is also
+ * the registry of script contexts: the context of an fd is its event.
+ *
+ * Every raild_event, for fds and timers, comes from a pool allocated by
+ * slabs and recycled through a free list, so no malloc happens once the
+ * pool is large enough. An event removed from epoll may still be in the
+ * batch being dispatched: it is only marked for purge and recycled by
+ * raild_epoll_collect() at the end of the loop iteration.
  */
 
 // Maximum time to wait for events before timeout
@@ -20,6 +29,48 @@ static int efd;
 // An epoll_events array used to store results from epoll_wait()
 struct epoll_event *epoll_events;
 
+// Number of events allocated at once by the pool
+#define EVENT_SLAB 64
+
+// Free events, linked by their ptr field
+static raild_event *free_events = NULL;
+
+// Events removed during this iteration, linked by their ptr field
+static raild_event *dead_events = NULL;
+
+// Watched events indexed by fd
+static raild_event **fds      = NULL;
+static int           fds_size = 0;
+
+/**
+ * Takes an event from the pool
+ * Fields are left uninitialized.
+ */
+raild_event *raild_event_alloc() {
+    if(!free_events) {
+        raild_event *slab = malloc(EVENT_SLAB * sizeof(raild_event));
+        if(!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for(int i = 0; i < EVENT_SLAB; i++) {
+            raild_event_free(&slab[i]);
+        }
+    }
+
+    raild_event *event = free_events;
+    free_events = (raild_event *) event->ptr;
+    return event;
+}
+
+/**
+ * Gives an event back to the pool
+ */
+void raild_event_free(raild_event *event) {
+    event->ptr  = free_events;
+    free_events = event;
+}
+
 /**
  * Creates a new epoll instance
  */
@@ -38,13 +89,17 @@ void raild_epoll_create() {
  */
 raild_event *raild_epoll_add(int fd, raild_event_type type) {
     // Create the raild_event object associated with this epoll instance
-    raild_event *event = malloc(sizeof(raild_event));
+    raild_event *event = raild_event_alloc();
     event->fd    = fd;
     event->type  = type;
+    event->priority = raild_event_priority(type);
     event->timer = false;
     event->n     = 0;
     event->ptr   = 0;
     event->purge = false;
+    event->slot  = -1;
+    event->readable = false;
+    event->writable = false;
 
     // Setting up everything required by epoll
     struct epoll_event epoll_ev;
@@ -52,6 +107,11 @@ raild_event *raild_epoll_add(int fd, raild_event_type type) {
     epoll_ev.data.ptr = event;   // Pointer to the raild_event object
     epoll_ev.events   = EPOLLIN; // Watching for reading-available events
 
+    // sysfs GPIO value files signal edges as priority data
+    if(type == RAILD_EV_GPIO) {
+        epoll_ev.events = EPOLLPRI | EPOLLERR;
+    }
+
     // Effectively add the fd to epoll
     int s = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &epoll_ev);
     if(s < 0) {
@@ -59,49 +119,104 @@ raild_event *raild_epoll_add(int fd, raild_event_type type) {
         exit(1);
     }
 
-    char *cls;
-    switch(type) {
-        case RAILD_EV_UART: cls = "UART"; break;
-        case RAILD_EV_UART_TIMER: cls = "UART_TIMER"; break;
-        case RAILD_EV_SERVER: cls = "API_SERVER"; break;
-        case RAILD_EV_SOCKET: cls = "API_CLIENT"; break;
-        case RAILD_EV_LUA_TIMER: cls = "LUA_TIMER"; break;
-        default: cls = "UNKNOWN";
+    // Register the event in the fd table
+    if(fd >= fds_size) {
+        int size = fds_size ? fds_size : 64;
+        while(size <= fd) size *= 2;
+        fds = realloc(fds, size * sizeof(raild_event *));
+        memset(fds + fds_size, 0, (size - fds_size) * sizeof(raild_event *));
+        fds_size = size;
     }
-
-    lua_alloc_context(fd, cls);
+    fds[fd] = event;
 
     return event;
 }
 
+/**
+ * Returns the event watching a fd, or NULL
+ */
+raild_event *raild_epoll_get(int fd) {
+    if(fd < 0 || fd >= fds_size) return NULL;
+    return fds[fd];
+}
+
+/**
+ * Returns the context class of a fd
+ */
+const char *raild_epoll_class(int fd) {
+    raild_event *event = raild_epoll_get(fd);
+    if(!event) return NULL;
+
+    switch(event->type) {
+        case RAILD_EV_UART: return "UART";
+        case RAILD_EV_SERVER: return "API_SERVER";
+        case RAILD_EV_SOCKET: return "API_CLIENT";
+        case RAILD_EV_GPIO: return "GPIO";
+        case RAILD_EV_TRAIN: return "TRAIN";
+        default: return "UNKNOWN";
+    }
+}
+
+/**
+ * Enables or disables writing-available notifications for an event
+ * Used by modules buffering their output for non-blocking fds.
+ */
+void raild_epoll_want_write(raild_event *event, bool enable) {
+    struct epoll_event epoll_ev;
+    epoll_ev.data.ptr = event;
+    epoll_ev.events   = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+
+    if(epoll_ctl(efd, EPOLL_CTL_MOD, event->fd, &epoll_ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
 /**
  * Removes a fd from the event loop
- * Must use the corresponding raild_event object for it to be freed.
- * (it's why you can't just pass the fd to remove as parameter)
+ * Must be called before closing the fd. The event is not dispatched
+ * anymore and recycled at the end of the loop iteration.
  */
 void raild_epoll_rem(raild_event *event) {
-    //epoll_ctl(efd, EPOLL_CTL_DEL, event->fd, 0);
+    if(epoll_ctl(efd, EPOLL_CTL_DEL, event->fd, NULL) < 0) {
+        perror("epoll_ctl");
+    }
+
+    // Scripts resources are released while the context still exists
     lua_dealloc_context(event->fd);
+    fds[event->fd] = NULL;
+
     event->purge = true;
+    event->ptr   = dead_events;
+    dead_events  = event;
 }
 
 /**
- * Collect the event memory
+ * Recycles events removed during this loop iteration
  */
-void raild_epoll_purge(raild_event *event) {
-    free(event);
+void raild_epoll_collect() {
+    while(dead_events) {
+        raild_event *event = dead_events;
+        dead_events = (raild_event *) event->ptr;
+        raild_event_free(event);
+    }
 }
 
 /**
  * Simple wrapper around epoll wait
+ * The wait is shortened to wake up in time for the next timer.
  */
 int raild_epoll_wait() {
-    return epoll_wait(efd, epoll_events, MAX_EVENTS, WAIT_TIMEOUT);
+    return epoll_wait(efd, epoll_events, MAX_EVENTS, raild_timer_timeout(WAIT_TIMEOUT));
 }
 
 /**
  * Returns the udata struct for the nth event
+ * Readiness flags of the event are updated from the epoll results.
  */
 raild_event *event_data(int n) {
-    return (raild_event *) epoll_events[n].data.ptr;
+    raild_event *event = (raild_event *) epoll_events[n].data.ptr;
+    event->readable = !!(epoll_events[n].events & (EPOLLIN | EPOLLPRI | EPOLLHUP | EPOLLERR));
+    event->writable = !!(epoll_events[n].events & EPOLLOUT);
+    return event;
 }
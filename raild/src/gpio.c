@@ -1,18 +1,147 @@
 #include "raild.h"
+#include <fcntl.h>
 
 /**
- * Interface to the GPIO 17 pin used as FAILURE command
+ * Interface to the Raspberry Pi GPIO pins
+ *
+ * The GPIO 17 pin is used as FAILURE command. Its sysfs value file is kept
+ * open for the whole life of raild so that changing the power state is a
+ * single write, without spawning any shell.
+ *
+ * Other pins can be watched as inputs. Their value file is registered in
+ * epoll and a GPIOChange event is sent to Lua on every edge.
  */
 
+// Pin used as FAILURE command
+#define FAILURE_PIN 17
+
+// Path to the sysfs gpio interface
+#define GPIO_PATH "/sys/class/gpio"
+
+// Value fd of the FAILURE pin
+static int failure_fd = -1;
+
+// Events of watched input pins
+static raild_event *inputs[GPIO_MAX];
+
+/**
+ * Writes a value to a sysfs file
+ */
+static bool write_file(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    bool ok = write(fd, value, strlen(value)) > 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * Exports a pin to userspace and sets its direction
+ */
+static bool export_pin(int pin, const char *direction) {
+    char path[64];
+    char value[8];
+
+    // The pin might already be exported, just ignore failures here
+    snprintf(value, 8, "%d", pin);
+    write_file(GPIO_PATH "/export", value);
+
+    snprintf(path, 64, GPIO_PATH "/gpio%d/direction", pin);
+    return write_file(path, direction);
+}
+
+/**
+ * Opens the value file of a pin
+ */
+static int open_value(int pin, int flags) {
+    char path[64];
+    snprintf(path, 64, GPIO_PATH "/gpio%d/value", pin);
+    return open(path, flags);
+}
+
+/**
+ * Reads the current value from a value fd
+ */
+static int read_value(int fd) {
+    char value;
+    if(pread(fd, &value, 1, 0) != 1) {
+        return -1;
+    }
+    return value == '1';
+}
+
 void setup_gpio() {
-    system("echo out > /sys/class/gpio/gpio17/direction");
-    system("echo 0 > /sys/class/gpio/gpio17/value");
+    if(!export_pin(FAILURE_PIN, "out")
+    || (failure_fd = open_value(FAILURE_PIN, O_WRONLY)) < 0) {
+        logger_error("Unable to setup the FAILURE GPIO pin");
+        return;
+    }
+
+    set_gpio(false);
 }
 
 void set_gpio(bool state) {
-    if(state) {
-        system("echo 1 > /sys/class/gpio/gpio17/value");
-    } else {
-        system("echo 0 > /sys/class/gpio/gpio17/value");
+    if(failure_fd < 0) return;
+    if(pwrite(failure_fd, state ? "1" : "0", 1, 0) != 1) {
+        perror("(gpio) write");
+    }
+}
+
+/**
+ * Starts watching an input pin
+ * Returns false if the pin cannot be setup
+ */
+bool gpio_watch(int pin) {
+    if(pin < 0 || pin >= GPIO_MAX || pin == FAILURE_PIN) {
+        return false;
+    } else if(inputs[pin]) {
+        return true;
+    }
+
+    char path[64];
+    snprintf(path, 64, GPIO_PATH "/gpio%d/edge", pin);
+
+    int fd;
+    if(!export_pin(pin, "in")
+    || !write_file(path, "both")
+    || (fd = open_value(pin, O_RDONLY | O_NONBLOCK)) < 0) {
+        return false;
+    }
+
+    // sysfs reports an edge the first time the file is polled, so read
+    // the current value now to acknowledge it
+    read_value(fd);
+
+    raild_event *event = raild_epoll_add(fd, RAILD_EV_GPIO);
+    event->n = pin;
+    inputs[pin] = event;
+
+    return true;
+}
+
+/**
+ * Returns the current state of a watched input pin, or -1 if this pin
+ * is not watched
+ */
+int gpio_read(int pin) {
+    if(pin < 0 || pin >= GPIO_MAX || !inputs[pin]) {
+        return -1;
     }
+    return read_value(inputs[pin]->fd);
+}
+
+/**
+ * Handle edges on watched input pins
+ */
+void gpio_handle_event(raild_event *event) {
+    int value = read_value(event->fd);
+    if(value < 0) {
+        perror("(gpio) read");
+        return;
+    }
+
+    lua_ongpiochange(event->n, value);
 }
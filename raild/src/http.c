@@ -0,0 +1,501 @@
+#include "raild.h"
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * HTTP and WebSocket endpoint
+ *
+ * raild can serve RailMon by itself: static files of the front-end are
+ * served over HTTP and the front-end WebSocket is accepted on the same
+ * port. Circuit events are then pushed to WebSocket clients directly from
+ * the publishing hooks of socket.c, encoded in the JSON messages RailMon
+ * expects, without going through Lua or the Node relay.
+ *
+ * Connections are handled by socket.c like API clients, with their output
+ * queue and backpressure. This file only implements the protocols: request
+ * parsing, the WebSocket handshake and framing, and events encoding.
+ *
+ * Plain HTTP connections are closed after one response.
+ */
+
+#ifndef HTTP_ROOT
+#define HTTP_ROOT "../railmon/static"
+#endif
+
+// Bigger files are not served, they would not fit in the output queue
+#define HTTP_FILE_MAX (192 * 1024)
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Directory of the static files
+static const char *root = HTTP_ROOT;
+
+// Number of connected WebSocket clients
+static int ws_clients = 0;
+
+/**
+ * Starts the HTTP endpoint on `port`, serving static files from `path`
+ * Does nothing if port is 0.
+ */
+void setup_http(int port, const char *path) {
+    if(port == 0) return;
+    if(path) root = path;
+
+    socket_listen(port, true);
+    logger_log(LOG_INFO, "HTTP", "Serving %s on port %d", root, port);
+}
+
+//---------------------------------------------------------------------------//
+// SHA-1 and base64, for the WebSocket handshake
+//---------------------------------------------------------------------------//
+
+#define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void sha1_block(uint32_t h[5], const rbyte *block) {
+    uint32_t w[80];
+    for(int i = 0; i < 16; i++) {
+        w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for(int i = 16; i < 80; i++) {
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for(int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if(i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if(i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if(i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else            { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+        uint32_t t = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/**
+ * SHA-1 digest of a short message (less than 120 bytes)
+ */
+static void sha1(const char *data, size_t len, rbyte digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    rbyte block[128] = { 0 };
+
+    memcpy(block, data, len);
+    block[len] = 0x80;
+
+    int blocks = (len + 9 > 64) ? 2 : 1;
+    uint64_t bits = (uint64_t) len * 8;
+    for(int i = 0; i < 8; i++) {
+        block[blocks * 64 - 1 - i] = bits >> (i * 8);
+    }
+
+    for(int i = 0; i < blocks; i++) {
+        sha1_block(h, block + i * 64);
+    }
+
+    for(int i = 0; i < 20; i++) {
+        digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static void base64(const rbyte *data, int len, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    int o = 0;
+    for(int i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if(i + 1 < len) v |= data[i + 1] << 8;
+        if(i + 2 < len) v |= data[i + 2];
+
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = (i + 1 < len) ? alphabet[(v >> 6) & 63] : '=';
+        out[o++] = (i + 2 < len) ? alphabet[v & 63] : '=';
+    }
+    out[o] = 0;
+}
+
+//---------------------------------------------------------------------------//
+// HTTP
+//---------------------------------------------------------------------------//
+
+/**
+ * Finds a header in the request, returns its value length or -1
+ */
+static int header(const char *request, int len, const char *name, const char **value) {
+    int name_len = strlen(name);
+    const char *end = request + len;
+
+    // Skip the request line
+    const char *line = memchr(request, '\n', len);
+    while(line && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if(!eol) break;
+
+        if(eol - line > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while(v < eol && *v == ' ') v++;
+
+            const char *v_end = eol;
+            while(v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ')) v_end--;
+
+            *value = v;
+            return v_end - v;
+        }
+        line = eol;
+    }
+    return -1;
+}
+
+static const char *content_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if(!ext) return "application/octet-stream";
+    if(strcmp(ext, ".html") == 0) return "text/html";
+    if(strcmp(ext, ".js") == 0)   return "application/javascript";
+    if(strcmp(ext, ".css") == 0)  return "text/css";
+    if(strcmp(ext, ".png") == 0)  return "image/png";
+    if(strcmp(ext, ".jpg") == 0)  return "image/jpeg";
+    if(strcmp(ext, ".wav") == 0)  return "audio/wav";
+    return "application/octet-stream";
+}
+
+/**
+ * Sends a response without body
+ */
+static void respond(int fd, const char *status) {
+    char response[128];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    socket_send(fd, response, len);
+}
+
+/**
+ * Sends a static file
+ */
+static void serve_file(int fd, const char *path) {
+    if(strcmp(path, "/") == 0) path = "/app.html";
+
+    // Only plain paths inside the root directory
+    char file[512];
+    if(path[0] != '/' || strstr(path, "..")
+    || snprintf(file, sizeof(file), "%s%s", root, path) >= (int) sizeof(file)) {
+        respond(fd, "404 Not Found");
+        return;
+    }
+
+    int file_fd = open(file, O_RDONLY);
+    struct stat st;
+    if(file_fd < 0 || fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if(file_fd >= 0) close(file_fd);
+        respond(fd, "404 Not Found");
+        return;
+    }
+
+    if(st.st_size > HTTP_FILE_MAX) {
+        close(file_fd);
+        respond(fd, "500 Internal Server Error");
+        return;
+    }
+
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n",
+        content_type(path), (long) st.st_size);
+    socket_send(fd, head, head_len);
+
+    if(st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if(data != MAP_FAILED) {
+            socket_send(fd, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(file_fd);
+}
+
+/**
+ * Answers the WebSocket handshake
+ */
+static bool upgrade(int fd, const char *request, int len) {
+    const char *key;
+    int key_len = header(request, len, "Sec-WebSocket-Key", &key);
+    if(key_len <= 0 || key_len > 64) {
+        respond(fd, "400 Bad Request");
+        return false;
+    }
+
+    char buffer[128];
+    memcpy(buffer, key, key_len);
+    memcpy(buffer + key_len, WS_GUID, strlen(WS_GUID));
+
+    rbyte digest[20];
+    char  accept[32];
+    sha1(buffer, key_len + strlen(WS_GUID), digest);
+    base64(digest, 20, accept);
+
+    char response[256];
+    int response_len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    socket_send(fd, response, response_len);
+
+    ws_clients++;
+    ws_send_sync(fd);
+    return true;
+}
+
+/**
+ * Handles a complete request (up to the empty line ending its headers)
+ * Returns true if the connection is now a WebSocket, false if it must be
+ * closed once the response is sent.
+ */
+bool http_handle_request(int fd, const char *request, int len) {
+    // Request line: GET <path> HTTP/1.1
+    char path[256];
+    if(len < 5 || strncmp(request, "GET ", 4) != 0) {
+        respond(fd, "405 Method Not Allowed");
+        return false;
+    }
+
+    const char *start = request + 4;
+    const char *end = start;
+    while(end < request + len && *end != ' ' && *end != '?' && *end != '\r') end++;
+    if(end - start >= (int) sizeof(path)) {
+        respond(fd, "414 URI Too Long");
+        return false;
+    }
+    memcpy(path, start, end - start);
+    path[end - start] = 0;
+
+    const char *value;
+    int value_len = header(request, len, "Upgrade", &value);
+    if(value_len == 9 && strncasecmp(value, "websocket", 9) == 0) {
+        return upgrade(fd, request, len);
+    }
+
+    serve_file(fd, path);
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+// WebSocket
+//---------------------------------------------------------------------------//
+
+/**
+ * Called by socket.c when a WebSocket client disconnects
+ */
+void ws_closed() {
+    ws_clients--;
+}
+
+/**
+ * Parses a frame sent by a client
+ * Returns the number of bytes of the frame, 0 if incomplete, or -1 if the
+ * frame is invalid or bigger than `len` could ever be. The payload is
+ * unmasked in place.
+ */
+int ws_parse_frame(rbyte *buffer, int len, int *opcode, rbyte **payload, int *payload_len) {
+    if(len < 2) return 0;
+
+    // Client frames must be masked
+    if(!(buffer[1] & 0x80)) return -1;
+
+    int      pos  = 2;
+    uint64_t size = buffer[1] & 0x7F;
+    if(size == 126) {
+        if(len < 4) return 0;
+        size = (buffer[2] << 8) | buffer[3];
+        pos = 4;
+    } else if(size == 127) {
+        // Way bigger than anything expected from RailMon
+        return -1;
+    }
+
+    if(pos + 4 + size > (uint64_t) len) {
+        return (pos + 4 + size > 4096) ? -1 : 0;
+    }
+
+    rbyte *mask = buffer + pos;
+    *payload = buffer + pos + 4;
+    for(uint64_t i = 0; i < size; i++) {
+        (*payload)[i] ^= mask[i % 4];
+    }
+
+    *opcode      = buffer[0] & 0x0F;
+    *payload_len = size;
+    return pos + 4 + size;
+}
+
+/**
+ * Sends a frame to a client
+ */
+void ws_send(int fd, int opcode, const char *data, size_t len) {
+    rbyte head[10];
+    int   head_len = 2;
+
+    head[0] = 0x80 | opcode;
+    if(len < 126) {
+        head[1] = len;
+    } else if(len < 65536) {
+        head[1] = 126;
+        head[2] = len >> 8;
+        head[3] = len;
+        head_len = 4;
+    } else {
+        head[1] = 127;
+        for(int i = 0; i < 8; i++) head[2 + i] = (uint64_t) len >> ((7 - i) * 8);
+        head_len = 10;
+    }
+
+    socket_send(fd, (char *) head, head_len);
+    socket_send(fd, data, len);
+}
+
+/**
+ * Sends a RailMon event to every WebSocket client
+ * `payload` is the JSON object of the event.
+ */
+void ws_publish(const char *payload, size_t len) {
+    if(ws_clients == 0) return;
+
+    char message[4096];
+    int message_len = snprintf(message, sizeof(message), "{\"type\":\"raild\",\"payload\":%.*s}", (int) len, payload);
+    if(message_len >= (int) sizeof(message)) return;
+
+    socket_ws_broadcast(message, message_len);
+}
+
+/**
+ * Returns the number of connected WebSocket clients
+ */
+int ws_count() {
+    return ws_clients;
+}
+
+/**
+ * Appends the states of `count` elements of a bitset as a JSON array
+ * Writes at most 2 + count * 6 bytes.
+ */
+static int json_states(char *out, const uint64_t *set, int count) {
+    int len = 0;
+    out[len++] = '[';
+    for(int i = 0; i < count; i++) {
+        bool state = (set[i / 64] >> (i % 64)) & 1;
+        if(i) out[len++] = ',';
+        if(state) {
+            memcpy(out + len, "true", 4);
+            len += 4;
+        } else {
+            memcpy(out + len, "false", 5);
+            len += 5;
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+// Fixed parts of the Sync message
+#define SYNC_HEAD     "{\"type\":\"raild\",\"payload\":{\"event\":\"Sync\",\"sensors\":"
+#define SYNC_SWITCHES ",\"switches\":"
+#define SYNC_LOCKS    ",\"locks\":"
+#define SYNC_READY    ",\"ready\":"
+#define SYNC_POWER    ",\"power\":"
+#define SYNC_TAIL     "}}"
+
+// Literals are counted with their NUL, enough for "false" and the array
+// brackets of each value
+#define SYNC_SIZE (sizeof(SYNC_HEAD) + sizeof(SYNC_SWITCHES) + sizeof(SYNC_LOCKS) \
+                 + sizeof(SYNC_READY) + sizeof(SYNC_POWER) + sizeof(SYNC_TAIL) \
+                 + 2 * sizeof("false") + (SENSORS_MAX + 2 * SWITCHES_MAX) * 6)
+
+#define SYNC_PUT(s) memcpy(message + len, s, sizeof(s) - 1), len += sizeof(s) - 1
+
+/**
+ * Sends the full circuit state to a new client
+ */
+void ws_send_sync(int fd) {
+    uint64_t sensors[SENSORS_MAX / 64], switches[SWITCHES_MAX / 64], locks[SWITCHES_MAX / 64];
+    hub_export(sensors, switches, locks);
+
+    bool ready = get_hub_readiness();
+    bool power = ready && get_power();
+
+    static char message[SYNC_SIZE];
+    int len = 0;
+    SYNC_PUT(SYNC_HEAD);
+    len += json_states(message + len, sensors, hub_sensors_count());
+    SYNC_PUT(SYNC_SWITCHES);
+    len += json_states(message + len, switches, hub_switches_count());
+    SYNC_PUT(SYNC_LOCKS);
+    len += json_states(message + len, locks, hub_switches_count());
+    SYNC_PUT(SYNC_READY);
+    if(ready) {
+        SYNC_PUT("true");
+    } else {
+        SYNC_PUT("false");
+    }
+    SYNC_PUT(SYNC_POWER);
+    if(power) {
+        SYNC_PUT("true");
+    } else {
+        SYNC_PUT("false");
+    }
+    SYNC_PUT(SYNC_TAIL);
+    ws_send(fd, WS_TEXT, message, len);
+
+    static const char online[] = "{\"type\":\"online\"}";
+    ws_send(fd, WS_TEXT, online, strlen(online));
+}
+
+/**
+ * Publishes { event, id, state } to WebSocket clients
+ */
+static void publish_state(const char *event, int id, bool state) {
+    char payload[96];
+    int len = snprintf(payload, sizeof(payload), "{\"event\":\"%s\",\"id\":%d,\"state\":%s}", event, id, state ? "true" : "false");
+    ws_publish(payload, len);
+}
+
+void ws_publish_sensors(int port, rbyte changed, rbyte value) {
+    if(ws_clients == 0) return;
+    for(int i = 0; i < 8; i++) {
+        if(changed & (1 << i)) {
+            publish_state("SensorChange", (port - 1) * 8 + i + 1, value & (1 << i));
+        }
+    }
+}
+
+void ws_publish_switches(int port, rbyte changed, rbyte value) {
+    if(ws_clients == 0) return;
+    for(int i = 0; i < 8; i++) {
+        if(changed & (1 << i)) {
+            publish_state("SwitchChange", (port - 1) * 8 + i + 1, value & (1 << i));
+        }
+    }
+}
+
+void ws_publish_lock(int sid, bool locked) {
+    if(ws_clients == 0) return;
+    char payload[64];
+    int len = snprintf(payload, sizeof(payload), "{\"event\":\"%s\",\"id\":%d}", locked ? "SwitchLock" : "SwitchUnlock", sid);
+    ws_publish(payload, len);
+}
+
+void ws_publish_power(bool state) {
+    if(ws_clients == 0) return;
+    char payload[48];
+    int len = snprintf(payload, sizeof(payload), "{\"event\":\"Power\",\"state\":%s}", state ? "true" : "false");
+    ws_publish(payload, len);
+}
+
+void ws_publish_ready(bool ready) {
+    if(ws_clients == 0) return;
+    const char *payload = ready ? "{\"event\":\"Ready\"}" : "{\"event\":\"Disconnect\"}";
+    ws_publish(payload, strlen(payload));
+}
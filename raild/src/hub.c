@@ -3,113 +3,486 @@
 /**
  * RailHub interface for Raild
  *
- * This file provides the RailHub ports cache.
+ * This file provides the hubs state table.
  *
- * Since the communication with RailHub is asynchronous, everything
+ * Since the communication with hubs is asynchronous, everything
  * is kept in Raild memory and used when requested by Lua scripts.
  *
- * Everytime something changes on one of the RailHub ports, Raild
+ * Everytime something changes on one of the hubs ports, Raild
  * is notified and this cache is updated.
+ *
+ * Every hub registers a number of 8-bit sensors and switches ports.
+ * Their bits are laid out one hub after the other in global bitsets, so
+ * that sensors and switches have global ids: the first sensor of the
+ * second hub directly follows the last sensor of the first one. Because
+ * ports are byte-aligned, a port never spans two words of a bitset and
+ * changes are diffed a word at a time, only visiting changed bits.
+ *
+ * Sensors are debounced here: a raw edge is only forwarded to Lua once
+ * the sensor kept its new state for its debounce delay. Every pending
+ * edges share a single timer set to the earliest deadline.
+ *
+ * Stable edges go through the interlocking engine (see interlock.c)
+ * before Lua.
  */
 
-// Flag indicating if RailHub is connected and in Ready state
+// Bitsets are arrays of words
+typedef uint64_t word_t;
+
+#define WORD_BITS 64
+#define WORDS(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+
+// Loops over the set bits of a word
+#define FOREACH_BIT(i, word) \
+    for(word_t _w = (word); _w && ((i) = __builtin_ctzll(_w), 1); _w &= _w - 1)
+
+// The state table
+typedef struct {
+    bool ready;         // Hub connected and in Ready state
+    int  sensor_base;   // Offset of the first sensor of this hub
+    int  sensor_ports;
+    int  switch_base;   // Offset of the first switch of this hub
+    int  switch_ports;
+} hub_entry;
+
+static hub_entry hubs[HUBS_MAX];
+static int       hubs_count = 0;
+
+// Number of sensors and switches of every hubs
+static int sensors_count  = 0;
+static int switches_count = 0;
+
+// Hub owning each switch port
+static int switch_owner[SWITCHES_MAX / 8];
+
+// Flag indicating if every hubs are connected and in Ready state
 static bool  hub_is_ready = false;
 
 // Flag indicating if the circuit is powered
 static bool  power        = false;
 
-// Cache for every sensors and switches
-static rbyte hub_sensors1 = 0x00;
-static rbyte hub_sensors2 = 0x00;
-static rbyte hub_sensors3 = 0x00;
-static rbyte hub_switches = 0x00;
+// Raw sensors state, as reported by hubs
+static word_t sensors_raw[WORDS(SENSORS_MAX)];
+
+// Debounced sensors state, as seen by Lua
+static word_t sensors_stable[WORDS(SENSORS_MAX)];
+
+// Switches state
+static word_t switches_state[WORDS(SWITCHES_MAX)];
+
+// Lock state of every switches, as reported by Lua scripts
+static word_t switch_locks[WORDS(SWITCHES_MAX)];
+
+// Debounce delays (ms)
+static int  debounce_default = 0;
+static bool debounce_enabled = true;
+static int  debounce_ms[SENSORS_MAX];
+static bool debounce_custom[SENSORS_MAX]; // False to use the default delay
+
+// Pending edges
+static word_t pending[WORDS(SENSORS_MAX)];
+static double deadlines[SENSORS_MAX];
+static double edge_times[SENSORS_MAX];
+
+// The timer set to the earliest deadline
+static raild_event *debounce_timer = NULL;
+static double       debounce_timer_deadline = 0;
+
+/**
+ * Returns the 8 bits at `offset` in a bitset
+ */
+static rbyte get_byte(const word_t *set, int offset) {
+    return set[offset / WORD_BITS] >> (offset % WORD_BITS);
+}
+
+static bool get_bit(const word_t *set, int offset) {
+    return (set[offset / WORD_BITS] >> (offset % WORD_BITS)) & 1;
+}
 
 static void sync_power() {
     bool state = (hub_is_ready && power);
+    shm_touch();
+    journal_record(JOURNAL_POWER, 0, &state, 1);
     set_gpio(state);
     uart_setpower(state);
+    socket_publish_power(state);
     lua_onpower(state);
 }
 
 /**
- * Update the Raild cache with fresh informations from RailHub
- * This function also fires associated Lua events
- */
-void set_hub_state(rhub_port port, rbyte value) {
-    // The number of the first sensor on this port
-    // -1 in the case of switches
-    int sensors_base;
-
-    // Pointer to the appropriate cache value
-    rbyte *shadow;
-
-    switch(port) {
-        case RHUB_SENSORS1:
-            sensors_base = 1;
-            shadow = &hub_sensors1;
-            break;
-
-        case RHUB_SENSORS2:
-            sensors_base = 9;
-            shadow = &hub_sensors2;
-            break;
-
-        case RHUB_SENSORS3:
-            sensors_base = 17;
-            shadow = &hub_sensors3;
-            break;
-
-        case RHUB_SWITCHES:
-            sensors_base = -1;
-            shadow = &hub_switches;
-            break;
-    }
-
-    // Update the cache
-    rbyte old_value = *shadow;
-    *shadow = value;
-
-    // Only send events when RailHub is ready
-    // Prevents a lot of event flood during synchronization with RailHub
-    if(hub_is_ready) {
-        // Check every bit on this port
-        for(int i = 0; i < 8; i++) {
-            int sensor_state = value & (1 << i);
-            int shadow_state = old_value & (1 << i);
-
-            // If the bit received is different from the cached one
-            if(sensor_state != shadow_state) {
-                if(sensors_base < 0) {
-                    // -1 base is used to identify the switches-port
-                    lua_onswitchchange(i + 1, !!sensor_state);
-                } else {
-                    // ... else it's a regular sensors-port
-                    lua_onsensorchange(sensors_base + i, !!sensor_state);
-                }
+ * Registers a new hub with the given number of ports
+ * Returns its index, or -1 if the state table is full.
+ */
+int hub_register(int sensor_ports, int switch_ports) {
+    if(hubs_count == HUBS_MAX
+    || sensors_count + sensor_ports * 8 > SENSORS_MAX
+    || switches_count + switch_ports * 8 > SWITCHES_MAX) {
+        return -1;
+    }
+
+    hub_entry *hub = &hubs[hubs_count];
+    hub->ready        = false;
+    hub->sensor_base  = sensors_count;
+    hub->sensor_ports = sensor_ports;
+    hub->switch_base  = switches_count;
+    hub->switch_ports = switch_ports;
+
+    for(int i = 0; i < switch_ports; i++) {
+        switch_owner[switches_count / 8 + i] = hubs_count;
+    }
+
+    sensors_count  += sensor_ports * 8;
+    switches_count += switch_ports * 8;
+
+    // A new hub is not ready yet
+    hub_is_ready = false;
+
+    return hubs_count++;
+}
+
+int hub_sensors_count() {
+    return sensors_count;
+}
+
+int hub_switches_count() {
+    return switches_count;
+}
+
+/**
+ * Finds the hub owning a switch (1-based global id)
+ * Sets `port` to the hub switch port and `bit` to the bit in this port.
+ */
+int hub_locate_switch(int sid, int *port, int *bit) {
+    int offset = sid - 1;
+    int hub = switch_owner[offset / 8];
+    *port = (offset - hubs[hub].switch_base) / 8;
+    *bit  = offset % 8;
+    return hub;
+}
+
+/**
+ * Returns the debounce delay of a sensor (0-based offset)
+ */
+static int sensor_debounce(int sid) {
+    if(!debounce_enabled) return 0;
+    return debounce_custom[sid] ? debounce_ms[sid] : debounce_default;
+}
+
+/**
+ * Ensures the debounce timer fires no later than the given deadline
+ */
+static void schedule_debounce(double deadline) {
+    if(debounce_timer) {
+        if(debounce_timer_deadline <= deadline) return;
+        raild_timer_delete(debounce_timer);
+    }
+
+    // Round up so the deadline is passed when the timer fires
+    int delay = (int) ((deadline - raild_now) * 1000 + 0.999);
+    if(delay < 0) delay = 0;
+
+    debounce_timer = raild_timer_create(delay, 0, RAILD_EV_DEBOUNCE_TIMER);
+    debounce_timer_deadline = deadline;
+}
+
+/**
+ * Flips stable sensors of a word and fires the associated events
+ * One SensorBatch event is sent for each port having changed sensors.
+ */
+static void apply_stable(int w, word_t mask, double time) {
+    sensors_stable[w] ^= mask;
+
+    shm_touch();
+
+    while(mask) {
+        int shift = __builtin_ctzll(mask) & ~7;
+        int port  = (w * WORD_BITS + shift) / 8 + 1;
+        rbyte changed = mask >> shift;
+        rbyte value   = sensors_stable[w] >> shift;
+
+        socket_publish_sensors(port, changed, value);
+        interlock_sensors(port, changed, value, time);
+        lua_onsensorbatch(port, changed, value, time);
+
+        mask &= ~((word_t) 0xFF << shift);
+    }
+}
+
+/**
+ * Debounce raw changes of a word of sensors
+ * Edges of sensors without debounce delay are forwarded immediately.
+ */
+static void debounce_word(int w, word_t changed, double time) {
+    // Back to the stable state, these edges were bounces
+    word_t differ = sensors_raw[w] ^ sensors_stable[w];
+    pending[w] &= ~(changed & ~differ);
+
+    word_t immediate = 0;
+
+    int i;
+    FOREACH_BIT(i, changed & differ) {
+        int sid = w * WORD_BITS + i;
+        int delay = sensor_debounce(sid);
+
+        if(delay > 0) {
+            deadlines[sid]  = time + delay / 1000.0;
+            edge_times[sid] = time;
+            pending[w] |= (word_t) 1 << i;
+            schedule_debounce(deadlines[sid]);
+        } else {
+            pending[w] &= ~((word_t) 1 << i);
+            immediate |= (word_t) 1 << i;
+        }
+    }
+
+    if(immediate) {
+        // Measured from the UART event that delivered the edge
+        stats_sensor_edge(time);
+        apply_stable(w, immediate, time);
+    }
+}
+
+/**
+ * Debounce timer handler
+ * Forwards edges whose deadline passed and reschedules for the next one
+ */
+void hub_handle_debounce(raild_event *event) {
+    // This timer is collected after dispatch
+    debounce_timer = NULL;
+
+    double next = 0;
+
+    for(int w = 0; w < WORDS(sensors_count); w++) {
+        word_t expired = 0;
+        double time = 0;
+        double due  = 0;
+
+        int i;
+        FOREACH_BIT(i, pending[w]) {
+            int sid = w * WORD_BITS + i;
+
+            if(deadlines[sid] <= raild_now) {
+                // Batches carry the time of their first edge
+                if(!expired || edge_times[sid] < time) time = edge_times[sid];
+                if(!expired || deadlines[sid] < due)   due  = deadlines[sid];
+                expired |= (word_t) 1 << i;
+            } else if(next == 0 || deadlines[sid] < next) {
+                next = deadlines[sid];
             }
         }
+
+        if(expired) {
+            pending[w] &= ~expired;
+
+            // The debounce delay itself is not part of the latency, it is
+            // measured from the moment the edge was due
+            stats_sensor_edge(due);
+            apply_stable(w, expired, time);
+        }
+    }
+
+    if(next > 0) {
+        schedule_debounce(next);
+    }
+}
+
+/**
+ * Stores a port value in a bitset
+ * Returns the changed bits, at their position in the word.
+ */
+static word_t update_port(word_t *set, int offset, rbyte value) {
+    int shift = offset % WORD_BITS;
+    word_t changed = (word_t) (value ^ get_byte(set, offset)) << shift;
+    set[offset / WORD_BITS] ^= changed;
+    return changed;
+}
+
+/**
+ * Handles changes of a sensors port
+ */
+static void notify_sensors(hub_entry *hub, int offset, word_t changed, double time) {
+    int w = offset / WORD_BITS;
+
+    // Only send events when the hub is ready
+    // Prevents a lot of event flood during synchronization with the hub.
+    // Sensors are considered stable right away.
+    if(!hub->ready) {
+        word_t mask = (word_t) 0xFF << (offset % WORD_BITS);
+        sensors_stable[w] = (sensors_stable[w] & ~mask) | (sensors_raw[w] & mask);
+        pending[w] &= ~mask;
+        shm_touch();
+        return;
+    }
+
+    // Stable edges are sent to Lua as a whole batch
+    if(changed) {
+        debounce_word(w, changed, time);
+    }
+}
+
+/**
+ * Handles changes of a switches port
+ */
+static void notify_switches(hub_entry *hub, int offset, word_t changed, double time) {
+    if(changed) {
+        shm_touch();
+    }
+
+    if(!hub->ready || !changed) {
+        return;
+    }
+
+    int   shift = offset % WORD_BITS;
+    rbyte bits  = changed >> shift;
+    rbyte value = get_byte(switches_state, offset);
+
+    socket_publish_switches(offset / 8 + 1, bits, value);
+
+    int i;
+    FOREACH_BIT(i, bits) {
+        lua_onswitchchange(offset + i + 1, (value >> i) & 1, time);
     }
 }
 
 /**
- * Returns the cached value for one of the RailHub port
+ * Updates a sensors port of a hub
  */
-rbyte get_hub_state(rhub_port port) {
-    switch(port) {
-        case RHUB_SENSORS1: return hub_sensors1;
-        case RHUB_SENSORS2: return hub_sensors2;
-        case RHUB_SENSORS3: return hub_sensors3;
-        case RHUB_SWITCHES: return hub_switches;
+void set_hub_sensors(int h, int port, rbyte value, double time) {
+    hub_entry *hub = &hubs[h];
+    int offset = hub->sensor_base + port * 8;
+    notify_sensors(hub, offset, update_port(sensors_raw, offset, value), time);
+}
+
+/**
+ * Updates a switches port of a hub
+ */
+void set_hub_switches(int h, int port, rbyte value, double time) {
+    hub_entry *hub = &hubs[h];
+    int offset = hub->switch_base + port * 8;
+    notify_switches(hub, offset, update_port(switches_state, offset, value), time);
+}
+
+/**
+ * Update the whole state of a hub at once
+ * `values` holds every sensors ports followed by every switches ports.
+ * The cache is updated before any event is fired, so that handlers
+ * always see a consistent state.
+ */
+void set_hub_full_state(int h, const rbyte *values, double time) {
+    hub_entry *hub = &hubs[h];
+    word_t sensors[hub->sensor_ports];
+    word_t switches[hub->switch_ports];
+
+    for(int i = 0; i < hub->sensor_ports; i++) {
+        sensors[i] = update_port(sensors_raw, hub->sensor_base + i * 8, values[i]);
     }
+    for(int i = 0; i < hub->switch_ports; i++) {
+        switches[i] = update_port(switches_state, hub->switch_base + i * 8, values[hub->sensor_ports + i]);
+    }
+
+    for(int i = 0; i < hub->switch_ports; i++) {
+        notify_switches(hub, hub->switch_base + i * 8, switches[i], time);
+    }
+    for(int i = 0; i < hub->sensor_ports; i++) {
+        notify_sensors(hub, hub->sensor_base + i * 8, sensors[i], time);
+    }
+}
+
+/**
+ * Returns the cached state of a switches port of a hub
+ */
+rbyte get_hub_switches(int h, int port) {
+    return get_byte(switches_state, hubs[h].switch_base + port * 8);
+}
+
+/**
+ * Returns the debounced state of a sensor (1-based global id)
+ */
+bool get_sensor(int sid) {
+    return get_bit(sensors_stable, sid - 1);
 }
 
 /**
- * Updates the ready state of RailHub and fires the corresponding event
+ * Returns the cached state of a switch (1-based global id)
  */
-void set_hub_readiness(bool r) {
-    hub_is_ready = r;
+bool get_switch(int sid) {
+    return get_bit(switches_state, sid - 1);
+}
+
+/**
+ * Returns a port of the global bitsets (0-based port index)
+ * Debounced sensors, switches and switch locks are laid out in ports
+ * of 8 bits, in hub order.
+ */
+rbyte get_sensors_port(int port) {
+    return get_byte(sensors_stable, port * 8);
+}
+
+rbyte get_switches_port(int port) {
+    return get_byte(switches_state, port * 8);
+}
+
+rbyte get_locks_port(int port) {
+    return get_byte(switch_locks, port * 8);
+}
+
+/**
+ * Sets the debounce delay of a sensor (1-based id)
+ * A negative delay reverts the sensor to the default delay.
+ */
+void set_sensor_debounce(int sid, int ms) {
+    debounce_custom[sid - 1] = (ms >= 0);
+    debounce_ms[sid - 1] = ms;
+}
+
+/**
+ * Enables or disables sensors debounce entirely, see journal.c
+ */
+void set_debounce_enabled(bool enabled) {
+    debounce_enabled = enabled;
+}
+
+/**
+ * Sets the debounce delay of sensors without a specific one
+ */
+void set_default_debounce(int ms) {
+    debounce_default = (ms > 0) ? ms : 0;
+}
+
+/**
+ * Updates the ready state of a hub
+ * Ready and Disconnect events are fired when every hubs are ready, or
+ * when one of them is not anymore.
+ */
+void set_hub_readiness(int h, bool r) {
+    hub_entry *hub = &hubs[h];
+    hub->ready = r;
+
+    journal_record(JOURNAL_READY, h, &r, 1);
+
+    // Edges pending when the hub disconnected are dropped
+    if(!r) {
+        for(int i = hub->sensor_base; i < hub->sensor_base + hub->sensor_ports * 8; i++) {
+            pending[i / WORD_BITS] &= ~((word_t) 1 << (i % WORD_BITS));
+        }
+    }
+
+    bool all_ready = true;
+    for(int i = 0; i < hubs_count; i++) {
+        all_ready = all_ready && hubs[i].ready;
+    }
+
+    // A hub that (re)started or went away still gets the power state, it
+    // boots with the track powered even if the others did not change
+    if(all_ready == hub_is_ready) {
+        uart_sethubpower(h, hub_is_ready && power);
+        return;
+    }
+
+    hub_is_ready = all_ready;
     sync_power();
-    if(r) {
+    socket_publish_ready(all_ready);
+    if(all_ready) {
         lua_onready();
     } else {
         lua_ondisconnect();
@@ -117,7 +490,7 @@ void set_hub_readiness(bool r) {
 }
 
 /**
- * Returns the RailHub ready state
+ * Returns true if every hubs are ready
  */
 bool get_hub_readiness() {
     return hub_is_ready;
@@ -137,3 +510,26 @@ void set_power(bool p) {
 bool get_power() {
     return power;
 }
+
+/**
+ * Updates the lock state of a switch
+ * Locks are managed by Lua scripts, this is only a cache for API clients
+ */
+void set_switch_lock(int sid, bool locked) {
+    int offset = sid - 1;
+    if(get_bit(switch_locks, offset) == locked) return;
+
+    switch_locks[offset / WORD_BITS] ^= (word_t) 1 << (offset % WORD_BITS);
+    socket_publish_lock(sid, locked);
+    shm_touch();
+}
+
+/**
+ * Copies the debounced sensors, switches and locks bitsets
+ * Used to publish the shared-memory snapshot.
+ */
+void hub_export(uint64_t *sensors, uint64_t *switches, uint64_t *locks) {
+    memcpy(sensors,  sensors_stable, sizeof(sensors_stable));
+    memcpy(switches, switches_state, sizeof(switches_state));
+    memcpy(locks,    switch_locks,   sizeof(switch_locks));
+}
@@ -0,0 +1,432 @@
+#include "raild.h"
+
+/**
+ * Switch interlocking and block occupancy
+ *
+ * Switches are locked by the trains going through them: a rising edge on
+ * one of the three sensors of a switch locks it, and it is unlocked once
+ * the train left by the exit sensor. While a switch is locked, its
+ * position cannot change and any activity on a sensor other than the
+ * entry and exit ones cuts the power.
+ *
+ * This runs in C, from the debounced sensors edges of hub.c and before
+ * Lua sees them, so that the safety cutoff does not depend on script
+ * latency or GC pauses. The topology is declared from Lua: switches with
+ * their A, B and C sensors, and blocks made of any number of sensors.
+ *
+ *      (A) (B)
+ *      | |/ /
+ *      | / /     STATE      EXIT
+ *      |/ /      false      (A)
+ *      | /       true       (B)
+ *      | |
+ *      (C)
+ *
+ * Each sensor has a list of the switches and blocks it belongs to, an
+ * edge only visits these. Lua is then notified of what happened with
+ * Interlock events to implement the routing policy. EnterA, EnterB and
+ * EnterC are dispatched right away, before the switch is locked, so that
+ * handlers can choose its position. Other notifications are queued while
+ * the engine runs and dispatched once its state is consistent again.
+ */
+
+#define BLOCKS_MAX 128
+
+// Owners of a sensor copied on the stack before handling its edge
+#define OWNERS_LOCAL 16
+
+// Roles of a sensor for its owners
+typedef enum {
+    ROLE_A,
+    ROLE_B,
+    ROLE_C,
+    ROLE_BLOCK
+} owner_role;
+
+// An element of the owners list of a sensor
+typedef struct {
+    int16_t next;  // Next owner of the same sensor, -1 at the end
+    uint8_t role;
+    int16_t index; // Switch or block index
+} owner;
+
+typedef struct {
+    bool    enabled;
+    bool    locked;
+    bool    state;
+    bool    pending_state; // Position to apply once unlocked
+    int16_t sensors[3];    // A, B and C sensors (0-based)
+    int16_t enter, exit;   // Sensors of the train going through, -1 if none
+    raild_event *unlock_timer;
+} interlock_switch;
+
+typedef struct {
+    int16_t active; // Number of active sensors of this block
+} interlock_block;
+
+// A notification waiting to be dispatched to Lua
+typedef struct {
+    interlock_event event;
+    int    id;
+    int    arg;
+    double time;
+} note;
+
+static interlock_switch switches[SWITCHES_MAX];
+static interlock_block  blocks[BLOCKS_MAX];
+static int              blocks_count = 0;
+
+// Owners lists, heads indexed by sensor
+static int16_t owner_head[SENSORS_MAX];
+static owner  *owners      = NULL;
+static int     owners_len  = 0;
+static int     owners_size = 0;
+static int16_t free_owner  = -1;
+
+// Delay before unlocking a switch once the train left it (ms)
+static int unlock_delay = 50;
+
+// Queued notifications
+static note *notes      = NULL;
+static int   notes_len  = 0;
+static int   notes_size = 0;
+static bool  flushing   = false;
+
+void setup_interlock() {
+    for(int i = 0; i < SENSORS_MAX; i++) owner_head[i] = -1;
+}
+
+//---------------------------------------------------------------------------//
+// Notifications
+//---------------------------------------------------------------------------//
+
+static void notify(interlock_event event, int id, int arg, double time) {
+    if(notes_len == notes_size) {
+        notes_size = notes_size ? notes_size * 2 : 16;
+        notes = realloc(notes, notes_size * sizeof(note));
+    }
+    notes[notes_len++] = (note) { event, id, arg, time };
+}
+
+/**
+ * Dispatches queued notifications
+ * Lua handlers may call back into the engine, their own notifications are
+ * appended and dispatched by the same loop.
+ */
+static void flush() {
+    if(flushing) return;
+    flushing = true;
+
+    for(int i = 0; i < notes_len; i++) {
+        note n = notes[i];
+        lua_oninterlock(n.event, n.id, n.arg, n.time);
+    }
+
+    notes_len = 0;
+    flushing  = false;
+}
+
+/**
+ * Dispatches an Enter notification right away
+ * Notifications raised by its handlers are queued.
+ */
+static void enter(interlock_event event, int index, double time) {
+    bool was_flushing = flushing;
+    flush();
+
+    flushing = true;
+    lua_oninterlock(event, index + 1, 0, time);
+    flushing = was_flushing;
+}
+
+//---------------------------------------------------------------------------//
+// Owners lists
+//---------------------------------------------------------------------------//
+
+static void add_owner(int sensor, owner_role role, int index) {
+    int16_t o = free_owner;
+    if(o >= 0) {
+        free_owner = owners[o].next;
+    } else {
+        if(owners_len == owners_size) {
+            owners_size = owners_size ? owners_size * 2 : 64;
+            owners = realloc(owners, owners_size * sizeof(owner));
+        }
+        o = owners_len++;
+    }
+
+    owners[o] = (owner) { owner_head[sensor], role, index };
+    owner_head[sensor] = o;
+}
+
+/**
+ * Removes the switch `index` from the owners of a sensor
+ */
+static void remove_switch_owner(int sensor, int index) {
+    int16_t *link = &owner_head[sensor];
+    while(*link >= 0) {
+        owner *o = &owners[*link];
+        if(o->role != ROLE_BLOCK && o->index == index) {
+            int16_t removed = *link;
+            *link = o->next;
+            o->next = free_owner;
+            free_owner = removed;
+        } else {
+            link = &o->next;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Switches
+//---------------------------------------------------------------------------//
+
+/**
+ * Moves a switch, or records the position for later if it is locked
+ */
+static void set_state(int index, bool state) {
+    interlock_switch *sw = &switches[index];
+    if(sw->locked) {
+        sw->pending_state = state;
+    } else if(sw->state != state) {
+        sw->state = state;
+        sw->pending_state = state;
+        uart_setswitch(index + 1, state);
+        notify(INTERLOCK_CHANGE, index + 1, state, raild_now);
+    }
+}
+
+static void lock(int index, int enter, int exit) {
+    interlock_switch *sw = &switches[index];
+    sw->locked = true;
+    sw->enter  = enter;
+    sw->exit   = exit;
+    set_switch_lock(index + 1, true);
+    notify(INTERLOCK_LOCK, index + 1, 0, raild_now);
+}
+
+static void unlock(int index) {
+    interlock_switch *sw = &switches[index];
+    if(sw->unlock_timer) {
+        raild_timer_delete(sw->unlock_timer);
+        sw->unlock_timer = NULL;
+    }
+
+    sw->locked = false;
+    sw->enter  = -1;
+    sw->exit   = -1;
+    set_switch_lock(index + 1, false);
+    notify(INTERLOCK_UNLOCK, index + 1, 0, raild_now);
+
+    set_state(index, sw->pending_state);
+}
+
+/**
+ * Handles an edge on one of the sensors of a switch
+ */
+static void switch_edge(int index, owner_role role, int sensor, bool rising, double time) {
+    interlock_switch *sw = &switches[index];
+
+    if(sw->locked) {
+        if(sensor == sw->exit) {
+            if(rising) {
+                // Still on the exit sensor, cancel the unlock delay
+                if(sw->unlock_timer) {
+                    raild_timer_delete(sw->unlock_timer);
+                    sw->unlock_timer = NULL;
+                }
+            } else if(!sw->unlock_timer) {
+                // The train left, unlock after the delay
+                sw->unlock_timer = raild_timer_create(unlock_delay, 0, RAILD_EV_INTERLOCK_TIMER);
+                sw->unlock_timer->n = index;
+            }
+        } else if(rising && sensor != sw->enter) {
+            // The current train has nothing to do with this sensor
+            set_power(false);
+            logger_log(LOG_WARN, "INTERLOCK", "Activity on sensor %d while switch %d is locked, power off", sensor + 1, index + 1);
+            notify(INTERLOCK_BAD_SENSOR, index + 1, sensor + 1, time);
+        }
+        return;
+    }
+
+    if(!rising) return;
+
+    switch(role) {
+        case ROLE_A: // (A) -> (C)
+            enter(INTERLOCK_ENTER_A, index, time);
+            if(!sw->enabled || sw->locked) return;
+            set_state(index, false);
+            lock(index, sensor, sw->sensors[ROLE_C]);
+            break;
+
+        case ROLE_B: // (B) -> (C)
+            enter(INTERLOCK_ENTER_B, index, time);
+            if(!sw->enabled || sw->locked) return;
+            set_state(index, true);
+            lock(index, sensor, sw->sensors[ROLE_C]);
+            break;
+
+        default: // (C) -> (A|B), the position was chosen by handlers
+            enter(INTERLOCK_ENTER_C, index, time);
+            if(!sw->enabled || sw->locked) return;
+            lock(index, sensor, sw->sensors[sw->state ? ROLE_B : ROLE_A]);
+            break;
+    }
+}
+
+/**
+ * Enables a switch with its A, B and C sensors (1-based ids)
+ * Returns false if the switch is already enabled.
+ */
+bool interlock_switch_enable(int sid, int a, int b, int c) {
+    interlock_switch *sw = &switches[sid - 1];
+    if(sw->enabled) return false;
+
+    sw->enabled       = true;
+    sw->locked        = false;
+    sw->state         = get_switch(sid);
+    sw->pending_state = sw->state;
+    sw->enter         = -1;
+    sw->exit          = -1;
+    sw->unlock_timer  = NULL;
+
+    int sensors[3] = { a - 1, b - 1, c - 1 };
+    for(int role = ROLE_A; role <= ROLE_C; role++) {
+        sw->sensors[role] = sensors[role];
+        add_owner(sensors[role], role, sid - 1);
+    }
+
+    return true;
+}
+
+/**
+ * Disables a switch, unlocking it if needed
+ */
+void interlock_switch_disable(int sid) {
+    interlock_switch *sw = &switches[sid - 1];
+    if(!sw->enabled) return;
+
+    for(int role = ROLE_A; role <= ROLE_C; role++) {
+        remove_switch_owner(sw->sensors[role], sid - 1);
+    }
+
+    if(sw->locked) unlock(sid - 1);
+    sw->enabled = false;
+    flush();
+}
+
+/**
+ * Requests a position for a switch
+ * The switch moves once unlocked if a train is going through it.
+ */
+void interlock_set_state(int sid, bool state) {
+    if(!switches[sid - 1].enabled) return;
+    set_state(sid - 1, state);
+    flush();
+}
+
+/**
+ * Returns true if the switch is enabled, along with its state
+ */
+bool interlock_get_switch(int sid, bool *state, bool *locked) {
+    interlock_switch *sw = &switches[sid - 1];
+    *state  = sw->state;
+    *locked = sw->locked;
+    return sw->enabled;
+}
+
+void interlock_set_delay(int ms) {
+    unlock_delay = ms;
+}
+
+/**
+ * Unlock delay timer handler
+ */
+void interlock_handle_timer(raild_event *event) {
+    interlock_switch *sw = &switches[event->n];
+
+    // This timer is collected after dispatch
+    sw->unlock_timer = NULL;
+    if(sw->enabled && sw->locked) {
+        unlock(event->n);
+        flush();
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Blocks
+//---------------------------------------------------------------------------//
+
+/**
+ * Declares a block made of the given sensors (1-based ids)
+ * Returns its id, or -1 if there are too many blocks.
+ */
+int interlock_add_block(const int *sensors, int count) {
+    if(blocks_count == BLOCKS_MAX) return -1;
+
+    int index = blocks_count++;
+    blocks[index].active = 0;
+    for(int i = 0; i < count; i++) {
+        add_owner(sensors[i] - 1, ROLE_BLOCK, index);
+        if(get_sensor(sensors[i])) blocks[index].active++;
+    }
+
+    return index + 1;
+}
+
+bool interlock_block_occupied(int id) {
+    return id >= 1 && id <= blocks_count && blocks[id - 1].active > 0;
+}
+
+static void block_edge(int index, bool rising, double time) {
+    interlock_block *block = &blocks[index];
+    if(rising) {
+        if(block->active++ == 0) notify(INTERLOCK_OCCUPIED, index + 1, 0, time);
+    } else if(block->active > 0) {
+        if(--block->active == 0) notify(INTERLOCK_FREE, index + 1, 0, time);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Sensors edges
+//---------------------------------------------------------------------------//
+
+/**
+ * Handles debounced edges of a sensors port
+ * Called by hub.c before the edges are dispatched to Lua.
+ */
+void interlock_sensors(int port, rbyte changed, rbyte value, double time) {
+    int base = (port - 1) * 8;
+
+    for(int i = 0; i < 8; i++) {
+        if(!(changed & (1 << i))) continue;
+
+        int  sensor = base + i;
+        bool rising = value & (1 << i);
+
+        // Enter handlers run while the list is visited and may release or
+        // enable switches, changing the owners lists. Owners are copied
+        // first, and switches no longer owning the sensor are skipped.
+        int count = 0;
+        for(int16_t o = owner_head[sensor]; o >= 0; o = owners[o].next) count++;
+        if(count == 0) continue;
+
+        owner  local[OWNERS_LOCAL];
+        owner *list = (count <= OWNERS_LOCAL) ? local : malloc(count * sizeof(owner));
+        int n = 0;
+        for(int16_t o = owner_head[sensor]; o >= 0; o = owners[o].next) list[n++] = owners[o];
+
+        for(int k = 0; k < count; k++) {
+            owner *own = &list[k];
+            if(own->role == ROLE_BLOCK) {
+                block_edge(own->index, rising, time);
+            } else if(switches[own->index].enabled && switches[own->index].sensors[own->role] == sensor) {
+                switch_edge(own->index, own->role, sensor, rising, time);
+            }
+        }
+
+        if(list != local) free(list);
+    }
+
+    flush();
+}
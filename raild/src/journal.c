@@ -0,0 +1,276 @@
+#include "raild.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/**
+ * Event journal
+ *
+ * Every byte received from RailHub, every frame sent to it and every
+ * power / readiness transition can be recorded in an append-only journal
+ * file with its monotonic timestamp.
+ *
+ * The file is memory-mapped: recording a record is a memcpy() in the
+ * mapping, without any syscall, and the kernel writes pages back on its
+ * own. The length stored in the file header is only updated once a record
+ * is complete, so a journal left by a crashed raild is still readable.
+ *
+ * A journal can be replayed in place of the UART: received bytes are fed
+ * back to the UART input processor at their recorded pace, while output to
+ * RailHub is discarded. Edges carry the recorded time, relative to the
+ * start of the replay.
+ *
+ * An accelerated replay speeds up the raild clock itself: raild_now, and
+ * with it debounce deadlines, interlocking delays and Lua timers, run
+ * `speed` times faster, so that scripts see the incident as it happened.
+ *
+ * Replaying as fast as possible (speed 0) cannot keep timings: records are
+ * fed in batches while the clock runs normally, and sensors debounce is
+ * skipped, since it would filter out or merge edges of a batch. Lua timers
+ * are not accelerated either.
+ *
+ * Layout of the file:
+ *   header:  "RJNL" [version:u32] [length:u64]
+ *   records: [time:u64] [length:u16] [type:u8] [hub:u8] [data...]
+ * Integers are in host byte order, `length` of the header counts the bytes
+ * of records. `hub` is the index of the hub concerned, 0 for power records.
+ */
+
+// The journal grows by chunks of this size
+#ifndef JOURNAL_CHUNK
+#define JOURNAL_CHUNK (4 << 20)
+#endif
+
+// Records fed per replay timer tick when replaying as fast as possible
+#define REPLAY_BATCH 64
+
+#define JOURNAL_MAGIC   "RJNL"
+#define JOURNAL_VERSION 2
+
+typedef struct {
+    char     magic[4];
+    uint32_t version;
+    uint64_t length;
+} journal_header;
+
+// Size of a record header
+#define RECORD_HEADER 12
+
+// The journal being recorded
+static int             journal_fd = -1;
+static rbyte          *journal    = NULL;
+static size_t          journal_size = 0;
+static journal_header *header     = NULL;
+
+// The journal being replayed
+static rbyte  *replay      = NULL;
+static size_t  replay_len  = 0;
+static size_t  replay_pos  = 0;
+static double  replay_speed = 1;
+static uint64_t replay_origin = 0; // Time of the first record
+static double  replay_start = 0;   // raild_now when the replay started, edges
+                                   // happen at replay_start + (time - origin)
+static unsigned long replay_count = 0;
+
+/**
+ * Maps `size` bytes of the recorded journal
+ */
+static void journal_map(size_t size) {
+    if(ftruncate(journal_fd, size) < 0) {
+        perror("(journal) ftruncate");
+        exit(1);
+    }
+
+    if(journal) {
+        munmap(journal, journal_size);
+    }
+
+    journal = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal_fd, 0);
+    if(journal == MAP_FAILED) {
+        perror("(journal) mmap");
+        exit(1);
+    }
+
+    journal_size = size;
+    header = (journal_header *) journal;
+}
+
+/**
+ * Starts recording a new journal at `path`
+ */
+void setup_journal(const char *path) {
+    journal_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(journal_fd < 0) {
+        perror("(journal) open");
+        exit(1);
+    }
+
+    journal_map(JOURNAL_CHUNK);
+    memcpy(header->magic, JOURNAL_MAGIC, 4);
+    header->version = JOURNAL_VERSION;
+    header->length  = 0;
+
+    char msg[128];
+    snprintf(msg, 128, "Recording journal to %s", path);
+    logger("JOURNAL", msg);
+}
+
+/**
+ * Appends a record to the journal, if recording
+ * Timestamped with the time of the current event loop iteration.
+ */
+void journal_record(journal_type type, int hub, const void *data, size_t len) {
+    if(!journal) return;
+
+    size_t pos = sizeof(journal_header) + header->length;
+    if(pos + RECORD_HEADER + len > journal_size) {
+        journal_map(journal_size + JOURNAL_CHUNK);
+    }
+
+    uint64_t time = (uint64_t) (raild_now * 1e9);
+    uint16_t length = len;
+    rbyte   *record = journal + pos;
+
+    memcpy(record, &time, 8);
+    memcpy(record + 8, &length, 2);
+    record[10] = type;
+    record[11] = hub;
+    memcpy(record + RECORD_HEADER, data, len);
+
+    header->length += RECORD_HEADER + len;
+}
+
+/**
+ * Reads the header of the record at `pos` in the replayed journal
+ * Returns false if there is no complete record there.
+ */
+static bool replay_record(size_t pos, uint64_t *time, uint16_t *len, rbyte *type, rbyte *hub) {
+    if(pos + RECORD_HEADER > replay_len) return false;
+
+    memcpy(time, replay + pos, 8);
+    memcpy(len, replay + pos + 8, 2);
+    *type = replay[pos + 10];
+    *hub  = replay[pos + 11];
+
+    return pos + RECORD_HEADER + *len <= replay_len;
+}
+
+/**
+ * Schedules the replay timer for the next record
+ */
+static void replay_schedule() {
+    uint64_t time;
+    uint16_t len;
+    rbyte    type, hub;
+
+    if(!replay_record(replay_pos, &time, &len, &type, &hub)) {
+        char msg[64];
+        snprintf(msg, 64, "Replay completed, %lu records", replay_count);
+        logger("JOURNAL", msg);
+        exit(0);
+    }
+
+    int delay = 0;
+    if(replay_speed > 0) {
+        double at = replay_start + (time - replay_origin) / 1e9;
+        delay = (int) ((at - raild_now) * 1000 + 0.999);
+        if(delay < 0) delay = 0;
+    }
+
+    raild_timer_create(delay, 0, RAILD_EV_REPLAY_TIMER);
+}
+
+/**
+ * Starts replaying the journal at `path`
+ * `speed` is the acceleration factor, 0 to replay as fast as possible.
+ */
+void setup_replay(const char *path, double speed) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        perror("(journal) open");
+        exit(1);
+    }
+
+    journal_header head;
+    if(read(fd, &head, sizeof(head)) != sizeof(head)
+    || memcmp(head.magic, JOURNAL_MAGIC, 4) != 0
+    || head.version != JOURNAL_VERSION) {
+        logger_error("Invalid journal file");
+        exit(1);
+    }
+
+    replay_len = sizeof(journal_header) + head.length;
+    replay = mmap(NULL, replay_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(replay == MAP_FAILED) {
+        perror("(journal) mmap");
+        exit(1);
+    }
+    close(fd);
+
+    replay_pos   = sizeof(journal_header);
+    replay_speed = speed;
+
+    if(speed > 0) {
+        raild_set_time_scale(speed);
+    } else {
+        set_debounce_enabled(false);
+    }
+    replay_start = raild_now;
+
+    // One offline hub is created for every hub found in the journal
+    uint64_t time;
+    uint16_t len;
+    rbyte    type, hub;
+    int      hubs = 1;
+
+    for(size_t pos = replay_pos; replay_record(pos, &time, &len, &type, &hub); pos += RECORD_HEADER + len) {
+        if(hub >= hubs) hubs = hub + 1;
+    }
+
+    for(int i = 0; i < hubs; i++) {
+        uart_add_offline();
+    }
+
+    replay_record(replay_pos, &replay_origin, &len, &type, &hub);
+
+    char msg[128];
+    snprintf(msg, 128, "Replaying journal %s", path);
+    logger("JOURNAL", msg);
+
+    replay_schedule();
+}
+
+/**
+ * Returns true if a journal is replayed instead of using the UART
+ */
+bool journal_is_replaying() {
+    return replay != NULL;
+}
+
+/**
+ * Replay timer handler
+ * Feeds every record due by now to the UART, then waits for the next one
+ */
+void journal_handle_replay(raild_event *event) {
+    uint64_t time;
+    uint16_t len;
+    rbyte    type, hub;
+
+    for(int n = 0; replay_record(replay_pos, &time, &len, &type, &hub); n++) {
+        double at = replay_start + (time - replay_origin) / 1e9;
+        if(replay_speed > 0) {
+            if(at > raild_now) break;
+        } else if(n == REPLAY_BATCH) {
+            break;
+        }
+
+        // Only input is replayed, everything else results from it
+        if(type == JOURNAL_UART_RX) {
+            uart_feed(hub, replay + replay_pos + RECORD_HEADER, len, at);
+        }
+
+        replay_pos += RECORD_HEADER + len;
+        replay_count++;
+    }
+
+    replay_schedule();
+}
@@ -0,0 +1,258 @@
+#include "raild.h"
+#include <math.h>
+#include <luajit-2.0/lua.h>
+#include <luajit-2.0/lauxlib.h>
+
+/**
+ * Native JSON encoder
+ *
+ * JSON messages for RailMon are built here in a reusable buffer instead of
+ * being concatenated from Lua strings.
+ *
+ * Tables are encoded the same way as the Lua JSON.Encode() function does:
+ * a table whose metatable has a __json field set to "object", "array" or
+ * "null" is encoded as such, any other table is an array if it has a
+ * non-zero length and an object otherwise.
+ */
+
+// Maximum nesting of tables, protects against cycles
+#define MAX_DEPTH 32
+
+// The reusable output buffer
+static char  *buffer      = NULL;
+static size_t buffer_len  = 0;
+static size_t buffer_size = 0;
+
+/**
+ * Ensures the buffer can hold `len` more bytes
+ */
+static void reserve(size_t len) {
+    if(buffer_len + len <= buffer_size) return;
+
+    size_t size = buffer_size ? buffer_size : 256;
+    while(size < buffer_len + len) size *= 2;
+
+    buffer = realloc(buffer, size);
+    if(!buffer) {
+        perror("realloc");
+        exit(1);
+    }
+    buffer_size = size;
+}
+
+static void put(const char *data, size_t len) {
+    reserve(len);
+    memcpy(buffer + buffer_len, data, len);
+    buffer_len += len;
+}
+
+#define PUT_LITERAL(s) put(s, sizeof(s) - 1)
+
+static void put_number(lua_Number n) {
+    if(isnan(n) || isinf(n)) {
+        // JSON has no representation for these
+        PUT_LITERAL("null");
+        return;
+    }
+
+    reserve(32);
+    buffer_len += snprintf(buffer + buffer_len, 32, "%.14g", n);
+}
+
+static void put_string(const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+
+    // Worst case is every character escaped as \u00XX
+    reserve(len * 6 + 2);
+    char *out = buffer + buffer_len;
+
+    *out++ = '"';
+    for(size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        switch(c) {
+            case '"':  *out++ = '\\'; *out++ = '"';  break;
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n';  break;
+            case '\r': *out++ = '\\'; *out++ = 'r';  break;
+            case '\t': *out++ = '\\'; *out++ = 't';  break;
+            default:
+                if(c < 0x20) {
+                    *out++ = '\\'; *out++ = 'u'; *out++ = '0'; *out++ = '0';
+                    *out++ = hex[c >> 4];
+                    *out++ = hex[c & 0xF];
+                } else {
+                    *out++ = c;
+                }
+        }
+    }
+    *out++ = '"';
+
+    buffer_len = out - buffer;
+}
+
+/**
+ * Returns the __json field of the metatable of the table at idx, or NULL
+ */
+static const char *json_type(lua_State *L, int idx) {
+    if(!lua_getmetatable(L, idx)) return NULL;
+    lua_getfield(L, -1, "__json");
+    const char *type = lua_tostring(L, -1);
+    lua_pop(L, 2);
+    return type;
+}
+
+static void encode(lua_State *L, int idx, int depth);
+
+static void encode_table(lua_State *L, int idx, int depth) {
+    if(depth > MAX_DEPTH) {
+        luaL_error(L, "cannot JSON-encode: table nested too deep");
+    }
+
+    const char *type = json_type(L, idx);
+    if(type && strcmp(type, "null") == 0) {
+        PUT_LITERAL("null");
+        return;
+    }
+
+    size_t len = lua_objlen(L, idx);
+    bool object = (type) ? strcmp(type, "object") == 0 : len == 0;
+
+    if(!object) {
+        put("[", 1);
+        for(size_t i = 1; i <= len; i++) {
+            if(i > 1) put(",", 1);
+            lua_rawgeti(L, idx, i);
+            encode(L, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        put("]", 1);
+        return;
+    }
+
+    put("{", 1);
+    bool first = true;
+    lua_pushnil(L);
+    while(lua_next(L, idx) != 0) {
+        if(!first) put(",", 1);
+        first = false;
+
+        // Keys are always strings, numbers are quoted
+        switch(lua_type(L, -2)) {
+            case LUA_TSTRING: {
+                size_t klen;
+                const char *key = lua_tolstring(L, -2, &klen);
+                put_string(key, klen);
+                break;
+            }
+
+            case LUA_TNUMBER:
+                put("\"", 1);
+                put_number(lua_tonumber(L, -2));
+                put("\"", 1);
+                break;
+
+            default:
+                luaL_error(L, "cannot JSON-encode key from type: %s", luaL_typename(L, -2));
+        }
+
+        put(":", 1);
+        encode(L, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+    }
+    put("}", 1);
+}
+
+static void encode(lua_State *L, int idx, int depth) {
+    switch(lua_type(L, idx)) {
+        case LUA_TNIL:
+            PUT_LITERAL("null");
+            break;
+
+        case LUA_TBOOLEAN:
+            if(lua_toboolean(L, idx)) {
+                PUT_LITERAL("true");
+            } else {
+                PUT_LITERAL("false");
+            }
+            break;
+
+        case LUA_TNUMBER:
+            put_number(lua_tonumber(L, idx));
+            break;
+
+        case LUA_TSTRING: {
+            size_t len;
+            const char *s = lua_tolstring(L, idx, &len);
+            put_string(s, len);
+            break;
+        }
+
+        case LUA_TTABLE:
+            encode_table(L, idx, depth);
+            break;
+
+        default:
+            // Unknown type (function / userdata / thread)
+            luaL_error(L, "cannot JSON-encode value from type: %s", luaL_typename(L, idx));
+    }
+}
+
+/**
+ * JSONEncode(obj)
+ * Encodes any Lua value to a JSON string
+ */
+static int lualib_JSONEncode(lua_State *L) {
+    luaL_checkany(L, 1);
+
+    buffer_len = 0;
+    lua_settop(L, 1);
+    encode(L, 1, 0);
+
+    lua_pushlstring(L, buffer, buffer_len);
+    return 1;
+}
+
+/**
+ * JSONEncodeEvent(event, id[, state])
+ * Fast path for fixed-shape RailMon messages, written straight from a
+ * template without building any table:
+ *   {"event":<event>,"id":<id>,"state":<state>}
+ * The state field is omitted if nil.
+ */
+static int lualib_JSONEncodeEvent(lua_State *L) {
+    size_t len;
+    const char *event = luaL_checklstring(L, 1, &len);
+    lua_Number id = luaL_checknumber(L, 2);
+
+    buffer_len = 0;
+    PUT_LITERAL("{\"event\":");
+    put_string(event, len);
+    PUT_LITERAL(",\"id\":");
+    put_number(id);
+
+    if(!lua_isnoneornil(L, 3)) {
+        if(lua_toboolean(L, 3)) {
+            PUT_LITERAL(",\"state\":true}");
+        } else {
+            PUT_LITERAL(",\"state\":false}");
+        }
+    } else {
+        put("}", 1);
+    }
+
+    lua_pushlstring(L, buffer, buffer_len);
+    return 1;
+}
+
+static const luaL_Reg json_api[] = {
+    { "JSONEncode",      lualib_JSONEncode },
+    { "JSONEncodeEvent", lualib_JSONEncodeEvent },
+    { NULL, NULL }
+};
+
+/**
+ * Register the JSON functions in the table on top of the stack
+ */
+void lualib_json_register(lua_State *L) {
+    luaL_register(L, NULL, json_api);
+}
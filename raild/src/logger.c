@@ -1,47 +1,207 @@
 #include "raild.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <strings.h>
 
 /**
  * Logger utilities
+ *
+ * Lines are formatted by the caller into a ring of fixed-size slots and
+ * written to stdout by a background thread, so logging never blocks the
+ * event loop on a slow terminal or pipe. The ring has a single producer
+ * (the event loop) and a single consumer (the logger thread) and is only
+ * synchronized by its head and tail counters.
+ *
+ * If the ring is full, lines are dropped and their count is reported once
+ * the logger thread catches up. Pending lines are written at exit.
+ *
+ * Messages less important than the current level are discarded before
+ * being formatted.
  */
 
 #define BUFFER_LENGTH 512
 
-static char buffer[BUFFER_LENGTH];
+// Ring of pending lines
+// Must be a power of two
+#define LOG_SLOTS 1024
+#define LOG_LINE  256
+
+static char ring[LOG_SLOTS][LOG_LINE];
+static unsigned int ring_head = 0; // Next slot to fill, written by the producer
+static unsigned int ring_tail = 0; // Next slot to write, written by the consumer
+static unsigned int dropped = 0;
+
+static pthread_t logger_thread;
+static sem_t     pending;
+static bool      running  = false;
+static bool      stopping = false;
+
 static char prefix_buffer[BUFFER_LENGTH];
-static char time_buffer[64];
+
+// Time tag of the current second
+static time_t time_cached = 0;
+static char   time_buffer[16];
+
+// Current log level
+logger_level_t logger_level = LOG_INFO;
+
+static const char *level_names[] = {
+    "ERROR", "WARN", "INFO", "DEBUG", "TRACE"
+};
 
 /**
  * Generates the time tag for output
+ * Only formatted again when the second changes.
  */
-static char* time_tag() {
+static const char* time_tag() {
     time_t now = time(0);
-    struct tm *now_struct = localtime(&now);
-    snprintf(time_buffer, 64, "%02i:%02i:%02i", now_struct->tm_hour, now_struct->tm_min, now_struct->tm_sec);
+    if(now != time_cached) {
+        struct tm now_struct;
+        localtime_r(&now, &now_struct);
+        snprintf(time_buffer, 16, "%02i:%02i:%02i", now_struct.tm_hour, now_struct.tm_min, now_struct.tm_sec);
+        time_cached = now;
+    }
     return time_buffer;
 }
 
+/**
+ * Returns the next free slot of the ring, or NULL if full
+ */
+static char *ring_slot() {
+    unsigned int tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if(ring_head - tail >= LOG_SLOTS) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return ring[ring_head & (LOG_SLOTS - 1)];
+}
+
+/**
+ * Hands the slot returned by ring_slot() to the logger thread
+ */
+static void ring_push() {
+    __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    if(running) sem_post(&pending);
+}
+
+/**
+ * Writes every pending lines to stdout
+ */
+static void drain() {
+    unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = ring_tail;
+
+    for(; tail != head; tail++) {
+        fputs(ring[tail & (LOG_SLOTS - 1)], stdout);
+        fputc('\n', stdout);
+    }
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned int lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if(lost) {
+        printf("%8s  %-5s  %u lines dropped\n", "", "LOG", lost);
+    }
+
+    fflush(stdout);
+}
+
+static void *logger_main(void *arg) {
+    while(1) {
+        sem_wait(&pending);
+        drain();
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+    }
+    return NULL;
+}
+
+/**
+ * Stops the logger thread once every pending lines are written
+ */
+static void logger_stop() {
+    if(running) {
+        __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+        sem_post(&pending);
+        pthread_join(logger_thread, NULL);
+        running = false;
+    }
+    drain();
+}
+
+void setup_logger() {
+    sem_init(&pending, 0, 0);
+    if(pthread_create(&logger_thread, NULL, logger_main, NULL) != 0) {
+        // Lines will be written at exit only, better than nothing
+        perror("(logger) pthread_create");
+    } else {
+        running = true;
+        sem_post(&pending);
+    }
+    atexit(logger_stop);
+}
+
+/**
+ * Sets the log level
+ */
+void logger_set_level(logger_level_t level) {
+    logger_level = level;
+}
+
+/**
+ * Returns the level with the given name, or -1 if unknown
+ */
+int logger_level_from_name(const char *name) {
+    for(int i = LOG_ERROR; i <= LOG_TRACE; i++) {
+        if(strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Outputs a formatted line at the given level
+ */
+void logger_log(logger_level_t level, const char *prefix, const char *format, ...) {
+    if(level > logger_level) return;
+
+    char *slot = ring_slot();
+    if(!slot) return;
+
+    int len = snprintf(slot, LOG_LINE, "%s  %-5s  ", time_tag(), prefix);
+    if(len < LOG_LINE) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(slot + len, LOG_LINE - len, format, args);
+        va_end(args);
+    }
+
+    ring_push();
+}
+
 /**
  * Outputs a line
  */
 void logger(const char *prefix, const char* message) {
-    snprintf(buffer, BUFFER_LENGTH, "%s  %-5s  %s", time_tag(), prefix, message);
-    printf("%s\n", buffer);
+    logger_log(LOG_INFO, prefix, "%s", message);
 }
 
 /**
  * Output an error
  */
 void logger_error(const char* message) {
-    snprintf(buffer, BUFFER_LENGTH, "%s  ERROR  %s", time_tag(), message);
-    printf("%s\n", buffer);
+    logger_log(LOG_ERROR, "ERROR", "%s", message);
 }
 
 /**
  * Light output
  */
 void logger_light(const char* message) {
-    snprintf(buffer, BUFFER_LENGTH, "%15s  %s", "", message);
-    printf("%s\n", buffer);
+    if(LOG_INFO > logger_level) return;
+
+    char *slot = ring_slot();
+    if(!slot) return;
+
+    snprintf(slot, LOG_LINE, "%15s  %s", "", message);
+    ring_push();
 }
 
 /**
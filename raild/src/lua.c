@@ -43,26 +43,114 @@ static int call(int nargs, int nres) {
  * Wrapper around call() for event dispatching
  */
 static void dispatch(int nargs) {
-    call(nargs + 1, 0);
+    call(nargs, 0);
+}
+
+// Internal bindings declared by the StdLib with __rd_bind()
+typedef enum {
+    BIND_DEALLOC_CONTEXT,
+    BIND_SWITCH_CONTEXT,
+    BIND_RESTORE_CONTEXT,
+    BIND_DELETE_TIMER,
+    BIND_RESUME_TASK,
+    BIND_WAKE_SENSORS,
+    BIND_COUNT
+} lua_binding;
+
+// Public events dispatched to Lua handlers
+typedef enum {
+    EV_INIT,
+    EV_READY,
+    EV_DISCONNECT,
+    EV_POWER,
+    EV_SENSOR_BATCH,
+    EV_SWITCH_CHANGE,
+    EV_GPIO_CHANGE,
+    EV_STATS,
+    EV_INTERLOCK,
+    EV_COUNT
+} lua_event;
+
+// A function resolved once to a registry slot
+typedef struct {
+    const char *name;
+    int         ref;
+} lua_slot;
+
+static lua_slot bindings[BIND_COUNT] = {
+    { "DeallocContext", LUA_NOREF },
+    { "SwitchContext",  LUA_NOREF },
+    { "RestoreCtx",     LUA_NOREF },
+    { "DeleteTimer",    LUA_NOREF },
+    { "ResumeTask",     LUA_NOREF },
+    { "WakeSensors",    LUA_NOREF }
+};
+
+// Sensors some Lua task is waiting for, one byte per port
+static rbyte sensors_waited[SENSORS_MAX / 8];
+
+// Dispatchers for events with at least one subscriber
+// The slot is LUA_NOREF while nobody is listening to the event
+static lua_slot events[EV_COUNT] = {
+    { "Init",         LUA_NOREF },
+    { "Ready",        LUA_NOREF },
+    { "Disconnect",   LUA_NOREF },
+    { "Power",        LUA_NOREF },
+    { "SensorBatch",  LUA_NOREF },
+    { "SwitchChange", LUA_NOREF },
+    { "GPIOChange",   LUA_NOREF },
+    { "Stats",        LUA_NOREF },
+    { "Interlock",    LUA_NOREF }
+};
+
+/**
+ * Finds a slot by name, returns NULL if no slot matches
+ */
+static lua_slot *find_slot(lua_slot *slots, int count, const char *name) {
+    for(int i = 0; i < count; i++) {
+        if(strcmp(slots[i].name, name) == 0) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stores the function at the given stack index in a slot, or clears
+ * the slot if the value is nil
+ */
+static void set_slot(lua_slot *slot, int idx) {
+    luaL_unref(L, LUA_REGISTRYINDEX, slot->ref);
+    if(lua_isnil(L, idx)) {
+        slot->ref = LUA_NOREF;
+    } else {
+        lua_pushvalue(L, idx);
+        slot->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
 }
 
 /**
  * Prepares to dispatch an internal event
  */
-static void prepare_event_internal(const char *ev) {
+static void prepare_event_internal(lua_binding binding) {
     // Fetch the event function from bindings
-    lua_getfield(L, LUA_REGISTRYINDEX, ev);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, bindings[binding].ref);
 }
 
 /**
  * Prepares an event for dispatching
+ * Returns false without touching the Lua stack if the event has no
+ * subscriber, in which case it must not be dispatched.
  */
-static void prepare_event(const char *ev) {
-    // Fetch the event dispatch handler
-    prepare_event_internal("DispatchEvent");
+static bool prepare_event(lua_event ev) {
+    int ref = events[ev].ref;
+    if(ref == LUA_NOREF) {
+        return false;
+    }
 
-    // Push the event name as first argument
-    lua_pushstring(L, ev);
+    // Fetch the event dispatcher
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    return true;
 }
 
 /**
@@ -91,9 +179,6 @@ void setup_lua(const char *main) {
     }
     call(0, 0);
 
-    // Alloc the main context
-    lua_alloc_context(0, "INTERNAL");
-
     // Load the main script if provided
     if(main) {
         logger("LUA", logger_prefix("Loading local script:", main));
@@ -106,12 +191,20 @@ void setup_lua(const char *main) {
     }
 }
 
+// Cache of compiled API chunks, see chunks.c
+static chunk_cache *eval_cache = NULL;
+
 /**
  * Runs a specific buffer of Lua code
  * Called from the TCP/IP API to run client code
+ *
+ * Compiled chunks are cached so that commands sent over and over again by
+ * API clients are only parsed once.
  */
 void lua_eval(const char *buffer, size_t length) {
-    if(luaL_loadbuffer(L, buffer, length, "API") != 0) {
+    if(!eval_cache) eval_cache = chunk_cache_create();
+
+    if(!chunk_cache_load(L, eval_cache, buffer, length, "API")) {
         logger_error(logger_prefix("Error loading API code:", lua_tostring(L, -1)));
         lua_pop(L, 1);
         return;
@@ -132,6 +225,23 @@ void lua_handle_timer(raild_event *event) {
     call(0, 0);
 }
 
+/**
+ * Wake timer handler
+ * Resumes the task sleeping on this timer
+ */
+void lua_handle_wake(raild_event *event) {
+    prepare_event_internal(BIND_RESUME_TASK);
+
+    // Fetch the task and forget it, this timer is now expired
+    lua_pushlightuserdata(L, event);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, event);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+
+    call(1, 0);
+}
+
 //---------------------------------------------------------------------------//
 // Lua public events
 //---------------------------------------------------------------------------//
@@ -140,7 +250,7 @@ void lua_handle_timer(raild_event *event) {
  * Init event
  */
 void lua_oninit() {
-    prepare_event("Init");
+    if(!prepare_event(EV_INIT)) return;
     dispatch(0);
 }
 
@@ -149,7 +259,7 @@ void lua_oninit() {
  * Fired ever time the RailHub sends a READY opcode
  */
 void lua_onready() {
-    prepare_event("Ready");
+    if(!prepare_event(EV_READY)) return;
     dispatch(0);
 }
 
@@ -159,7 +269,7 @@ void lua_onready() {
  * is now considered disconnected
  */
 void lua_ondisconnect() {
-    prepare_event("Disconnect");
+    if(!prepare_event(EV_DISCONNECT)) return;
     dispatch(0);
 }
 
@@ -168,52 +278,104 @@ void lua_ondisconnect() {
  * Fired when power state status is updated
  */
 void lua_onpower(bool state) {
-    prepare_event("Power");
+    if(!prepare_event(EV_POWER)) return;
     lua_pushboolean(L, state);
     dispatch(1);
 }
 
 /**
- * Sensor changed event
- * Fired when any of the 24 sensors changes state
+ * Sensors batch event
+ * Fired once for every update of one of the 3 sensors ports, with the
+ * mask of changed sensors and the new port value. Per-sensor SensorChange
+ * events are derived from this one by the StdLib.
+ *
+ * Tasks waiting on a sensor with WaitSensor() are resumed from here too,
+ * only if one of their sensors changed.
  */
-void lua_onsensorchange(int sensorid, bool state) {
-    prepare_event("SensorChange");
-    lua_pushnumber(L, sensorid);
-    lua_pushboolean(L, state);
-    dispatch(2);
+void lua_onsensorbatch(int port, rbyte changed, rbyte value, double time) {
+    if(prepare_event(EV_SENSOR_BATCH)) {
+        lua_pushnumber(L, port);
+        lua_pushnumber(L, changed);
+        lua_pushnumber(L, value);
+        lua_pushnumber(L, time);
+        dispatch(4);
+    }
+
+    // Then wake up tasks waiting on one of these sensors, once handlers
+    // have seen the new state
+    rbyte woken = changed & sensors_waited[port - 1];
+    if(woken) {
+        prepare_event_internal(BIND_WAKE_SENSORS);
+        lua_pushnumber(L, port);
+        lua_pushnumber(L, woken);
+        lua_pushnumber(L, value);
+        lua_pushnumber(L, time);
+        call(4, 0);
+    }
 }
 
 /**
  * Switch changed event
  * Fired when any of the 8 switches changes state
  */
-void lua_onswitchchange(int switchid, bool state) {
-    prepare_event("SwitchChange");
+void lua_onswitchchange(int switchid, bool state, double time) {
+    if(!prepare_event(EV_SWITCH_CHANGE)) return;
     lua_pushnumber(L, switchid);
     lua_pushboolean(L, state);
+    lua_pushnumber(L, time);
+    dispatch(3);
+}
+
+/**
+ * GPIO changed event
+ * Fired on every edge of a GPIO pin watched with WatchGPIO()
+ */
+void lua_ongpiochange(int pin, bool state) {
+    if(!prepare_event(EV_GPIO_CHANGE)) return;
+    lua_pushnumber(L, pin);
+    lua_pushboolean(L, state);
     dispatch(2);
 }
 
-//---------------------------------------------------------------------------//
-// Lua internal events
-//---------------------------------------------------------------------------//
+/**
+ * Stats event
+ * Fired every second with the event loop statistics
+ */
+void lua_onstats() {
+    if(!prepare_event(EV_STATS)) return;
+    stats_push(L);
+    dispatch(1);
+}
+
+// Names of interlocking notifications, as given to Lua
+static const char *interlock_names[] = {
+    "EnterA", "EnterB", "EnterC", "Lock", "Unlock",
+    "Change", "BadSensor", "Occupied", "Free"
+};
 
 /**
- * Context allocated event
+ * Interlock event
+ * Fired by the interlocking engine for switches and blocks, with the id
+ * of the switch or block, an event-specific argument and the edge time
  */
-void lua_alloc_context(int fd, const char *cls) {
-    prepare_event_internal("AllocContext");
-    lua_pushnumber(L, fd);
-    lua_pushstring(L, cls);
-    call(2, 0);
+void lua_oninterlock(interlock_event event, int id, int arg, double time) {
+    if(!prepare_event(EV_INTERLOCK)) return;
+    lua_pushstring(L, interlock_names[event]);
+    lua_pushnumber(L, id);
+    lua_pushnumber(L, arg);
+    lua_pushnumber(L, time);
+    dispatch(4);
 }
 
+//---------------------------------------------------------------------------//
+// Lua internal events
+//---------------------------------------------------------------------------//
+
 /**
  * Context deallocated event
  */
 void lua_dealloc_context(int fd) {
-    prepare_event_internal("DeallocContext");
+    prepare_event_internal(BIND_DEALLOC_CONTEXT);
     lua_pushnumber(L, fd);
     call(1, 0);
 }
@@ -222,7 +384,7 @@ void lua_dealloc_context(int fd) {
  * Sets the current script context
  */
 void lua_switch_context(int fd) {
-    prepare_event_internal("SwitchContext");
+    prepare_event_internal(BIND_SWITCH_CONTEXT);
     lua_pushnumber(L, fd);
     call(1, 0);
 }
@@ -231,7 +393,7 @@ void lua_switch_context(int fd) {
  * Removes the script context
  */
 void lua_restore_context() {
-    prepare_event_internal("RestoreCtx");
+    prepare_event_internal(BIND_RESTORE_CONTEXT);
     call(0, 0);
 }
 
@@ -239,7 +401,7 @@ void lua_restore_context() {
  * Timer auto-deletec event
  */
 void lua_delete_timer(void *timer) {
-    prepare_event_internal("DeleteTimer");
+    prepare_event_internal(BIND_DELETE_TIMER);
     lua_pushlightuserdata(L, timer);
     call(1, 0);
 }
@@ -267,6 +429,16 @@ API_DECL(IsHubReady) {
     return 1;
 }
 
+/**
+ * Now()
+ * Returns the cached monotonic time of the current event loop
+ * iteration, in seconds
+ */
+API_DECL(Now) {
+    lua_pushnumber(L, raild_now);
+    return 1;
+}
+
 /**
  * SetPower()
  * Set the power state of the circuit
@@ -291,11 +463,11 @@ API_DECL(IsPowered) {
  */
 API_DECL(GetSwitch) {
     int sid = luaL_checknumber(L, 1);
-    if(sid < 1 || sid > 8) {
+    if(sid < 1 || sid > hub_switches_count()) {
         luaL_error(L, "out of bounds switch id");
     }
 
-    lua_pushboolean(L, get_hub_state(RHUB_SWITCHES) & (1 << (sid - 1)));
+    lua_pushboolean(L, get_switch(sid));
     return 1;
 }
 
@@ -307,16 +479,129 @@ API_DECL(SetSwitch) {
     int  sid   = luaL_checknumber(L, 1);
     bool state = lua_toboolean(L, 2);
 
-    if(sid < 1 || sid > 8) {
+    if(sid < 1 || sid > hub_switches_count()) {
         luaL_error(L, "out of bounds switch id");
     }
 
-    if(state) {
-        uart_setswitch_on(sid - 1);
-    } else {
-        uart_setswitch_off(sid - 1);
+    uart_setswitch(sid, state);
+    return 0;
+}
+
+/**
+ * SetSwitches({ [switch_id] = state, ... })
+ * Request multiple switches modifications with a single command per hub
+ */
+API_DECL(SetSwitches) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    rbyte mask[HUBS_MAX]   = { 0 };
+    rbyte values[HUBS_MAX] = { 0 };
+
+    lua_pushnil(L);
+    while(lua_next(L, 1) != 0) {
+        int sid = lua_tonumber(L, -2);
+        if(sid < 1 || sid > hub_switches_count()) {
+            luaL_error(L, "out of bounds switch id");
+        }
+
+        int port, bit;
+        int hub = hub_locate_switch(sid, &port, &bit);
+
+        mask[hub] |= 1 << bit;
+        if(lua_toboolean(L, -1)) {
+            values[hub] |= 1 << bit;
+        }
+        lua_pop(L, 1);
+    }
+
+    for(int hub = 0; hub < HUBS_MAX; hub++) {
+        if(mask[hub]) {
+            uart_setswitches(hub, mask[hub], values[hub]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * SetTrainSpeed(train_id, pwm[, backward])
+ * Requests a motor PWM value (0 to 255) for a train, and optionally its
+ * direction. Commands of the same iteration are coalesced, see train.c.
+ */
+API_DECL(SetTrainSpeed) {
+    int    id  = luaL_checknumber(L, 1);
+    double pwm = luaL_checknumber(L, 2);
+
+    if(id < 1 || id > TRAINS_MAX) {
+        luaL_error(L, "out of bounds train id");
+    }
+    if(pwm < 0 || pwm > 255) {
+        luaL_error(L, "train speed must be between 0 and 255");
     }
 
+    train_set_speed(id, (rbyte) pwm);
+    if(!lua_isnoneornil(L, 3)) {
+        train_set_direction(id, lua_toboolean(L, 3));
+    }
+    return 0;
+}
+
+/**
+ * GetTrainSpeed(train_id)
+ * Returns the last requested PWM value and direction of a train, or
+ * nothing if no speed was requested for it
+ */
+API_DECL(GetTrainSpeed) {
+    int id = luaL_checknumber(L, 1);
+    if(id < 1 || id > TRAINS_MAX) {
+        luaL_error(L, "out of bounds train id");
+    }
+
+    rbyte pwm;
+    bool  backward;
+    if(!train_get(id, &pwm, &backward)) return 0;
+
+    lua_pushnumber(L, pwm);
+    lua_pushboolean(L, backward);
+    return 2;
+}
+
+/**
+ * LostFrames()
+ * Returns the number of state frames from RailHub detected as lost
+ */
+API_DECL(LostFrames) {
+    lua_pushnumber(L, uart_lost_frames());
+    return 1;
+}
+
+/**
+ * SetLogLevel(level)
+ * Sets the raild log level: "ERROR", "WARN", "INFO", "DEBUG" or "TRACE"
+ */
+API_DECL(SetLogLevel) {
+    int level = logger_level_from_name(luaL_checkstring(L, 1));
+    if(level < 0) {
+        luaL_error(L, "unknown log level");
+    }
+
+    logger_set_level(level);
+    return 0;
+}
+
+/**
+ * SetSwitchLock(switch_id, locked)
+ * Reports the lock state of a switch to binary API clients
+ */
+API_DECL(SetSwitchLock) {
+    int  sid    = luaL_checknumber(L, 1);
+    bool locked = lua_toboolean(L, 2);
+
+    if(sid < 1 || sid > hub_switches_count()) {
+        luaL_error(L, "out of bounds switch id");
+    }
+
+    set_switch_lock(sid, locked);
     return 0;
 }
 
@@ -326,20 +611,239 @@ API_DECL(SetSwitch) {
  */
 API_DECL(GetSensor) {
     int sid = luaL_checknumber(L, 1);
+    if(sid < 1 || sid > hub_sensors_count()) {
+        luaL_error(L, "out of bounds sensor id");
+    }
+
+    lua_pushboolean(L, get_sensor(sid));
+    return 1;
+}
+
+/**
+ * SensorsCount()
+ * Returns the number of sensors of every hubs
+ */
+API_DECL(SensorsCount) {
+    lua_pushnumber(L, hub_sensors_count());
+    return 1;
+}
+
+/**
+ * SwitchesCount()
+ * Returns the number of switches of every hubs
+ */
+API_DECL(SwitchesCount) {
+    lua_pushnumber(L, hub_switches_count());
+    return 1;
+}
+
+/**
+ * WatchGPIO(pin)
+ * Starts watching a GPIO input pin, GPIOChange events will be fired
+ * on every edge of this pin
+ */
+API_DECL(WatchGPIO) {
+    int pin = luaL_checknumber(L, 1);
+    if(!gpio_watch(pin)) {
+        luaL_error(L, "unable to watch GPIO pin %d", pin);
+    }
+
+    return 0;
+}
+
+/**
+ * GetGPIO(pin)
+ * Returns the current state of a watched GPIO input pin
+ */
+API_DECL(GetGPIO) {
+    int pin = luaL_checknumber(L, 1);
+    int value = gpio_read(pin);
+    if(value < 0) {
+        luaL_error(L, "GPIO pin %d is not watched", pin);
+    }
 
-    if(sid < 1 || sid > 24) {
+    lua_pushboolean(L, value);
+    return 1;
+}
+
+/**
+ * EvalCacheStats()
+ * Returns the number of hits and misses of the API code cache
+ */
+API_DECL(EvalCacheStats) {
+    uint32_t hits = 0, misses = 0;
+    if(eval_cache) chunk_cache_stats(eval_cache, &hits, &misses);
+
+    lua_pushnumber(L, hits);
+    lua_pushnumber(L, misses);
+    return 2;
+}
+
+/**
+ * WebSocketClients()
+ * Returns the number of RailMon clients connected to the native endpoint
+ */
+API_DECL(WebSocketClients) {
+    lua_pushnumber(L, ws_count());
+    return 1;
+}
+
+/**
+ * WebSocketSend(json)
+ * Sends an encoded RailMon event to every native WebSocket client
+ */
+API_DECL(WebSocketSend) {
+    size_t len;
+    const char *json = luaL_checklstring(L, 1, &len);
+    ws_publish(json, len);
+    return 0;
+}
+
+/**
+ * Checks that argument `idx` is a valid switch id and returns it
+ */
+static int check_switch(lua_State *L, int idx) {
+    int sid = luaL_checknumber(L, idx);
+    if(sid < 1 || sid > hub_switches_count()) {
         luaL_error(L, "out of bounds switch id");
-    } else if(sid < 9) {
-        lua_pushboolean(L, get_hub_state(RHUB_SENSORS1) & (1 << (sid - 1)));
-    } else if(sid < 17) {
-        lua_pushboolean(L, get_hub_state(RHUB_SENSORS2) & (1 << (sid - 9)));
-    } else {
-        lua_pushboolean(L, get_hub_state(RHUB_SENSORS3) & (1 << (sid - 17)));
     }
+    return sid;
+}
+
+static int check_sensor(lua_State *L, int idx) {
+    int sid = luaL_checknumber(L, idx);
+    if(sid < 1 || sid > hub_sensors_count()) {
+        luaL_error(L, "out of bounds sensor id");
+    }
+    return sid;
+}
+
+/**
+ * InterlockSwitch(switch_id, a, b, c)
+ * Hands a switch and its three sensors to the interlocking engine
+ */
+API_DECL(InterlockSwitch) {
+    int sid = check_switch(L, 1);
+    int a = check_sensor(L, 2);
+    int b = check_sensor(L, 3);
+    int c = check_sensor(L, 4);
+
+    if(!interlock_switch_enable(sid, a, b, c)) {
+        luaL_error(L, "switch already interlocked");
+    }
+    return 0;
+}
+
+/**
+ * InterlockRelease(switch_id)
+ * Removes a switch from the interlocking engine, unlocking it
+ */
+API_DECL(InterlockRelease) {
+    interlock_switch_disable(check_switch(L, 1));
+    return 0;
+}
+
+/**
+ * InterlockSetState(switch_id, state)
+ * Moves an interlocked switch now, or once unlocked if it is locked
+ */
+API_DECL(InterlockSetState) {
+    interlock_set_state(check_switch(L, 1), lua_toboolean(L, 2));
+    return 0;
+}
+
+/**
+ * InterlockGetSwitch(switch_id)
+ * Returns enabled, state, locked
+ */
+API_DECL(InterlockGetSwitch) {
+    bool state, locked;
+    lua_pushboolean(L, interlock_get_switch(check_switch(L, 1), &state, &locked));
+    lua_pushboolean(L, state);
+    lua_pushboolean(L, locked);
+    return 3;
+}
+
+/**
+ * SetInterlockDelay(ms)
+ * Delay before unlocking a switch once the train left its exit sensor
+ */
+API_DECL(SetInterlockDelay) {
+    interlock_set_delay(luaL_checknumber(L, 1));
+    return 0;
+}
+
+/**
+ * InterlockBlock(sensor_id, ...)
+ * Declares a block made of the given sensors, returns its id
+ */
+API_DECL(InterlockBlock) {
+    int count = lua_gettop(L);
+    if(count < 1 || count > SENSORS_MAX) {
+        luaL_error(L, "invalid block sensors");
+    }
+
+    int sensors[count];
+    for(int i = 0; i < count; i++) {
+        sensors[i] = check_sensor(L, i + 1);
+    }
+
+    int id = interlock_add_block(sensors, count);
+    if(id < 0) {
+        luaL_error(L, "too many blocks");
+    }
+
+    lua_pushnumber(L, id);
+    return 1;
+}
 
+/**
+ * IsBlockOccupied(block_id)
+ */
+API_DECL(IsBlockOccupied) {
+    lua_pushboolean(L, interlock_block_occupied(luaL_checknumber(L, 1)));
     return 1;
 }
 
+/**
+ * Stats([reset])
+ * Returns the event loop statistics, then resets them if reset is true
+ */
+API_DECL(Stats) {
+    bool reset = lua_toboolean(L, 1);
+    stats_push(L);
+    if(reset) {
+        stats_reset();
+    }
+    return 1;
+}
+
+/**
+ * SetSensorDebounce(sensor_id, delay)
+ * Sets the debounce delay of a sensor in milliseconds
+ * A nil delay reverts to the default one
+ */
+API_DECL(SetSensorDebounce) {
+    int sid = luaL_checknumber(L, 1);
+    int ms  = lua_isnoneornil(L, 2) ? -1 : luaL_checknumber(L, 2);
+
+    if(sid < 1 || sid > hub_sensors_count()) {
+        luaL_error(L, "out of bounds sensor id");
+    }
+
+    set_sensor_debounce(sid, ms);
+    return 0;
+}
+
+/**
+ * SetDefaultDebounce(delay)
+ * Sets the debounce delay of every sensors without a specific one
+ */
+API_DECL(SetDefaultDebounce) {
+    set_default_debounce(luaL_checknumber(L, 1));
+    return 0;
+}
+
 //---------------------------------------------------------------------------//
 // LUA Private API
 // C functions to be wrapped and then called by internal Lua code
@@ -355,16 +859,42 @@ API_DECL(__rd_bind) {
 
     // Function handler
     luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue (L, 2);
 
-    // Set it in registry
-    lua_setfield(L, LUA_REGISTRYINDEX, binding);
+    lua_slot *slot = find_slot(bindings, BIND_COUNT, binding);
+    if(!slot) {
+        luaL_error(L, "unknown internal binding: %s", binding);
+    }
+
+    // Resolve it to a registry slot
+    set_slot(slot, 2);
+    return 0;
+}
+
+/**
+ * __rd_subscribe(event, dispatcher)
+ * Sets the function called when a C event is fired
+ *
+ * Called by the StdLib when the first handler is attached to an event,
+ * and with a nil dispatcher once the last one is removed. Events that are
+ * not fired by C are ignored.
+ */
+API_DECL(__rd_subscribe) {
+    const char* event = luaL_checkstring(L, 1);
+    if(!lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    }
+
+    lua_slot *slot = find_slot(events, EV_COUNT, event);
+    if(slot) {
+        set_slot(slot, 2);
+    }
+
     return 0;
 }
 
 /**
- * __rd_send(data)
- * Sends a data string to the remote point of the API
+ * __rd_send(data, fd)
+ * Queues a data string to be sent to the remote point of the API
  */
 API_DECL(__rd_send) {
     luaL_checkstring(L, 1);
@@ -372,7 +902,7 @@ API_DECL(__rd_send) {
 
     size_t len;
     const char *buffer = lua_tolstring(L, 1, &len);
-    write(fd, buffer, len);
+    socket_send(fd, buffer, len);
 
     return 0;
 }
@@ -428,6 +958,86 @@ API_DECL(__rd_cancel_timer) {
     return 0;
 }
 
+/**
+ * __rd_ctx_class(ctx)
+ * Returns the class of a context, nil if it does not exist
+ * Contexts are the fds watched by epoll, 0 being the internal context.
+ */
+API_DECL(__rd_ctx_class) {
+    int ctx = luaL_checknumber(L, 1);
+    if(ctx == 0) {
+        lua_pushstring(L, "INTERNAL");
+    } else {
+        const char *cls = raild_epoll_class(ctx);
+        if(cls) {
+            lua_pushstring(L, cls);
+        } else {
+            lua_pushnil(L);
+        }
+    }
+    return 1;
+}
+
+/**
+ * __rd_wake(delay, task)
+ * Creates a one-time timer resuming `task` after `delay` milliseconds
+ * The task is given back to the ResumeTask binding of the StdLib.
+ */
+API_DECL(__rd_wake) {
+    int delay = luaL_checknumber(L, 1);
+    luaL_checkany(L, 2);
+
+    raild_event *event = raild_timer_create(delay, 0, RAILD_EV_WAKE_TIMER);
+
+    // Keep the task until the timer fires
+    lua_pushlightuserdata(L, event);
+    lua_pushvalue(L, 2);
+    lua_settable(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, event);
+    return 1;
+}
+
+/**
+ * __rd_cancel_wake(timer)
+ * Cancels a wake timer, does nothing if it already fired
+ */
+API_DECL(__rd_cancel_wake) {
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    raild_event *event = (raild_event *) lua_touserdata(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, -1)) return 0;
+
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+    raild_timer_delete(event);
+
+    return 0;
+}
+
+/**
+ * __rd_wait_sensor(sid, waited)
+ * Tells whether some task is waiting on a sensor
+ */
+API_DECL(__rd_wait_sensor) {
+    int sid = luaL_checknumber(L, 1);
+    if(sid < 1 || sid > hub_sensors_count()) {
+        luaL_error(L, "out of bounds sensor id");
+    }
+
+    rbyte mask = 1 << ((sid - 1) % 8);
+    if(lua_toboolean(L, 2)) {
+        sensors_waited[(sid - 1) / 8] |= mask;
+    } else {
+        sensors_waited[(sid - 1) / 8] &= ~mask;
+    }
+
+    return 0;
+}
+
 /**
  * __rd_unregister_timer(timer)
  * Removes the callback from the internal callbacks table
@@ -450,17 +1060,46 @@ luaL_Reg raild_api[] = {
     API_LINK(exit),
 
     API_LINK(IsHubReady),
+    API_LINK(Now),
     API_LINK(SetPower),
     API_LINK(IsPowered),
     API_LINK(GetSwitch),
     API_LINK(SetSwitch),
+    API_LINK(SetSwitches),
+    API_LINK(SetTrainSpeed),
+    API_LINK(GetTrainSpeed),
+    API_LINK(LostFrames),
+    API_LINK(SetLogLevel),
+    API_LINK(SetSwitchLock),
+    API_LINK(InterlockSwitch),
+    API_LINK(InterlockRelease),
+    API_LINK(InterlockSetState),
+    API_LINK(InterlockGetSwitch),
+    API_LINK(SetInterlockDelay),
+    API_LINK(InterlockBlock),
+    API_LINK(IsBlockOccupied),
     API_LINK(GetSensor),
+    API_LINK(SensorsCount),
+    API_LINK(SwitchesCount),
+    API_LINK(SetSensorDebounce),
+    API_LINK(SetDefaultDebounce),
+    API_LINK(WatchGPIO),
+    API_LINK(GetGPIO),
+    API_LINK(EvalCacheStats),
+    API_LINK(Stats),
+    API_LINK(WebSocketClients),
+    API_LINK(WebSocketSend),
 
     API_LINK(__rd_bind),
+    API_LINK(__rd_subscribe),
     API_LINK(__rd_send),
     API_LINK(__rd_create_timer),
     API_LINK(__rd_cancel_timer),
     API_LINK(__rd_unregister_timer),
+    API_LINK(__rd_ctx_class),
+    API_LINK(__rd_wake),
+    API_LINK(__rd_cancel_wake),
+    API_LINK(__rd_wait_sensor),
     { NULL, NULL }
 };
 
@@ -469,4 +1108,6 @@ luaL_Reg raild_api[] = {
  */
 void lualib_register() {
     luaL_register(L, NULL, raild_api);
+    lualib_json_register(L);
+    lualib_rolling_register();
 }
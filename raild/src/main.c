@@ -9,11 +9,285 @@
  * Because everything is built around epoll() feature available in Linux
  * kernels, every manageable events have to expose a file description
  * interface as to be compatible with epoll.
+ *
+ * Timers are the exception: they are kept in a heap by timer.c and
+ * collected after each epoll_wait() call, whose timeout is bounded by
+ * the next timer deadline.
+ *
+ * Events of an iteration are dispatched by priority class rather than in
+ * the order returned by the kernel: RailHub communication first, then Lua
+ * timers and tasks, then API clients. API clients only get a time budget
+ * per iteration, clients not handled within it wait for the next one. Their
+ * fds are level-triggered, so epoll simply reports them again.
+ */
+
+// Time budget of low priority events in one loop iteration (µs)
+#ifndef LOW_PRIORITY_BUDGET
+#define LOW_PRIORITY_BUDGET 5000
+#endif
+
+// Default port of the HTTP/WebSocket endpoint, see http.c
+#ifndef HTTP_PORT
+#define HTTP_PORT 8080
+#endif
+
+// Monotonic time of the current event loop iteration, in seconds
+// Cached to be used by Lua scripts without any syscall
+double raild_now = 0;
+
+// Speed of the raild clock relative to the monotonic clock, see journal.c
+// raild_now is clock_base + (monotonic - monotonic_base) * raild_time_scale
+double raild_time_scale = 1;
+static double clock_base     = 0;
+static double monotonic_base = 0;
+
+// Events of the current iteration, by priority class
+typedef struct {
+    raild_event **events;
+    int           len;
+    int           size;
+} event_queue;
+
+static event_queue queues[RAILD_PRIOS];
+
+/**
+ * Returns the priority class of an event type
  */
+raild_priority raild_event_priority(raild_event_type type) {
+    switch(type) {
+        case RAILD_EV_UART:
+        case RAILD_EV_UART_TIMER:
+        case RAILD_EV_GPIO:
+        case RAILD_EV_DEBOUNCE_TIMER:
+        case RAILD_EV_REPLAY_TIMER:
+        case RAILD_EV_INTERLOCK_TIMER:
+            return RAILD_PRIO_HIGH;
+
+        case RAILD_EV_SERVER:
+        case RAILD_EV_SOCKET:
+            return RAILD_PRIO_LOW;
+
+        default:
+            return RAILD_PRIO_NORMAL;
+    }
+}
+
+/**
+ * Queues an event to be dispatched with its priority class
+ */
+static void enqueue(raild_event *event) {
+    event_queue *queue = &queues[event->priority];
+    if(queue->len == queue->size) {
+        queue->size = queue->size ? queue->size * 2 : 64;
+        queue->events = realloc(queue->events, queue->size * sizeof(raild_event *));
+        if(!queue->events) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    queue->events[queue->len++] = event;
+}
+
+/**
+ * Current monotonic time in microseconds
+ */
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Updates the cached loop time
+ */
+static void update_now(const struct timespec *tp) {
+    double monotonic = tp->tv_sec + tp->tv_nsec / 1e9;
+    raild_now = clock_base + (monotonic - monotonic_base) * raild_time_scale;
+}
+
+/**
+ * Makes the raild clock run `scale` times faster than real time from now
+ * on, every timers following it. Used to replay journals accelerated.
+ */
+void raild_set_time_scale(double scale) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    update_now(&tp);
+
+    clock_base       = raild_now;
+    monotonic_base   = tp.tv_sec + tp.tv_nsec / 1e9;
+    raild_time_scale = scale;
+}
+
+/**
+ * Dispatch one event to the module handling it
+ */
+static void dispatch(raild_event *event, const struct timespec *tp) {
+    // Removed or canceled by an event dispatched before it
+    if(event->purge) {
+        if(event->timer) raild_timer_autodelete(event);
+        return;
+    }
+
+    // Add time informations
+    event->time = *tp;
+
+    uint64_t begin = stats_dispatch_begin();
+    if(event->timer) {
+        stats_timer(event);
+    }
+
+    // Dispatch events
+    switch(event->type) {
+        case RAILD_EV_UART:
+            uart_handle_event(event);
+            break;
+
+        case RAILD_EV_UART_TIMER:
+            uart_handle_timer(event);
+            break;
+
+        case RAILD_EV_LUA_TIMER:
+            lua_handle_timer(event);
+            break;
+
+        case RAILD_EV_SERVER:
+            socket_handle_server(event);
+            break;
+
+        case RAILD_EV_SOCKET:
+            socket_handle_client(event);
+            break;
+
+        case RAILD_EV_GPIO:
+            gpio_handle_event(event);
+            break;
+
+        case RAILD_EV_STATS_TIMER:
+            stats_handle_timer(event);
+            break;
+
+        case RAILD_EV_DEBOUNCE_TIMER:
+            hub_handle_debounce(event);
+            break;
+
+        case RAILD_EV_REPLAY_TIMER:
+            journal_handle_replay(event);
+            break;
+
+        case RAILD_EV_WAKE_TIMER:
+            lua_handle_wake(event);
+            break;
+
+        case RAILD_EV_INTERLOCK_TIMER:
+            interlock_handle_timer(event);
+            break;
+
+        case RAILD_EV_TRAIN_TIMER:
+            train_handle_timer(event);
+            break;
 
+        case RAILD_EV_TRAIN:
+            train_handle_event(event);
+            break;
+
+        case RAILD_EV_WORKER:
+            worker_handle_event(event);
+            break;
+
+        default:
+            logger("EPOLL", "Got event on an unmanageable fd type");
+            exit(1);
+    }
+
+    // Must be recorded before the event is collected
+    stats_dispatch_end(event->type, begin);
+
+    if(event->timer) {
+        // Collect or reschedule the timer
+        raild_timer_autodelete(event);
+    }
+}
+
+
+/**
+ * Usage: raild [-l level] [-u uart_path] [-j journal] [-r journal [-x speed]] [-w port] [-s dir] [-t train_path] [script.lua]
+ *   -l  log level: ERROR, WARN, INFO (default), DEBUG or TRACE
+ *   -u  UART device to use, repeated for every RailHub
+ *   -j  records a journal of the session
+ *   -r  replays a journal instead of using the UART
+ *   -x  replay acceleration factor, 0 for as fast as possible without debounce
+ *   -w  port of the RailMon HTTP/WebSocket endpoint, 0 to disable
+ *   -s  directory of the RailMon static files
+ *   -t  serial device of the trains speed commands channel
+ */
 int main(int argc, char **argv) {
+    const char *uart_paths[HUBS_MAX];
+    int uarts = 0;
+    const char *journal_path = NULL;
+    const char *replay_path = NULL;
+    double replay_speed = 1;
+    int http_port = HTTP_PORT;
+    const char *http_root = NULL;
+    const char *train_path = NULL;
+
+    setup_logger();
+
+    int opt, level;
+    while((opt = getopt(argc, argv, "l:u:j:r:x:w:s:t:")) != -1) {
+        switch(opt) {
+            case 'l':
+                if((level = logger_level_from_name(optarg)) < 0) {
+                    fprintf(stderr, "Unknown log level: %s\n", optarg);
+                    exit(1);
+                }
+                logger_set_level(level);
+                break;
+
+            case 'u':
+                if(uarts == HUBS_MAX) {
+                    fprintf(stderr, "Too many UARTs\n");
+                    exit(1);
+                }
+                uart_paths[uarts++] = optarg;
+                break;
+
+            case 'j':
+                journal_path = optarg;
+                break;
+
+            case 'r':
+                replay_path = optarg;
+                break;
+
+            case 'x':
+                replay_speed = atof(optarg);
+                break;
+
+            case 'w':
+                http_port = atoi(optarg);
+                break;
+
+            case 's':
+                http_root = optarg;
+                break;
+
+            case 't':
+                train_path = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-l level] [-u uart_path] [-j journal] [-r journal [-x speed]] [-w port] [-s dir] [-t train_path] [script.lua]\n", argv[0]);
+                exit(1);
+        }
+    }
+
     logger("RAILD", "Starting raild...");
 
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    update_now(&tp);
+
     // --- SETUP ---
 
     // GPIO
@@ -22,14 +296,44 @@ int main(int argc, char **argv) {
     // Epoll
     raild_epoll_create();
 
-    // Lua
-    setup_lua((argc > 1) ? argv[1] : NULL);
+    // Journal
+    if(journal_path) {
+        setup_journal(journal_path);
+    }
 
-    // UART
-    setup_uart();
+    // UART, or the journal replacing it
+    // Hubs are registered first, so that Lua scripts know every sensors
+    if(replay_path) {
+        setup_replay(replay_path, replay_speed);
+    } else {
+        if(uarts == 0) {
+            uart_add(NULL);
+        }
+        for(int i = 0; i < uarts; i++) {
+            uart_add(uart_paths[i]);
+        }
+        setup_uart();
+    }
 
-    // Socket
+    // Trains speed commands, only if their channel is given
+    if(train_path) {
+        setup_train(train_path);
+    }
+
+    // Shared-memory state snapshot
+    setup_shm();
+
+    // Lua, and the interlocking engine its scripts configure
+    setup_interlock();
+    setup_lua((optind < argc) ? argv[optind] : NULL);
+
+    // Socket, and the worker running API clients scripts
+    setup_worker();
     setup_socket();
+    setup_http(http_port, http_root);
+
+    // Statistics
+    setup_stats();
 
     lua_oninit();
     logger("RAILD", "Setup completed!");
@@ -38,75 +342,65 @@ int main(int argc, char **argv) {
     // Spinning during the entire life of raild
     while(1) {
         // Wait for events to handle
+        // An idle loop still has to check timers
         int n = raild_epoll_wait();
-        if(n < 1) {
-            // Event loop idle
-            // Just wait again
-            continue;
-        }
+        stats_batch(n);
 
         // Fetching the current time
-        struct timespec tp;
-        clock_gettime(CLOCK_REALTIME, &tp);
+        // Every events of this batch share this timestamp
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        update_now(&tp);
 
-        // Handle each event one by one
+        // Sort events and expired timers by priority class
         for(int i = 0; i < n; i++) {
             // Extract the raild_event struct from the event
-            raild_event *event = event_data(i);
-
-            // Add time informations
-            event->time = tp;
-
-            // Filter function for timers
-            // Timers fds are automatically read and their 'proc'
-            // count is stored in the 'times' field of the raild_event
-            if(event->timer) {
-                uint64_t times;
-                if(read(event->fd, &times, 8) != 8) {
-                    // This event did not really happened. Just ignore it.
-                    continue;
-                } else {
-                    event->times = (int) times;
-                }
-            }
+            enqueue(event_data(i));
+        }
 
-            // Dispatch events
-            switch(event->type) {
-                case RAILD_EV_UART:
-                    uart_handle_event(event);
-                    break;
+        raild_event *timer;
+        while((timer = raild_timer_next(&tp))) {
+            enqueue(timer);
+        }
 
-                case RAILD_EV_UART_TIMER:
-                    uart_handle_timer(event);
-                    break;
+        // Higher classes are entirely dispatched
+        for(int p = RAILD_PRIO_HIGH; p < RAILD_PRIO_LOW; p++) {
+            for(int i = 0; i < queues[p].len; i++) {
+                dispatch(queues[p].events[i], &tp);
+            }
+            queues[p].len = 0;
+        }
 
-                case RAILD_EV_LUA_TIMER:
-                    lua_handle_timer(event);
-                    break;
+        // Low priority events within the budget, at least one
+        // Expired timers are never deferred, they left the heap already.
+        event_queue *low = &queues[RAILD_PRIO_LOW];
+        uint64_t start = now_us();
+        int dispatched = 0, deferred = 0;
+        for(int i = 0; i < low->len; i++) {
+            raild_event *event = low->events[i];
+            if(dispatched > 0 && !event->timer && now_us() - start > LOW_PRIORITY_BUDGET) {
+                deferred++;
+                continue;
+            }
+            dispatch(event, &tp);
+            dispatched++;
+        }
+        low->len = 0;
+        stats_deferred(deferred);
 
-                case RAILD_EV_SERVER:
-                    socket_handle_server(event);
-                    break;
+        // Send every commands queued for RailHub during this iteration
+        uart_flush();
 
-                case RAILD_EV_SOCKET:
-                    socket_handle_client(event);
-                    break;
+        // Send speed commands requested during this iteration
+        train_flush();
 
-                default:
-                    logger("EPOLL", "Got event on an unmanageable fd type");
-                    exit(1);
-            }
+        // Send output queued for API clients
+        socket_flush();
 
-            // Auto delete feature for non-repeatable timer events
-            if(!event->purge && event->timer) {
-                raild_timer_autodelete(event);
-            }
+        // Publish the new state to shared-memory readers
+        shm_flush();
 
-            // If this event is marked for purge at the end of the event loop
-            if(event->purge) {
-                raild_epoll_purge(event);
-            }
-        }
+        // Recycle events removed during this iteration
+        raild_epoll_collect();
     }
 
     return 0;
@@ -26,6 +26,18 @@ typedef enum {
     RHUB_SWITCHES
 } rhub_port;
 
+// Number of ports on RailHub
+#define RHUB_PORTS 4
+#define RHUB_SENSOR_PORTS 3
+#define RHUB_SWITCH_PORTS 1
+
+// Limits of the hubs state table
+#ifndef HUBS_MAX
+#define HUBS_MAX     8
+#endif
+#define SENSORS_MAX  512
+#define SWITCHES_MAX 128
+
 // fd type indicator for epoll events
 typedef enum {
     RAILD_EV_UART,       // New data available to read from RailHub
@@ -33,8 +45,26 @@ typedef enum {
     RAILD_EV_SERVER,     // Events from the TCP/IP server
     RAILD_EV_SOCKET,     // Events from a TCP/IP client
     RAILD_EV_LUA_TIMER,  // Timer created by Lua scripts
+    RAILD_EV_GPIO,       // Edge on a watched GPIO input pin
+    RAILD_EV_STATS_TIMER, // Statistics publication timer
+    RAILD_EV_DEBOUNCE_TIMER, // Sensors debounce timer
+    RAILD_EV_REPLAY_TIMER, // Journal replay timer
+    RAILD_EV_WAKE_TIMER, // Timer resuming a sleeping Lua task
+    RAILD_EV_WORKER,     // Messages from the API worker thread
+    RAILD_EV_INTERLOCK_TIMER, // Switch unlock delay
+    RAILD_EV_TRAIN_TIMER, // Trains state refresh
+    RAILD_EV_TRAIN,      // Trains channel accepts output again
 } raild_event_type;
 
+// Dispatch priority classes, see main.c
+typedef enum {
+    RAILD_PRIO_HIGH,   // RailHub communication and hub timers
+    RAILD_PRIO_NORMAL, // Lua timers and tasks, API worker messages
+    RAILD_PRIO_LOW     // API clients, dispatched within a time budget
+} raild_priority;
+
+#define RAILD_PRIOS 3
+
 // user data struct for epoll events
 // This struct holds various informations about an event and
 // is the main object passed around when dealing with events
@@ -42,17 +72,43 @@ typedef enum {
 typedef struct raild_event_t {
     int                   fd;    // The associated file descriptor
     raild_event_type      type;  // Event type flag
-    struct timespec       time;  // Event trigger timestamp
+    raild_priority        priority; // Dispatch priority class
+    struct timespec       time;  // Event trigger timestamp (CLOCK_MONOTONIC)
     bool                  timer; // TRUE if this event is a timer
     int                   times; // Number of times this timer was triggered since the last event
     int                   n;     // User-defined number
     void                 *ptr;   // User-defined pointer
     bool                  purge; // True when this event is ready to be collected
+    bool                  readable; // Data is available for reading on fd
+    bool                  writable; // fd is ready to accept more data
+
+    // Timer-specific fields
+    uint64_t              deadline; // Next expiration (monotonic, nanoseconds)
+    uint64_t              interval; // Repeat interval (ns), 0 for one-time timers
+    int                   slot;     // Index in the timer heap, -1 when not scheduled
 } raild_event;
 
 // A single byte of 8-bit used for communication with RailHub
 typedef unsigned char rbyte;
 
+// Types of journal records
+typedef enum {
+    JOURNAL_UART_RX = 1, // Bytes received from RailHub
+    JOURNAL_UART_TX,     // Frame sent to RailHub
+    JOURNAL_POWER,       // Power state transition [state]
+    JOURNAL_READY        // Readiness transition of a hub [ready]
+} journal_type;
+
+//---------------------------------------------------------------------------//
+// Time
+//---------------------------------------------------------------------------//
+// Monotonic time of the current event loop iteration, in seconds
+// Runs `raild_time_scale` times faster than real time when replaying
+extern double raild_now;
+extern double raild_time_scale;
+
+void raild_set_time_scale(double scale);
+
 //---------------------------------------------------------------------------//
 // SETUP
 //---------------------------------------------------------------------------//
@@ -60,21 +116,57 @@ void setup_socket();
 void setup_uart();
 void setup_gpio();
 void setup_lua(const char *main);
+void setup_stats();
+void setup_journal(const char *path);
+void setup_replay(const char *path, double speed);
+void setup_shm();
+void setup_worker();
+void setup_interlock();
+void setup_http(int port, const char *path);
+void setup_train(const char *path);
 
 //---------------------------------------------------------------------------//
 // GPIO
 //---------------------------------------------------------------------------//
+// Number of GPIO pins that can be watched
+#define GPIO_MAX 64
+
 void set_gpio(bool state);
+bool gpio_watch(int pin);
+int  gpio_read(int pin);
+void gpio_handle_event(raild_event *event);
 
 //---------------------------------------------------------------------------//
 // State
 //---------------------------------------------------------------------------//
-void  set_hub_state(rhub_port port, rbyte value);
-rbyte get_hub_state(rhub_port port);
-void  set_hub_readiness(bool r);
+int   hub_register(int sensor_ports, int switch_ports);
+int   hub_sensors_count();
+int   hub_switches_count();
+int   hub_locate_switch(int sid, int *port, int *bit);
+void  set_hub_sensors(int hub, int port, rbyte value, double time);
+void  set_hub_switches(int hub, int port, rbyte value, double time);
+void  set_hub_full_state(int hub, const rbyte *values, double time);
+rbyte get_hub_switches(int hub, int port);
+bool  get_sensor(int sid);
+bool  get_switch(int sid);
+rbyte get_sensors_port(int port);
+rbyte get_switches_port(int port);
+rbyte get_locks_port(int port);
+void  set_hub_readiness(int hub, bool r);
 bool  get_hub_readiness();
 void  set_power(bool p);
 bool  get_power();
+void  set_switch_lock(int sid, bool locked);
+void  hub_export(uint64_t *sensors, uint64_t *switches, uint64_t *locks);
+void  set_sensor_debounce(int sid, int ms);
+void  set_default_debounce(int ms);
+void  set_debounce_enabled(bool enabled);
+void  hub_handle_debounce(raild_event *event);
+
+//---------------------------------------------------------------------------//
+// Event loop
+//---------------------------------------------------------------------------//
+raild_priority raild_event_priority(raild_event_type type);
 
 //---------------------------------------------------------------------------//
 // Epoll wrappers
@@ -84,7 +176,12 @@ extern struct epoll_event *epoll_events;
 void         raild_epoll_create();
 raild_event *raild_epoll_add(int fd, raild_event_type type);
 void         raild_epoll_rem(raild_event *udata);
-void         raild_epoll_purge(raild_event *event);
+void         raild_epoll_want_write(raild_event *event, bool enable);
+void         raild_epoll_collect();
+raild_event *raild_epoll_get(int fd);
+const char  *raild_epoll_class(int fd);
+raild_event *raild_event_alloc();
+void         raild_event_free(raild_event *event);
 int          raild_epoll_wait();
 raild_event *event_data(int n);
 
@@ -94,47 +191,196 @@ raild_event *event_data(int n);
 raild_event *raild_timer_create(int initial, int interval, raild_event_type type);
 void         raild_timer_delete(raild_event *event);
 void         raild_timer_autodelete(raild_event *event);
+int          raild_timer_timeout(int max);
+raild_event *raild_timer_next(const struct timespec *now);
 
 //---------------------------------------------------------------------------//
 // UART
 //---------------------------------------------------------------------------//
-void uart_reset();
-void uart_setswitch_on(rbyte sid);
-void uart_setswitch_off(rbyte sid);
+void uart_flush();
+void uart_add(const char *path);
+void uart_add_offline();
+void uart_setswitch(int sid, bool state);
+void uart_setswitches(int hub, rbyte mask, rbyte values);
+unsigned int uart_lost_frames();
 void uart_setpower(bool state);
+void uart_sethubpower(int hub, bool state);
 void uart_handle_event(raild_event *event);
 void uart_handle_timer(raild_event *event);
+void uart_feed(int hub, const rbyte *data, int len, double time);
+
+//---------------------------------------------------------------------------//
+// Trains
+//---------------------------------------------------------------------------//
+// Train ids are 1 to TRAINS_MAX
+#define TRAINS_MAX 16
+
+void train_set_speed(int id, rbyte pwm);
+void train_set_direction(int id, bool backward);
+bool train_get(int id, rbyte *pwm, bool *backward);
+void train_flush();
+void train_handle_timer(raild_event *event);
+void train_handle_event(raild_event *event);
+
+//---------------------------------------------------------------------------//
+// Interlock
+//---------------------------------------------------------------------------//
+// Notifications of the interlocking engine to Lua
+typedef enum {
+    INTERLOCK_ENTER_A,
+    INTERLOCK_ENTER_B,
+    INTERLOCK_ENTER_C,
+    INTERLOCK_LOCK,
+    INTERLOCK_UNLOCK,
+    INTERLOCK_CHANGE,     // [state]
+    INTERLOCK_BAD_SENSOR, // [sensor id]
+    INTERLOCK_OCCUPIED,   // Blocks
+    INTERLOCK_FREE
+} interlock_event;
+
+void interlock_sensors(int port, rbyte changed, rbyte value, double time);
+void interlock_handle_timer(raild_event *event);
+bool interlock_switch_enable(int sid, int a, int b, int c);
+void interlock_switch_disable(int sid);
+void interlock_set_state(int sid, bool state);
+bool interlock_get_switch(int sid, bool *state, bool *locked);
+void interlock_set_delay(int ms);
+int  interlock_add_block(const int *sensors, int count);
+bool interlock_block_occupied(int id);
 
 //---------------------------------------------------------------------------//
 // Socket
 //---------------------------------------------------------------------------//
 void socket_handle_server(raild_event *event);
 void socket_handle_client(raild_event *event);
+void socket_send(int fd, const char *data, size_t length);
+bool socket_session_alive(int fd, unsigned int session);
+void socket_flush();
+void socket_publish_sensors(int port, rbyte changed, rbyte value);
+void socket_publish_switches(int port, rbyte changed, rbyte value);
+void socket_publish_lock(int sid, bool locked);
+void socket_publish_power(bool state);
+void socket_publish_ready(bool ready);
+void socket_listen(int port, bool http);
+raild_event *socket_attach(int fd, bool http);
+void socket_ws_broadcast(const char *data, size_t length);
+
+//---------------------------------------------------------------------------//
+// HTTP
+//---------------------------------------------------------------------------//
+// WebSocket opcodes
+#define WS_TEXT  0x1
+#define WS_CLOSE 0x8
+#define WS_PING  0x9
+#define WS_PONG  0xA
+
+bool http_handle_request(int fd, const char *request, int len);
+int  ws_parse_frame(rbyte *buffer, int len, int *opcode, rbyte **payload, int *payload_len);
+void ws_send(int fd, int opcode, const char *data, size_t len);
+void ws_send_sync(int fd);
+void ws_publish(const char *payload, size_t len);
+int  ws_count();
+void ws_closed();
+void ws_publish_sensors(int port, rbyte changed, rbyte value);
+void ws_publish_switches(int port, rbyte changed, rbyte value);
+void ws_publish_lock(int sid, bool locked);
+void ws_publish_power(bool state);
+void ws_publish_ready(bool ready);
 
 //---------------------------------------------------------------------------//
 // Lua
 //---------------------------------------------------------------------------//
+struct lua_State;
+
 void lualib_register();
+void lualib_json_register(struct lua_State *L);
+void lualib_rolling_register();
+
+// Compiled chunks cache of a Lua state, see chunks.c
+typedef struct chunk_cache chunk_cache;
+
+chunk_cache *chunk_cache_create();
+void         chunk_cache_free(chunk_cache *cache);
+bool         chunk_cache_load(struct lua_State *L, chunk_cache *cache, const char *buffer, size_t length, const char *name);
+void         chunk_cache_stats(chunk_cache *cache, uint32_t *hits, uint32_t *misses);
 void lua_eval(const char *buffer, size_t length);
 
-void lua_alloc_context(int fd, const char *cls);
 void lua_dealloc_context(int fd);
 void lua_switch_context(int fd);
 void lua_restore_context();
 
 void lua_handle_timer(raild_event *event);
+void lua_handle_wake(raild_event *event);
 void lua_delete_timer(void *timer);
 
 void lua_oninit();
 void lua_onready();
 void lua_ondisconnect();
 void lua_onpower(bool state);
-void lua_onsensorchange(int sensorid, bool state);
-void lua_onswitchchange(int switchid, bool state);
+void lua_onsensorbatch(int port, rbyte changed, rbyte value, double time);
+void lua_onswitchchange(int switchid, bool state, double time);
+void lua_ongpiochange(int pin, bool state);
+void lua_onstats();
+void lua_oninterlock(interlock_event event, int id, int arg, double time);
+
+//---------------------------------------------------------------------------//
+// Statistics
+//---------------------------------------------------------------------------//
+uint64_t stats_dispatch_begin();
+void     stats_dispatch_end(raild_event_type type, uint64_t begin);
+void     stats_batch(int n);
+void     stats_timer(raild_event *event);
+void     stats_deferred(int n);
+void     stats_sensor_edge(double time);
+void     stats_switch_command();
+void     stats_reset();
+void     stats_push(struct lua_State *L);
+void     stats_handle_timer(raild_event *event);
+
+//---------------------------------------------------------------------------//
+// Journal
+//---------------------------------------------------------------------------//
+void journal_record(journal_type type, int hub, const void *data, size_t len);
+bool journal_is_replaying();
+void journal_handle_replay(raild_event *event);
+
+//---------------------------------------------------------------------------//
+// Shared-memory snapshot
+//---------------------------------------------------------------------------//
+struct raild_shm_t;
+
+void shm_touch();
+void shm_flush();
+const struct raild_shm_t *shm_snapshot();
+
+//---------------------------------------------------------------------------//
+// API worker
+//---------------------------------------------------------------------------//
+void worker_eval(int fd, unsigned int session, const char *chunk, size_t length);
+void worker_close(int fd, unsigned int session);
+void worker_handle_event(raild_event *event);
 
 //---------------------------------------------------------------------------//
 // Logger
 //---------------------------------------------------------------------------//
+typedef enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_TRACE
+} logger_level_t;
+
+extern logger_level_t logger_level;
+
+// True if messages of this level are currently logged
+#define LOG_ENABLED(level) ((level) <= logger_level)
+
+void  setup_logger();
+void  logger_set_level(logger_level_t level);
+int   logger_level_from_name(const char *name);
+void  logger_log(logger_level_t level, const char *prefix, const char *format, ...)
+          __attribute__((format(printf, 3, 4)));
 void  logger(const char *prefix, const char* message);
 void  logger_error(const char* message);
 void  logger_light(const char* message);
@@ -0,0 +1,350 @@
+#include "raild.h"
+#include <math.h>
+#include <luajit-2.0/lua.h>
+#include <luajit-2.0/lauxlib.h>
+
+/**
+ * Native rolling-window statistics
+ *
+ * A Rolling object keeps the last `capacity` values pushed in a ring
+ * buffer, along with statistics of the window updated on every push and
+ * shift in constant time, without allocating anything after creation:
+ *  - Sums of values and squares, compensated (Kahan) so that adding and
+ *    removing values for hours does not drift
+ *  - Minimum and maximum, from two monotonic queues of sample numbers
+ *  - A log-scale histogram for approximate percentiles, with 8 buckets
+ *    per power of two (at most 12.5% wide) from 1µs to about an hour
+ *
+ * Rolling objects are full userdata, their methods are called with ':'.
+ */
+
+#define ROLLING_MT "raild.Rolling"
+
+// Histogram layout
+#define HISTOGRAM_SUB     8   // Buckets per power of two
+#define HISTOGRAM_OCTAVES 32
+#define HISTOGRAM_MIN_EXP -19 // First octave starts at 2^-20
+#define HISTOGRAM_BUCKETS (1 + HISTOGRAM_OCTAVES * HISTOGRAM_SUB)
+
+extern lua_State *L;
+
+typedef struct {
+    int      capacity;
+    int      count;
+    uint64_t first; // Number of the oldest sample
+    uint64_t next;  // Number of the next sample
+
+    // Compensated sums
+    double sum, sum_c;
+    double squares, squares_c;
+
+    // Monotonic queues of sample numbers, fronts are the min and max
+    int min_head, min_len;
+    int max_head, max_len;
+
+    uint32_t histogram[HISTOGRAM_BUCKETS];
+
+    // Rings of `capacity` elements, allocated after the struct
+    double   *values;   // Indexed by sample number % capacity
+    uint64_t *min_seqs;
+    uint64_t *max_seqs;
+} rolling;
+
+static rolling *check_rolling(lua_State *L) {
+    return (rolling *) luaL_checkudata(L, 1, ROLLING_MT);
+}
+
+static inline double value_of(rolling *r, uint64_t seq) {
+    return r->values[seq % r->capacity];
+}
+
+static inline void kahan_add(double *sum, double *c, double v) {
+    double y = v - *c;
+    double t = *sum + y;
+    *c = (t - *sum) - y;
+    *sum = t;
+}
+
+//---------------------------------------------------------------------------//
+// Histogram
+//---------------------------------------------------------------------------//
+
+/**
+ * Returns the bucket of a value
+ * Bucket 0 holds values <= 0, values out of range go in the edge buckets.
+ */
+static int bucket_of(double v) {
+    if(!(v > 0)) return 0;
+
+    int exp;
+    double m = frexp(v, &exp); // v = m * 2^exp, m in [0.5, 1)
+
+    int octave = exp - HISTOGRAM_MIN_EXP;
+    if(octave < 0) return 1;
+    if(octave >= HISTOGRAM_OCTAVES) return HISTOGRAM_BUCKETS - 1;
+
+    return 1 + octave * HISTOGRAM_SUB + (int) ((m - 0.5) * 2 * HISTOGRAM_SUB);
+}
+
+/**
+ * Returns the lower bound of a bucket (> 0)
+ */
+static double bucket_low(int b) {
+    int octave = (b - 1) / HISTOGRAM_SUB;
+    int sub    = (b - 1) % HISTOGRAM_SUB;
+    return ldexp(0.5 + sub / (2.0 * HISTOGRAM_SUB), octave + HISTOGRAM_MIN_EXP);
+}
+
+//---------------------------------------------------------------------------//
+// Window management
+//---------------------------------------------------------------------------//
+
+/**
+ * Removes the oldest value of the window and returns it
+ */
+static double evict(rolling *r) {
+    uint64_t seq = r->first++;
+    double v = value_of(r, seq);
+    r->count--;
+
+    kahan_add(&r->sum, &r->sum_c, -v);
+    kahan_add(&r->squares, &r->squares_c, -v * v);
+    r->histogram[bucket_of(v)]--;
+
+    if(r->min_len > 0 && r->min_seqs[r->min_head] == seq) {
+        r->min_head = (r->min_head + 1) % r->capacity;
+        r->min_len--;
+    }
+    if(r->max_len > 0 && r->max_seqs[r->max_head] == seq) {
+        r->max_head = (r->max_head + 1) % r->capacity;
+        r->max_len--;
+    }
+
+    // Empty window, drop accumulated rounding errors
+    if(r->count == 0) {
+        r->sum = r->sum_c = r->squares = r->squares_c = 0;
+    }
+
+    return v;
+}
+
+static void push(rolling *r, double v) {
+    if(r->count == r->capacity) evict(r);
+
+    uint64_t seq = r->next++;
+    r->values[seq % r->capacity] = v;
+    r->count++;
+
+    kahan_add(&r->sum, &r->sum_c, v);
+    kahan_add(&r->squares, &r->squares_c, v * v);
+    r->histogram[bucket_of(v)]++;
+
+    // Values that can no longer be the min or max are dropped from the back
+    while(r->min_len > 0 && value_of(r, r->min_seqs[(r->min_head + r->min_len - 1) % r->capacity]) >= v) {
+        r->min_len--;
+    }
+    r->min_seqs[(r->min_head + r->min_len++) % r->capacity] = seq;
+
+    while(r->max_len > 0 && value_of(r, r->max_seqs[(r->max_head + r->max_len - 1) % r->capacity]) <= v) {
+        r->max_len--;
+    }
+    r->max_seqs[(r->max_head + r->max_len++) % r->capacity] = seq;
+}
+
+static void reset(rolling *r) {
+    r->count = 0;
+    r->first = r->next = 0;
+    r->sum = r->sum_c = r->squares = r->squares_c = 0;
+    r->min_head = r->min_len = 0;
+    r->max_head = r->max_len = 0;
+    memset(r->histogram, 0, sizeof(r->histogram));
+}
+
+//---------------------------------------------------------------------------//
+// Lua API
+//---------------------------------------------------------------------------//
+
+/**
+ * Rolling(capacity)
+ * Creates a rolling window of the last `capacity` values
+ */
+static int lualib_Rolling(lua_State *L) {
+    int capacity = luaL_checknumber(L, 1);
+    luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+
+    size_t size = sizeof(rolling) + capacity * (sizeof(double) + 2 * sizeof(uint64_t));
+    rolling *r = (rolling *) lua_newuserdata(L, size);
+
+    r->capacity = capacity;
+    r->values   = (double *) (r + 1);
+    r->min_seqs = (uint64_t *) (r->values + capacity);
+    r->max_seqs = r->min_seqs + capacity;
+    reset(r);
+
+    luaL_getmetatable(L, ROLLING_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/**
+ * rolling:Push(value)
+ * Adds a value, the oldest one is dropped if the window is full
+ */
+static int rolling_Push(lua_State *L) {
+    rolling *r = check_rolling(L);
+    push(r, luaL_checknumber(L, 2));
+    return 0;
+}
+
+/**
+ * rolling:Shift()
+ * Removes the oldest value and returns it, or nil if the window is empty
+ */
+static int rolling_Shift(lua_State *L) {
+    rolling *r = check_rolling(L);
+    if(r->count == 0) return 0;
+
+    lua_pushnumber(L, evict(r));
+    return 1;
+}
+
+/**
+ * rolling:Reset()
+ * Empties the window
+ */
+static int rolling_Reset(lua_State *L) {
+    reset(check_rolling(L));
+    return 0;
+}
+
+static int rolling_Count(lua_State *L) {
+    lua_pushnumber(L, check_rolling(L)->count);
+    return 1;
+}
+
+static int rolling_Capacity(lua_State *L) {
+    lua_pushnumber(L, check_rolling(L)->capacity);
+    return 1;
+}
+
+/**
+ * rolling:Mean()
+ * NaN if the window is empty, as are every statistics below
+ */
+static int rolling_Mean(lua_State *L) {
+    rolling *r = check_rolling(L);
+    lua_pushnumber(L, r->count ? r->sum / r->count : NAN);
+    return 1;
+}
+
+/**
+ * rolling:Variance()
+ * Population variance of the window
+ */
+static int rolling_Variance(lua_State *L) {
+    rolling *r = check_rolling(L);
+    if(r->count == 0) {
+        lua_pushnumber(L, NAN);
+        return 1;
+    }
+
+    double mean = r->sum / r->count;
+    double var  = r->squares / r->count - mean * mean;
+    lua_pushnumber(L, var > 0 ? var : 0);
+    return 1;
+}
+
+static int rolling_Min(lua_State *L) {
+    rolling *r = check_rolling(L);
+    lua_pushnumber(L, r->count ? value_of(r, r->min_seqs[r->min_head]) : NAN);
+    return 1;
+}
+
+static int rolling_Max(lua_State *L) {
+    rolling *r = check_rolling(L);
+    lua_pushnumber(L, r->count ? value_of(r, r->max_seqs[r->max_head]) : NAN);
+    return 1;
+}
+
+/**
+ * rolling:Percentile(p)
+ * Approximate p-th percentile (0 to 100) of the window, interpolated in
+ * the histogram bucket holding it. Exact for 0 and 100.
+ */
+static int rolling_Percentile(lua_State *L) {
+    rolling *r = check_rolling(L);
+    double p = luaL_checknumber(L, 2);
+    if(r->count == 0) {
+        lua_pushnumber(L, NAN);
+        return 1;
+    }
+
+    double min = value_of(r, r->min_seqs[r->min_head]);
+    double max = value_of(r, r->max_seqs[r->max_head]);
+    if(p <= 0) {
+        lua_pushnumber(L, min);
+        return 1;
+    } else if(p >= 100) {
+        lua_pushnumber(L, max);
+        return 1;
+    }
+
+    double target = p / 100 * r->count;
+    double seen   = 0;
+    double result = max;
+
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        uint32_t n = r->histogram[b];
+        if(n == 0 || seen + n < target) {
+            seen += n;
+            continue;
+        }
+
+        if(b == 0) {
+            result = min;
+        } else {
+            double low  = bucket_low(b);
+            double high = (b + 1 < HISTOGRAM_BUCKETS) ? bucket_low(b + 1) : low * 2;
+            result = low + (high - low) * (target - seen) / n;
+        }
+        break;
+    }
+
+    if(result < min) result = min;
+    if(result > max) result = max;
+
+    lua_pushnumber(L, result);
+    return 1;
+}
+
+static const luaL_Reg rolling_methods[] = {
+    { "Push",       rolling_Push },
+    { "Shift",      rolling_Shift },
+    { "Reset",      rolling_Reset },
+    { "Count",      rolling_Count },
+    { "Capacity",   rolling_Capacity },
+    { "Mean",       rolling_Mean },
+    { "Variance",   rolling_Variance },
+    { "Min",        rolling_Min },
+    { "Max",        rolling_Max },
+    { "Percentile", rolling_Percentile },
+    { NULL, NULL }
+};
+
+static const luaL_Reg rolling_api[] = {
+    { "Rolling", lualib_Rolling },
+    { NULL, NULL }
+};
+
+/**
+ * Register the Rolling constructor in the table on top of the stack
+ */
+void lualib_rolling_register() {
+    luaL_newmetatable(L, ROLLING_MT);
+    lua_newtable(L);
+    luaL_register(L, NULL, rolling_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_register(L, NULL, rolling_api);
+}
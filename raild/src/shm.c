@@ -0,0 +1,88 @@
+#include "raild.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <raild_shm.h>
+
+/**
+ * Shared-memory state snapshot
+ *
+ * The debounced sensors, switches, locks and power / ready flags are
+ * published in a POSIX shared-memory segment for local tools, see
+ * shared/raild_shm.h for its layout.
+ *
+ * hub.c marks the snapshot as dirty on every change and it is written once
+ * at the end of the event loop iteration, under the seqlock.
+ *
+ * If the segment cannot be created, the snapshot is kept in private memory
+ * so that the API worker thread can still read it.
+ */
+
+#if SENSORS_MAX > RAILD_SHM_SENSORS || SWITCHES_MAX > RAILD_SHM_SWITCHES
+#error "The shared-memory segment cannot hold every sensors and switches"
+#endif
+
+static raild_shm *shm = NULL;
+static bool       dirty = false;
+
+void setup_shm() {
+    int fd = shm_open(RAILD_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if(fd < 0 || ftruncate(fd, sizeof(raild_shm)) < 0) {
+        perror("(shm) shm_open");
+        logger_error("Unable to create the shared-memory state snapshot");
+        if(fd >= 0) close(fd);
+        shm = calloc(1, sizeof(raild_shm));
+    } else {
+        shm = mmap(NULL, sizeof(raild_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(shm == MAP_FAILED) {
+            perror("(shm) mmap");
+            shm = calloc(1, sizeof(raild_shm));
+        }
+    }
+
+    // A stale odd sequence would block readers forever
+    __atomic_store_n(&shm->seq, 0, __ATOMIC_RELAXED);
+    shm->magic   = RAILD_SHM_MAGIC;
+    shm->version = RAILD_SHM_VERSION;
+    shm->pid     = getpid();
+
+    dirty = true;
+    shm_flush();
+}
+
+/**
+ * Returns the snapshot, to be read with raild_shm_read()
+ */
+const raild_shm *shm_snapshot() {
+    return shm;
+}
+
+/**
+ * Marks the snapshot as outdated
+ */
+void shm_touch() {
+    dirty = true;
+}
+
+/**
+ * Writes the snapshot if something changed
+ * Called at the end of every event loop iteration.
+ */
+void shm_flush() {
+    if(!dirty || !shm) return;
+    dirty = false;
+
+    uint32_t seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->flags =
+        (get_hub_readiness() ? RAILD_SHM_READY : 0) |
+        (get_hub_readiness() && get_power() ? RAILD_SHM_POWER : 0);
+    shm->sensors  = hub_sensors_count();
+    shm->switches = hub_switches_count();
+    shm->updated  = (uint64_t) (raild_now * 1e9);
+    hub_export(shm->sensors_state, shm->switches_state, shm->locks);
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
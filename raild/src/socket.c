@@ -4,24 +4,106 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <api_opcodes.h>
 
 /**
  * TCP/IP server socket management
+ *
+ * Client data, input buffer included, comes from a free list and is
+ * recycled when the client disconnects, along with its output buffer
+ * unless it grew past OUTPUT_KEPT.
+ *
+ * Output to API clients is queued per client and flushed once per event
+ * loop iteration by socket_flush(). Client sockets are non-blocking: data
+ * the kernel cannot accept stays queued until epoll reports the socket as
+ * writable. A client whose queue grows past OUTPUT_HIGH_WATER is either
+ * kicked or loses the new data, depending on API_KICK_SLOW_CLIENTS.
+ *
+ * Two protocols are available on the same port, selected by the first
+ * byte sent by the client:
+ *  - Lua chunks separated by '\f', evaluated in a Lua state of the client
+ *    by the API worker thread (see worker.c), or in the client context of
+ *    the control state if API_WORKER is disabled
+ *  - A binary frame stream (see api_opcodes.h) where the client subscribes
+ *    to event classes, encoded directly from C without going through Lua
+ *
+ * Connections accepted on the HTTP listener (see http.c) instead start as
+ * HTTP requests and may be upgraded to WebSocket, RailMon clients then
+ * receive circuit events from the same publishing hooks as binary clients.
  */
 
-static int sockfd;
+#ifndef API_KICK_SLOW_CLIENTS
+#define API_KICK_SLOW_CLIENTS 1
+#endif
+
+#ifndef API_WORKER
+#define API_WORKER 1
+#endif
 
 #define BUFFER_MAX_LEN 4096
 
-typedef struct {
-    char *buffer;
+// Maximum amount of queued output for one client
+#define OUTPUT_HIGH_WATER (256 * 1024)
+
+// Bigger output buffers are freed when their client disconnects
+#define OUTPUT_KEPT (16 * 1024)
+
+typedef enum {
+    CLIENT_MODE_UNKNOWN, // Nothing received yet
+    CLIENT_MODE_LUA,     // '\f' separated Lua chunks
+    CLIENT_MODE_BINARY,  // Binary subscription protocol
+    CLIENT_MODE_HTTP,    // HTTP request, see http.c
+    CLIENT_MODE_WEBSOCKET // RailMon WebSocket
+} client_mode;
+
+typedef struct client_data_t {
+    char  buffer[BUFFER_MAX_LEN];
     int   buffer_len;
+
+    client_mode  mode;
+    rbyte        subscriptions; // Event classes of a binary client
+    unsigned int session;       // Unique id of this connection
+
+    // Output queue, data from out_head to out_len is waiting to be sent
+    char *out;
+    int   out_head;
+    int   out_len;
+    int   out_size;
+
+    bool  dirty;   // Output was queued during this loop iteration
+    bool  blocked; // Waiting for the socket to become writable
+    bool  kick;    // Client fell too far behind and must be closed
+    bool  closing; // Close once the output queue is empty
+
+    int   index;   // Position in the clients list
+    struct client_data_t *next; // Next free client data
 } client_data;
 
-void setup_socket() {
-    logger("API", "Init API server");
+// Events of connected clients
+static raild_event **clients      = NULL;
+static int           clients_len  = 0;
+static int           clients_size = 0;
 
-    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+// Recycled client data
+static client_data *free_clients = NULL;
+
+// fds of clients with output queued during this loop iteration
+static int *dirty      = NULL;
+static int  dirty_len  = 0;
+static int  dirty_size = 0;
+
+// Number of clients using the binary protocol
+static int binary_clients = 0;
+
+// Last session id given to a client
+static unsigned int last_session = 0;
+
+/**
+ * Opens a listening socket on `port`
+ * Connections of the HTTP listener are handled as HTTP requests.
+ */
+void socket_listen(int port, bool http) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if(sockfd < 0) {
         perror("socket");
         exit(1);
@@ -32,7 +114,7 @@ void setup_socket() {
 
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(9000);
+    serv_addr.sin_port = htons(port);
 
     int optval = 1;
     if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) < 0) {
@@ -55,32 +137,362 @@ void setup_socket() {
         exit(1);
     }
 
-    raild_epoll_add(sockfd, RAILD_EV_SERVER);
+    raild_event *server = raild_epoll_add(sockfd, RAILD_EV_SERVER);
+    server->n = http;
+}
+
+void setup_socket() {
+    logger("API", "Init API server");
+    socket_listen(9000, false);
 }
 
 void socket_handle_server(raild_event *event) {
+    int clientfd = accept(event->fd, NULL, NULL);
+    if(clientfd < 0) {
+        perror("accept");
+        return;
+    }
+
+    int optval = 1;
+    if(ioctl(clientfd, FIONBIO, &optval) < 0) {
+        perror("ioctl");
+        close(clientfd);
+        return;
+    }
+
     logger("API", "New client connected");
+    socket_attach(clientfd, event->n);
+}
+
+/**
+ * Registers a connected socket as a client
+ * Clients of the HTTP listener start as HTTP requests.
+ */
+raild_event *socket_attach(int clientfd, bool http) {
+    client_data *cdata = free_clients;
+    if(cdata) {
+        free_clients = cdata->next;
+    } else {
+        cdata = malloc(sizeof(client_data));
+        cdata->out      = NULL;
+        cdata->out_size = 0;
+    }
 
-    client_data *cdata = malloc(sizeof(client_data));
-    cdata->buffer      = malloc(sizeof(char[BUFFER_MAX_LEN]));
     cdata->buffer_len  = 0;
+    cdata->mode        = http ? CLIENT_MODE_HTTP : CLIENT_MODE_UNKNOWN;
+    cdata->subscriptions = 0;
+    cdata->session     = ++last_session;
+    cdata->out_head    = 0;
+    cdata->out_len     = 0;
+    cdata->dirty       = false;
+    cdata->blocked     = false;
+    cdata->kick        = false;
+    cdata->closing     = false;
+
+    // Register the client in the clients list
+    if(clients_len == clients_size) {
+        clients_size = clients_size ? clients_size * 2 : 16;
+        clients = realloc(clients, clients_size * sizeof(raild_event *));
+    }
 
-    int clientfd = accept(sockfd, NULL, NULL);
-    raild_epoll_add(clientfd, RAILD_EV_SOCKET)->ptr = cdata;
+    raild_event *client = raild_epoll_add(clientfd, RAILD_EV_SOCKET);
+    client->ptr  = cdata;
+    cdata->index = clients_len;
+    clients[clients_len++] = client;
+    return client;
+}
+
+/**
+ * Returns the event of the API client using `fd`, or NULL
+ */
+static raild_event *client_event(int fd) {
+    raild_event *event = raild_epoll_get(fd);
+    return (event && event->type == RAILD_EV_SOCKET) ? event : NULL;
 }
 
 void _close(raild_event *event) {
-    close(event->fd);
-    free(((client_data *) event->ptr)->buffer);
-    free(event->ptr);
+    client_data *cdata = (client_data *) event->ptr;
+    if(cdata->mode == CLIENT_MODE_BINARY) binary_clients--;
+    if(cdata->mode == CLIENT_MODE_WEBSOCKET) ws_closed();
+    if(API_WORKER && cdata->mode == CLIENT_MODE_LUA) worker_close(event->fd, cdata->session);
+
+    // Remove it from the clients list
+    raild_event *last = clients[--clients_len];
+    ((client_data *) last->ptr)->index = cdata->index;
+    clients[cdata->index] = last;
+
+    int fd = event->fd;
     raild_epoll_rem(event);
+    close(fd);
+
+    // Recycle its data
+    if(cdata->out_size > OUTPUT_KEPT) {
+        free(cdata->out);
+        cdata->out      = NULL;
+        cdata->out_size = 0;
+    }
+    cdata->next  = free_clients;
+    free_clients = cdata;
+}
+
+/**
+ * Checks that the client using `fd` is still the one of the given session
+ */
+bool socket_session_alive(int fd, unsigned int session) {
+    raild_event *event = client_event(fd);
+    return event && ((client_data *) event->ptr)->session == session;
+}
+
+/**
+ * Writes as much queued output as the client socket accepts
+ * Returns false on write error, the client must then be closed
+ */
+static bool client_flush(raild_event *event) {
+    client_data *cdata = (client_data *) event->ptr;
+    if(cdata->out_len == 0 || cdata->blocked) return true;
+
+    // MSG_NOSIGNAL prevents SIGPIPE if the client is already gone
+    ssize_t len = send(event->fd, cdata->out + cdata->out_head, cdata->out_len, MSG_NOSIGNAL);
+    if(len < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            logger("API", "Client write error, closing");
+            return false;
+        }
+        len = 0;
+    }
+
+    cdata->out_head += len;
+    cdata->out_len  -= len;
+
+    if(cdata->out_len == 0) {
+        cdata->out_head = 0;
+    } else {
+        // The socket is full, wait for it to become writable again
+        cdata->blocked = true;
+        raild_epoll_want_write(event, true);
+    }
+
+    return true;
+}
+
+/**
+ * Queues data to be sent to the API client using the given fd
+ * Data sent to an fd that is not an API client is ignored.
+ */
+void socket_send(int fd, const char *data, size_t length) {
+    raild_event *event = client_event(fd);
+    if(!event) return;
+
+    client_data *cdata = (client_data *) event->ptr;
+    if(cdata->kick || length == 0) return;
+
+    // Slow client
+    if(cdata->out_len + length > OUTPUT_HIGH_WATER) {
+        if(API_KICK_SLOW_CLIENTS) {
+            // Closing is deferred to socket_flush() since we are
+            // probably running Lua code from this client context
+            cdata->kick = true;
+        } else {
+            logger("API", "Client output queue full, dropping data");
+            return;
+        }
+    } else {
+        // Make room for the new data
+        if(cdata->out_head + cdata->out_len + length > (size_t) cdata->out_size) {
+            if(cdata->out_head > 0) {
+                memmove(cdata->out, cdata->out + cdata->out_head, cdata->out_len);
+                cdata->out_head = 0;
+            }
+
+            if(cdata->out_len + length > (size_t) cdata->out_size) {
+                int size = cdata->out_size ? cdata->out_size : 1024;
+                while((size_t) size < cdata->out_len + length) size *= 2;
+                cdata->out = realloc(cdata->out, size);
+                cdata->out_size = size;
+            }
+        }
+
+        memcpy(cdata->out + cdata->out_head + cdata->out_len, data, length);
+        cdata->out_len += length;
+    }
+
+    // Mark the client for flushing at the end of this iteration
+    if(!cdata->dirty) {
+        cdata->dirty = true;
+        if(dirty_len == dirty_size) {
+            dirty_size = dirty_size ? dirty_size * 2 : 16;
+            dirty = realloc(dirty, dirty_size * sizeof(int));
+        }
+        dirty[dirty_len++] = fd;
+    }
+}
+
+/**
+ * Flushes output queued for API clients during this loop iteration
+ * Called at the end of every event loop iteration.
+ */
+void socket_flush() {
+    for(int i = 0; i < dirty_len; i++) {
+        raild_event *event = client_event(dirty[i]);
+        if(!event) continue;
+
+        client_data *cdata = (client_data *) event->ptr;
+        if(!cdata->dirty) continue;
+        cdata->dirty = false;
+
+        if(cdata->kick) {
+            logger("API", "Client too slow, kicking");
+        } else if(client_flush(event) && !(cdata->closing && cdata->out_len == 0)) {
+            continue;
+        }
+
+        _close(event);
+    }
+
+    dirty_len = 0;
+}
+
+/**
+ * Queues a WebSocket text frame for every WebSocket client
+ */
+void socket_ws_broadcast(const char *data, size_t length) {
+    for(int i = 0; i < clients_len; i++) {
+        client_data *cdata = (client_data *) clients[i]->ptr;
+        if(cdata->mode == CLIENT_MODE_WEBSOCKET) {
+            ws_send(clients[i]->fd, WS_TEXT, data, length);
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Binary protocol
+//---------------------------------------------------------------------------//
+
+/**
+ * Queues a binary frame for one client
+ */
+static void send_frame(int fd, rbyte opcode, const rbyte *payload, int len) {
+    char frame[256];
+    frame[0] = len + 1;
+    frame[1] = opcode;
+    memcpy(frame + 2, payload, len);
+    socket_send(fd, frame, len + 2);
+}
+
+/**
+ * Sends a frame to every binary clients subscribed to the given class
+ */
+static void publish(rbyte cls, rbyte opcode, const rbyte *payload, int len) {
+    if(binary_clients == 0) return;
+
+    for(int i = 0; i < clients_len; i++) {
+        client_data *cdata = (client_data *) clients[i]->ptr;
+        if(cdata->mode == CLIENT_MODE_BINARY && (cdata->subscriptions & cls)) {
+            send_frame(clients[i]->fd, opcode, payload, len);
+        }
+    }
+}
+
+/**
+ * Handles a frame received from a binary client
+ */
+static void handle_binary_frame(raild_event *event, rbyte *frame, int len) {
+    client_data *cdata = (client_data *) event->ptr;
+
+    switch(frame[0]) {
+        case API_SUBSCRIBE:
+            if(len < 2) break;
+            cdata->subscriptions = frame[1];
+
+            // Answer with the full current state
+            rbyte sync[3 + SENSORS_MAX / 8 + SWITCHES_MAX / 4];
+            int sensor_ports = hub_sensors_count() / 8;
+            int switch_ports = hub_switches_count() / 8;
+            int len = 0;
+
+            sync[len++] = sensor_ports;
+            sync[len++] = switch_ports;
+            for(int i = 0; i < sensor_ports; i++) sync[len++] = get_sensors_port(i);
+            for(int i = 0; i < switch_ports; i++) sync[len++] = get_switches_port(i);
+            for(int i = 0; i < switch_ports; i++) sync[len++] = get_locks_port(i);
+            sync[len++] =
+                (get_hub_readiness() ? API_FLAG_READY : 0) |
+                (get_hub_readiness() && get_power() ? API_FLAG_POWER : 0);
+
+            send_frame(event->fd, API_SYNC, sync, len);
+            break;
+
+        default:
+            logger("API", "Unknown binary opcode from client");
+    }
+}
+
+void socket_publish_sensors(int port, rbyte changed, rbyte value) {
+    rbyte payload[3] = { port, changed, value };
+    publish(API_SUB_SENSOR, API_SENSORS, payload, 3);
+    ws_publish_sensors(port, changed, value);
 }
 
+void socket_publish_switches(int port, rbyte changed, rbyte value) {
+    rbyte payload[3] = { port, changed, value };
+    publish(API_SUB_SWITCH, API_SWITCHES, payload, 3);
+    ws_publish_switches(port, changed, value);
+}
+
+void socket_publish_lock(int sid, bool locked) {
+    rbyte payload[2] = { sid, locked };
+    publish(API_SUB_LOCK, API_LOCK, payload, 2);
+    ws_publish_lock(sid, locked);
+}
+
+void socket_publish_power(bool state) {
+    rbyte payload[1] = { state };
+    publish(API_SUB_POWER, API_POWER, payload, 1);
+    ws_publish_power(state);
+}
+
+void socket_publish_ready(bool ready) {
+    rbyte payload[1] = { ready };
+    publish(API_SUB_READY, API_READY, payload, 1);
+    ws_publish_ready(ready);
+}
+
+//---------------------------------------------------------------------------//
+// Client events
+//---------------------------------------------------------------------------//
+
 void socket_handle_client(raild_event *event) {
     client_data *cdata = (client_data *) event->ptr;
 
+    // The socket accepts data again
+    if(event->writable && cdata->blocked) {
+        cdata->blocked = false;
+        if(!client_flush(event)) {
+            _close(event);
+            return;
+        }
+        if(!cdata->blocked) {
+            raild_epoll_want_write(event, false);
+            if(cdata->closing) {
+                _close(event);
+                return;
+            }
+        }
+    }
+
+    if(!event->readable) {
+        return;
+    }
+
     // Read data in buffer
     int len = read(event->fd, (cdata->buffer + cdata->buffer_len), (BUFFER_MAX_LEN - cdata->buffer_len));
+    if(len < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+        logger("API", "Client read error, closing");
+        _close(event);
+        return;
+    }
+
     cdata->buffer_len += len;
 
     // Check some space exists in the client buffer
@@ -97,20 +509,94 @@ void socket_handle_client(raild_event *event) {
         return;
     }
 
-    // Scan buffer for code block
     char *buffer = cdata->buffer;
     int   length = cdata->buffer_len;
-    for(int i = 0; i < length; i++) {
-        if(buffer[i] == '\f') {
-            if(i > 0) {
-                lua_switch_context(event->fd);
-                lua_eval(buffer, i);
-                lua_restore_context();
+
+    // The first byte selects the protocol
+    if(cdata->mode == CLIENT_MODE_UNKNOWN) {
+        if(buffer[0] == API_BINARY) {
+            cdata->mode = CLIENT_MODE_BINARY;
+            binary_clients++;
+            buffer += 1;
+            length -= 1;
+        } else {
+            cdata->mode = CLIENT_MODE_LUA;
+        }
+    }
+
+    if(cdata->closing) {
+        // Response already sent, ignore anything else
+        length = 0;
+    } else if(cdata->mode == CLIENT_MODE_HTTP) {
+        // Wait for the end of the request headers
+        int request_len = 0;
+        for(int i = 3; i < length && !request_len; i++) {
+            if(memcmp(buffer + i - 3, "\r\n\r\n", 4) == 0) request_len = i + 1;
+        }
+
+        if(request_len) {
+            if(http_handle_request(event->fd, buffer, request_len)) {
+                cdata->mode = CLIENT_MODE_WEBSOCKET;
+            } else {
+                cdata->closing = true;
             }
+            buffer += request_len;
+            length -= request_len;
+        }
+    }
 
-            buffer += i + 1;
-            length -= i + 1;
-            i = 0;
+    if(cdata->mode == CLIENT_MODE_WEBSOCKET && !cdata->closing) {
+        // Handle every complete frames
+        int opcode, payload_len, frame_len;
+        rbyte *payload;
+        while((frame_len = ws_parse_frame((rbyte *) buffer, length, &opcode, &payload, &payload_len)) > 0) {
+            if(opcode == WS_CLOSE) {
+                ws_send(event->fd, WS_CLOSE, NULL, 0);
+                cdata->closing = true;
+            } else if(opcode == WS_PING) {
+                ws_send(event->fd, WS_PONG, (char *) payload, payload_len);
+            }
+
+            // Messages are ignored, commands go through the API port
+            buffer += frame_len;
+            length -= frame_len;
+            if(cdata->closing) break;
+        }
+
+        if(frame_len < 0) {
+            logger("HTTP", "Invalid WebSocket frame, closing");
+            _close(event);
+            return;
+        }
+    } else if(cdata->closing || cdata->mode == CLIENT_MODE_HTTP) {
+        // Nothing more to handle
+    } else if(cdata->mode == CLIENT_MODE_BINARY) {
+        // Handle every complete frames
+        while(length > 0 && length > (rbyte) buffer[0]) {
+            int frame_len = (rbyte) buffer[0];
+            if(frame_len > 0) {
+                handle_binary_frame(event, (rbyte *) buffer + 1, frame_len);
+            }
+
+            buffer += frame_len + 1;
+            length -= frame_len + 1;
+        }
+    } else {
+        // Scan buffer for code block
+        for(int i = 0; i < length; i++) {
+            if(buffer[i] == '\f') {
+                if(i > 0 && API_WORKER) {
+                    worker_eval(event->fd, cdata->session, buffer, i);
+                } else if(i > 0) {
+                    lua_switch_context(event->fd);
+                    lua_eval(buffer, i);
+                    lua_restore_context();
+                }
+
+                buffer += i + 1;
+                length -= i + 1;
+                i = 0;
+            }
         }
     }
 
@@ -0,0 +1,193 @@
+#include "raild.h"
+#include <luajit-2.0/lua.h>
+#include <luajit-2.0/lauxlib.h>
+
+/**
+ * Event loop statistics
+ *
+ * Durations are recorded in fixed-size histograms with logarithmic
+ * buckets: bucket 0 counts zero values and bucket k counts values in
+ * [2^(k-1), 2^k[ microseconds.
+ *
+ * Statistics are available to Lua with Stats() and pushed every second
+ * to handlers of the Stats event.
+ */
+
+// Number of buckets in a histogram
+#define BUCKETS 32
+
+// Number of raild_event_type values
+#define EVENT_TYPES (RAILD_EV_TRAIN + 1)
+
+typedef struct {
+    uint32_t count;
+    uint64_t sum;
+    uint32_t max;
+    uint32_t buckets[BUCKETS];
+} histogram;
+
+// Dispatch time for each event type (µs)
+static histogram dispatch_time[EVENT_TYPES];
+
+// Number of events returned by each epoll_wait() call
+static histogram batch_size;
+
+// Delay between the UART event bringing a sensor edge and the write of the
+// next switch command to the UART (µs)
+static histogram edge_to_switch;
+
+// Number of timer ticks missed because the loop was late
+static uint32_t timer_overruns = 0;
+
+// Number of low priority events deferred to the next loop iteration
+static uint32_t deferred_events = 0;
+
+// Time of the first sensor edge not yet followed by a switch command
+static uint64_t last_edge = 0;
+
+// Edges not followed by a switch command within this delay are forgotten
+#define EDGE_TIMEOUT 1000000
+
+// Names of event types, as exposed to Lua
+static const char *event_names[EVENT_TYPES] = {
+    "UART", "UART_TIMER", "API_SERVER", "API_CLIENT",
+    "LUA_TIMER", "GPIO", "STATS_TIMER", "DEBOUNCE_TIMER",
+    "REPLAY_TIMER", "WAKE_TIMER", "WORKER", "INTERLOCK_TIMER",
+    "TRAIN_TIMER", "TRAIN"
+};
+
+/**
+ * Current monotonic time in microseconds
+ */
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void record(histogram *h, uint64_t value) {
+    uint32_t v = (value > UINT32_MAX) ? UINT32_MAX : (uint32_t) value;
+    int bucket = v ? 32 - __builtin_clz(v) : 0;
+    if(bucket >= BUCKETS) bucket = BUCKETS - 1;
+
+    h->count++;
+    h->sum += v;
+    h->buckets[bucket]++;
+    if(v > h->max) h->max = v;
+}
+
+void setup_stats() {
+    raild_timer_create(1000, 1000, RAILD_EV_STATS_TIMER);
+}
+
+/**
+ * Returns a timestamp to be passed to stats_dispatch_end()
+ */
+uint64_t stats_dispatch_begin() {
+    return now_us();
+}
+
+/**
+ * Records the dispatch time of an event
+ */
+void stats_dispatch_end(raild_event_type type, uint64_t begin) {
+    record(&dispatch_time[type], now_us() - begin);
+}
+
+void stats_batch(int n) {
+    record(&batch_size, (n > 0) ? n : 0);
+}
+
+void stats_timer(raild_event *event) {
+    if(event->times > 1) {
+        timer_overruns += event->times - 1;
+    }
+}
+
+void stats_deferred(int n) {
+    deferred_events += n;
+}
+
+/**
+ * Records a sensor edge received at `time` (monotonic, in seconds)
+ */
+void stats_sensor_edge(double time) {
+    // Replayed edges were not received by the UART
+    if(journal_is_replaying()) return;
+
+    uint64_t received = (uint64_t) (time * 1e6);
+    if(!last_edge || now_us() - last_edge > EDGE_TIMEOUT) last_edge = received;
+}
+
+/**
+ * Records a switch command, called once it is written to the UART
+ */
+void stats_switch_command() {
+    if(!last_edge) return;
+
+    uint64_t delay = now_us() - last_edge;
+    if(delay <= EDGE_TIMEOUT) record(&edge_to_switch, delay);
+    last_edge = 0;
+}
+
+void stats_reset() {
+    memset(dispatch_time, 0, sizeof(dispatch_time));
+    memset(&batch_size, 0, sizeof(batch_size));
+    memset(&edge_to_switch, 0, sizeof(edge_to_switch));
+    timer_overruns = 0;
+    deferred_events = 0;
+}
+
+void stats_handle_timer(raild_event *event) {
+    lua_onstats();
+}
+
+/**
+ * Pushes a histogram as a Lua table
+ * { count, mean, max, buckets = { ... } }
+ */
+static void push_histogram(lua_State *L, histogram *h) {
+    lua_createtable(L, 0, 4);
+
+    lua_pushnumber(L, h->count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushnumber(L, h->count ? (double) h->sum / h->count : 0);
+    lua_setfield(L, -2, "mean");
+
+    lua_pushnumber(L, h->max);
+    lua_setfield(L, -2, "max");
+
+    lua_createtable(L, BUCKETS, 0);
+    for(int i = 0; i < BUCKETS; i++) {
+        lua_pushnumber(L, h->buckets[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "buckets");
+}
+
+/**
+ * Pushes every statistics as a Lua table
+ */
+void stats_push(lua_State *L) {
+    lua_createtable(L, 0, 5);
+
+    lua_createtable(L, 0, EVENT_TYPES);
+    for(int i = 0; i < EVENT_TYPES; i++) {
+        push_histogram(L, &dispatch_time[i]);
+        lua_setfield(L, -2, event_names[i]);
+    }
+    lua_setfield(L, -2, "dispatch");
+
+    push_histogram(L, &batch_size);
+    lua_setfield(L, -2, "batch");
+
+    push_histogram(L, &edge_to_switch);
+    lua_setfield(L, -2, "edge_to_switch");
+
+    lua_pushnumber(L, timer_overruns);
+    lua_setfield(L, -2, "timer_overruns");
+
+    lua_pushnumber(L, deferred_events);
+    lua_setfield(L, -2, "deferred");
+}
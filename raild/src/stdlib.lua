@@ -9,38 +9,54 @@ local trace = print
 -- Contexts manager
 -------------------------------------------------------------------------------
 local GetCtx, CtxClass, SwitchCtx, RestoreCtx
-local RegisterDealloc
+local CtxAttach, CtxDetach
 do
-    local ctxs = {}             -- List of every context currently available
+    -- string ctx_class(ctx)
+    -- Class of a context, nil if not allocated
+    -- Contexts are allocated by raild, one for every watched fd.
+    local ctx_class = __rd_ctx_class
+    __rd_ctx_class = nil
+
     local ctx  = 0              -- Currently enabled context
-    local freehandlers = {}     -- Dealloc handlers
 
-    -- New context allocated context allocations
-    bind("AllocContext", function(ctx, class)
-        -- Check if context is not already allocated
-        if ctxs[ctx] then
-            error("attempt to alloc an already allocated context: " .. ctx .. " " .. class)
-        end
-
-        -- Allocate
-        ctxs[ctx] = class
-    end)
+    -- Resources owned by each context
+    -- Every resource is a table with a `ctx` field and a `release` method
+    -- called when its context is deallocated, so a deallocation only
+    -- touches what this context owns. Keys are weak: a resource dropped by
+    -- its owner is not kept alive by this index.
+    local owned = {}
 
     -- Tracks context deallocations
     bind("DeallocContext", function(ctx)
-        -- Check if context is allocated
-        if not ctxs[ctx] then
-            error("attempt to dealloc a not allocated context: " .. ctx)
+        -- Release resources owned by this context
+        -- The index is detached first, releasing a resource may attach it
+        -- to another context
+        local resources = owned[ctx]
+        owned[ctx] = nil
+        if resources then
+            for resource in pairs(resources) do
+                resource:release()
+            end
         end
+    end)
 
-        -- Run cleaners
-        for i = 1, #freehandlers do
-            freehandlers[i](ctx)
+    -- Records a resource as owned by its context
+    function CtxAttach(resource)
+        local resources = owned[resource.ctx]
+        if not resources then
+            resources = setmetatable({}, { ["__mode"] = "k" })
+            owned[resource.ctx] = resources
         end
+        resources[resource] = true
+    end
 
-        -- Dealloc
-        ctxs[ctx] = nil
-    end)
+    -- Forgets a resource previously attached to its context
+    function CtxDetach(resource)
+        local resources = owned[resource.ctx]
+        if resources then
+            resources[resource] = nil
+        end
+    end
 
     -- Returns the current context
     function GetCtx()
@@ -49,12 +65,7 @@ do
 
     -- Returns the class of a given context
     function CtxClass(ctx)
-        return ctxs[ctx] or "UNKNOWN"
-    end
-
-    -- Registers a context deallocation handler
-    function RegisterDealloc(handler)
-        table.insert(freehandlers, handler)
+        return ctx_class(ctx) or "UNKNOWN"
     end
 
     --
@@ -70,6 +81,8 @@ do
     -- Only API-Client and Internal are allowed contexts
     local classes_whitelist = { ["API_CLIENT"] = true, ["INTERNAL"] = true }
     local function IsCtxAllowed(ctx)
+        -- The internal context, most handlers run in it
+        if ctx == 0 then return true end
         return classes_whitelist[CtxClass(ctx)] or false
     end
 
@@ -153,40 +166,103 @@ end
 -- EventEmitter
 -------------------------------------------------------------------------------
 do
-    -- List of all registered event emitters
-    local emitters = {}
+    -- Adds a handler to the set of `key` in an index
+    local function link(index, key, handler)
+        local set = index[key]
+        if not set then
+            set = {}
+            index[key] = set
+        end
+        set[handler] = true
+    end
 
-    -- Set emitters as weak values
-    setmetatable(emitters, { ["__mode"] = "k"})
+    -- Removes a handler from the set of `key` in an index
+    local function unlink(index, key, handler)
+        local set = index[key]
+        if set then
+            set[handler] = nil
+            if next(set) == nil then index[key] = nil end
+        end
+    end
 
-    function EventEmitter(self)
+    -- The optional watcher function is called with (event, true) when the
+    -- first handler is attached to an event and with (event, false) once
+    -- the last one is removed.
+    function EventEmitter(self, watcher)
         -- Optional parameter
         self = self or {}
 
         -- List of registered event handlers
+        -- Handlers of an event are a doubly linked list in registration
+        -- order, indexed by function and by context, so removing a handler
+        -- never needs to look at the other ones.
         local events = {}
 
+        -- Registration counter
+        -- Emit does not call handlers registered after it started
+        local serial = 0
+
+        -- Removes a handler
+        -- Its `next` link is kept, so an Emit currently on it can go on.
+        local function remove(handler)
+            if handler.removed then return end
+            handler.removed = true
+
+            local list = handler.list
+            if handler.prev then handler.prev.next = handler.next else list.head = handler.next end
+            if handler.next then handler.next.prev = handler.prev else list.tail = handler.prev end
+
+            unlink(list.fns, handler.fn, handler)
+            unlink(list.ctxs, handler.ctx, handler)
+            CtxDetach(handler)
+
+            if not list.head then
+                events[list.event] = nil
+                if watcher then watcher(list.event, false) end
+            end
+        end
+
+        -- Called when the context of a handler is deallocated
+        local function release(handler)
+            if handler.persistent then
+                -- Handler is persistent, inherited by ctx 0
+                unlink(handler.list.ctxs, handler.ctx, handler)
+                handler.ctx = 0
+                link(handler.list.ctxs, 0, handler)
+                CtxAttach(handler)
+            else
+                remove(handler)
+            end
+        end
+
         --
         -- Emits an event
         --
         function self.Emit(event, ...)
             -- This event has nothing registered to it
-            if not events[event] then return end
+            local list = events[event]
+            if not list then return end
 
             -- Loops over every handlers
-            for idx, handler in ipairs(events[event]) do
-                -- Safe call, error in one handler should not prevent
-                -- others to be run correctly
-                SwitchCtx(handler.ctx)
-                local success, error = pcall(handler.fn, ...)
-                RestoreCtx()
-                if not success then
-                    print("[LUA]\t Error while dispatching event: " .. error)
-                end
-                -- Delete once handler
-                if handler.once then
-                    table.remove(events[event], idx)
+            local last = serial
+            local handler = list.head
+            while handler and handler.serial <= last do
+                if not handler.removed then
+                    -- Delete once handler
+                    if handler.once then
+                        remove(handler)
+                    end
+
+                    -- Safe call, error in one handler should not prevent
+                    -- others to be run correctly
+                    SwitchCtx(handler.ctx)
+                    local success, error = pcall(handler.fn, ...)
+                    RestoreCtx()
+                    if not success then
+                        print("[LUA]\t Error while dispatching event: " .. error)
+                    end
                 end
+                handler = handler.next
             end
         end
 
@@ -194,20 +270,37 @@ do
         -- Attaches a new handler to an event
         --
         local function on(event, fn, persistent, once)
-            -- First time an event is registered
-            if not events[event] then
-                events[event] = {}
+            local list = events[event]
+            local first = not list
+            if first then
+                list = { event = event, fns = {}, ctxs = {} }
+                events[event] = list
             end
 
-            -- Adds this function to the event handler
-            -- table along with context informations
-            table.insert(events[event], {
+            -- Adds this function at the end of the event handlers
+            -- list along with context informations
+            serial = serial + 1
+            local handler = {
                 ctx = GetCtx(),
                 fn  = fn,
                 persistent = persistent,
-                once = once
-            })
-
+                once = once,
+                serial = serial,
+                list = list,
+                prev = list.tail,
+                release = release
+            }
+
+            if list.tail then list.tail.next = handler else list.head = handler end
+            list.tail = handler
+
+            link(list.fns, fn, handler)
+            link(list.ctxs, handler.ctx, handler)
+            CtxAttach(handler)
+
+            if first and watcher then
+                watcher(event, true)
+            end
         end
 
         function self.On(event, fn, persistent)
@@ -218,6 +311,13 @@ do
             return on(event, fn, persistent, true)
         end
 
+        --
+        -- Checks if at least one handler is registered to an event
+        --
+        function self.HasHandlers(event)
+            return events[event] ~= nil
+        end
+
         --
         -- Detach a function previously registered with On
         --
@@ -225,70 +325,69 @@ do
         -- registered from the current context on this event
         --
         function self.Off(event, fn)
-            -- Nothing registered to this event, so obviously
-            -- nothing to remove...
-            if not events[event] then return end
-
-            -- Current script context
-            local ctx = GetCtx();
-
-            -- Check matching handler
-            for idx, handler in ipairs(events[event]) do
-                if fn then
-                    if handler.fn == fn then
-                        table.remove(events[event], idx)
-                    end
-                elseif handler.ctx == ctx then
-                    table.remove(events[event], idx)
-                end
+            local list = events[event]
+            if not list then return end
+
+            -- Matching handlers
+            local set
+            if fn then
+                set = list.fns[fn]
+            else
+                set = list.ctxs[GetCtx()]
             end
-        end
 
-        --
-        -- Function called when a file descriptor is deallocated
-        --
-        -- This functions checks every handlers and removes those
-        -- registered from that context
-        --
-        emitters[self] = function(ctx)
-            for _, handlers in pairs(events) do
-                for idx, handler in ipairs(handlers) do
-                    if handler.ctx == ctx then
-                        if handler.persistent then
-                            -- Handler is persistent, inherited by ctx 0
-                            handler.ctx = 0
-                        else
-                            table.remove(handlers, idx)
-                        end
-                    end
+            if set then
+                for handler in pairs(set) do
+                    remove(handler)
                 end
             end
         end
 
         return self
     end
-
-    --
-    -- Cleanup every emitters
-    --
-    RegisterDealloc(function(ctx)
-        for emitter, cleanup in pairs(emitters) do
-            cleanup(ctx)
-        end
-    end)
 end
 
 -------------------------------------------------------------------------------
 -- C-Events
 -------------------------------------------------------------------------------
 do
+    -- void subscribe(event, dispatcher)
+    -- Resolves a C event to its dispatcher, or disables it if nil
+    local subscribe = __rd_subscribe
+    __rd_subscribe = nil
+
     -- EventEmitter object for C-events
-    local cEvents = EventEmitter()
+    -- C only fires events having at least one handler, each one directly
+    -- calling its own dispatcher
+    local cEvents
+    cEvents = EventEmitter(nil, function(event, active)
+        if active then
+            subscribe(event, function(...)
+                cEvents.Emit(event, ...)
+            end)
+        else
+            subscribe(event, nil)
+        end
+    end)
 
     -- Global API
-    bind("DispatchEvent", cEvents.Emit)
     On = cEvents.On
     Off = cEvents.Off
+
+    -- Compatibility SensorChange events
+    -- Sensors updates are sent as one SensorBatch event per port, the
+    -- per-sensor event is only derived if someone is listening to it
+    local band, lshift = bit.band, bit.lshift
+    On("SensorBatch", function(port, changed, value, time)
+        if not cEvents.HasHandlers("SensorChange") then return end
+        local base = (port - 1) * 8
+        for i = 0, 7 do
+            local mask = lshift(1, i)
+            if band(changed, mask) ~= 0 then
+                cEvents.Emit("SensorChange", base + i + 1, band(value, mask) ~= 0, time)
+            end
+        end
+    end)
 end
 
 -------------------------------------------------------------------------------
@@ -315,6 +414,20 @@ do
     local timers = {}
     local soft_tid = 0
 
+    local function cancelTimerInternal(tid)
+        local timer = timers[tid]
+        if not timer then return end
+        timers[tid] = nil                 -- delete the Lua reference
+        CtxDetach(timer)
+        cancel_timer(tid)                 -- cancel the timer
+        unregister_timer(tid)             -- unregister the callback
+    end
+
+    -- Cancels a timer whose context is deallocated
+    local function release(timer)
+        cancelTimerInternal(timer.tid)
+    end
+
     -- Create a new timer that will fire for the first time after `initial`
     -- milliseconds and then every `interval` milliseconds, calling the
     -- callback function `fn`
@@ -345,20 +458,17 @@ do
         -- Allocate a new soft id for this timer
         -- and save the context of this timer
         soft_tid = soft_tid + 1
-        timers[tid] = {
+        local timer = {
             ["ctx"] = ctx,
             ["tid"] = tid,
-            ["soft_tid"] = soft_tid
+            ["soft_tid"] = soft_tid,
+            ["release"] = release
         }
 
-        return timers[tid]
-    end
+        timers[tid] = timer
+        CtxAttach(timer)
 
-    local function cancelTimerInternal(tid)
-        if not timers[tid] then return end
-        timers[tid] = nil                 -- delete the Lua reference
-        cancel_timer(tid)                 -- cancel the timer
-        unregister_timer(tid)             -- unregister the callback
+        return timer
     end
 
     -- Cancel a not-yet-fired timer
@@ -373,22 +483,237 @@ do
 
     -- Cleanup after automatic collection of one-time timers
     bind("DeleteTimer", function(tid)
-        if not timers[tid] then return end
+        local timer = timers[tid]
+        if not timer then return end
         timers[tid] = nil        -- delete the Lua reference
+        CtxDetach(timer)
         unregister_timer(tid)    -- unregisters the callback
         -- There is no need to cancel the timer as this is
         -- an auto-collected timer already expired.
     end)
+end
 
-    -- Tracks context deallocations and cancel timers associated
-    -- with these contexts
-    RegisterDealloc(function(ctx)
-        for tid, timer in pairs(timers) do
-            if timer.ctx == ctx then
-                cancelTimerInternal(tid)
+-------------------------------------------------------------------------------
+-- Tasks
+-------------------------------------------------------------------------------
+do
+    -- timer wake(delay, task)
+    -- Resumes `task` through ResumeTask after `delay` milliseconds
+    local wake = __rd_wake
+    __rd_wake = nil
+
+    -- void cancel_wake(timer)
+    -- Cancels a timer returned by wake(), if not yet fired
+    local cancel_wake = __rd_cancel_wake
+    __rd_cancel_wake = nil
+
+    -- void wait_sensor(sid, waited)
+    -- Tells raild whether WakeSensors must be called for a sensor
+    local wait_sensor = __rd_wait_sensor
+    __rd_wait_sensor = nil
+
+    local create, resume, yield, running = coroutine.create, coroutine.resume, coroutine.yield, coroutine.running
+    local band, lshift = bit.band, bit.lshift
+
+    -- The task currently running
+    local current
+
+    -- Tasks waiting on each sensor, in waiting order
+    local waiters = {}
+
+    -- Removes a task from the waiters of its sensor
+    local function unwait(task)
+        local list = waiters[task.sensor]
+        for i = 1, #list do
+            if list[i] == task then
+                table.remove(list, i)
+                break
             end
         end
+
+        if #list == 0 then
+            waiters[task.sensor] = nil
+            wait_sensor(task.sensor, false)
+        end
+        task.sensor = nil
+    end
+
+    -- Forgets whatever a task was waiting for
+    local function clear(task)
+        if task.timer then
+            cancel_wake(task.timer)
+            task.timer = nil
+        end
+        if task.sensor then
+            unwait(task)
+        end
+        if task.emitter then
+            task.emitter.Off(task.event, task.handler)
+            task.emitter, task.event, task.handler = nil, nil, nil
+        end
+    end
+
+    -- Ends a task, it will never be resumed again
+    local function finish(task)
+        clear(task)
+        task.done = true
+        CtxDetach(task)
+    end
+
+    -- Runs a task until it waits for something or returns
+    -- Arguments are the values returned by the wait function
+    local function run(task, ...)
+        if task.done or coroutine.status(task.co) ~= "suspended" then return end
+        clear(task)
+
+        local previous = current
+        current = task
+        SwitchCtx(task.ctx)
+        local success, error = resume(task.co, ...)
+        RestoreCtx()
+        current = previous
+
+        if not success then
+            print("[LUA]\t Error in task: " .. tostring(error))
+        end
+        if coroutine.status(task.co) == "dead" then
+            finish(task)
+        end
+    end
+
+    -- Returns the running task, waiting functions can only be called
+    -- from one
+    local function running_task(name)
+        if not current or running() ~= current.co then
+            error("attempt to call " .. name .. "() outside of a task", 3)
+        end
+        return current
+    end
+
+    -- Suspends the running task until run() is called again
+    -- A canceled task stays suspended forever and is collected.
+    local function suspend(task, timeout)
+        if timeout and not task.done then
+            task.timer = wake(timeout, task)
+        end
+        return yield()
+    end
+
+    -- Returns false for a timeout, the wake up values otherwise
+    local function results(...)
+        if ... == nil then return false end
+        return ...
+    end
+
+    -- Expired wake timer
+    bind("ResumeTask", function(task)
+        if not task then return end
+        task.timer = nil
+        run(task)
     end)
+
+    -- Edges on waited sensors
+    bind("WakeSensors", function(port, woken, value, time)
+        local base = (port - 1) * 8
+        for i = 0, 7 do
+            local mask = lshift(1, i)
+            local list = waiters[base + i + 1]
+            if band(woken, mask) ~= 0 and list then
+                local rising = band(value, mask) ~= 0
+                local edge = rising and "Rising" or "Falling"
+
+                -- Tasks are collected first, running them changes the list
+                local ready = {}
+                for j = 1, #list do
+                    local task = list[j]
+                    if task.edge == "Edge" or task.edge == edge then
+                        ready[#ready + 1] = task
+                    end
+                end
+
+                for j = 1, #ready do
+                    -- Unless it has been woken up by a previous one
+                    if ready[j].sensor == base + i + 1 then
+                        run(ready[j], true, rising, time)
+                    end
+                end
+            end
+        end
+    end)
+
+    -- Runs `fn` as a new task, until it first waits for something
+    -- The task belongs to the current context and is canceled with it.
+    function Spawn(fn, ...)
+        local task = {
+            ["ctx"] = GetCtx(),
+            ["co"] = create(fn),
+            ["release"] = finish
+        }
+
+        CtxAttach(task)
+        run(task, ...)
+        return task
+    end
+
+    -- Cancels a task, it will never be resumed
+    function Cancel(task)
+        if type(task) == "table" and task.co and not task.done then
+            finish(task)
+        end
+    end
+
+    -- Suspends the running task for `ms` milliseconds
+    function Sleep(ms)
+        suspend(running_task("Sleep"), ms or 0)
+    end
+
+    -- Suspends the running task until an edge of a sensor
+    -- `edge` is "Rising", "Falling" or "Edge" (default) for both.
+    -- Returns true and the state and time of the edge, or false once
+    -- `timeout` milliseconds elapsed.
+    function WaitSensor(id, edge, timeout)
+        local task = running_task("WaitSensor")
+        if type(id) == "table" then id = id.GetId() end
+
+        edge = edge or "Edge"
+        if edge ~= "Edge" and edge ~= "Rising" and edge ~= "Falling" then
+            error("invalid sensor edge: " .. tostring(edge))
+        end
+
+        if not task.done then
+            local list = waiters[id]
+            if not list then
+                wait_sensor(id, true)
+                list = {}
+                waiters[id] = list
+            end
+            list[#list + 1] = task
+            task.sensor, task.edge = id, edge
+        end
+
+        return results(suspend(task, timeout))
+    end
+
+    -- Suspends the running task until an emitter emits an event
+    -- The emitter is optional and defaults to C-events. Returns true
+    -- and the event arguments, or false once `timeout` milliseconds
+    -- elapsed.
+    function WaitEvent(emitter, event, timeout)
+        local task = running_task("WaitEvent")
+        if type(emitter) ~= "table" then
+            emitter, event, timeout = { ["On"] = On, ["Off"] = Off }, emitter, event
+        end
+
+        if not task.done then
+            task.emitter, task.event = emitter, event
+            task.handler = function(...)
+                run(task, true, ...)
+            end
+            emitter.On(event, task.handler)
+        end
+
+        return results(suspend(task, timeout))
+    end
 end
 
 -------------------------------------------------------------------------------
@@ -402,3 +727,15 @@ function load(file)
         print("Error loading file: " .. e)
     end
 end
+
+-- Evaluates code in the current context
+-- API clients scripts run in their own state and reach the control state
+-- through Control(), this one keeps them working when evaluated here.
+function Control(code)
+    local f, e = loadstring(code, "Control")
+    if f then
+        f()
+    else
+        error(e)
+    end
+end
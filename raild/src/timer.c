@@ -1,22 +1,127 @@
 #include "raild.h"
-#include <sys/timerfd.h>
 
 /**
  * Timer utilities
  *
  * These functions allow simple creation of JavaScript-like timers with
- * milliseconds precision. Those are triggered by event on file descriptor
- * making them quite suitable to use in the event loop.
+ * milliseconds precision.
+ *
+ * Every timer is kept in a single binary min-heap ordered by deadline.
+ * No file descriptor is used: the event loop asks for the delay until the
+ * next deadline and uses it as the epoll_wait() timeout, then collects
+ * expired timers with raild_timer_next(). Creating and canceling a timer
+ * is thus only a matter of heap manipulation, without any syscall.
+ *
+ * Delays are given in milliseconds of the raild clock (raild_now), which
+ * runs faster than the monotonic clock when a journal is replayed with an
+ * acceleration factor. They are converted once, when the timer is created.
+ */
+
+// Initial capacity of the timer heap
+#define HEAP_INITIAL_SIZE 32
+
+// The timer heap, heap[0] is the next timer to expire
+static raild_event **heap      = NULL;
+static int           heap_len  = 0;
+static int           heap_size = 0;
+
+/**
+ * Convert a timespec to nanoseconds
  */
+static uint64_t _to_ns(const struct timespec *ts) {
+    return (uint64_t) ts->tv_sec * 1000000000ULL + (uint64_t) ts->tv_nsec;
+}
 
 /**
- * Split time from milliseconds to struct of seconds / nanosecs
+ * Current monotonic time in nanoseconds
  */
-static struct timespec _split_time(int time) {
+static uint64_t _now() {
     struct timespec ts;
-    ts.tv_sec  = time / 1000;
-    ts.tv_nsec = (time % 1000) * 1000000;
-    return ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return _to_ns(&ts);
+}
+
+/**
+ * Converts a delay of the raild clock to monotonic nanoseconds
+ */
+static uint64_t _delay_ns(int ms) {
+    return (uint64_t) (ms * 1e6 / raild_time_scale);
+}
+
+/**
+ * Put a timer in the given heap slot
+ */
+static void _place(raild_event *event, int slot) {
+    heap[slot]  = event;
+    event->slot = slot;
+}
+
+/**
+ * Move a timer toward the top of the heap until its parent expires first
+ */
+static void _sift_up(int slot) {
+    raild_event *event = heap[slot];
+    while(slot > 0) {
+        int parent = (slot - 1) / 2;
+        if(heap[parent]->deadline <= event->deadline) break;
+        _place(heap[parent], slot);
+        slot = parent;
+    }
+    _place(event, slot);
+}
+
+/**
+ * Move a timer toward the bottom of the heap until its children expire later
+ */
+static void _sift_down(int slot) {
+    raild_event *event = heap[slot];
+    while(1) {
+        int child = slot * 2 + 1;
+        if(child >= heap_len) break;
+        if(child + 1 < heap_len && heap[child + 1]->deadline < heap[child]->deadline) {
+            child++;
+        }
+        if(heap[child]->deadline >= event->deadline) break;
+        _place(heap[child], slot);
+        slot = child;
+    }
+    _place(event, slot);
+}
+
+/**
+ * Insert a timer in the heap
+ */
+static void _schedule(raild_event *event) {
+    if(heap_len == heap_size) {
+        heap_size = heap_size ? heap_size * 2 : HEAP_INITIAL_SIZE;
+        heap = realloc(heap, heap_size * sizeof(raild_event *));
+        if(!heap) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    _place(event, heap_len++);
+    _sift_up(event->slot);
+}
+
+/**
+ * Remove a timer from the heap
+ */
+static void _unschedule(raild_event *event) {
+    int slot = event->slot;
+    event->slot = -1;
+
+    raild_event *last = heap[--heap_len];
+    if(last == event) return;
+
+    // Fill the hole with the last timer and restore heap order
+    _place(last, slot);
+    if(slot > 0 && heap[(slot - 1) / 2]->deadline > last->deadline) {
+        _sift_up(slot);
+    } else {
+        _sift_down(slot);
+    }
 }
 
 /**
@@ -25,42 +130,101 @@ static struct timespec _split_time(int time) {
  * If interval is 0, the timer is automatically deleted after firing.
  */
 raild_event *raild_timer_create(int initial, int interval, raild_event_type type) {
-    // Create the fd timer
-    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-
-    struct itimerspec timer;
-    timer.it_value    = _split_time(initial);
-    timer.it_interval = _split_time(interval);
-
-    timerfd_settime(fd, 0, &timer, NULL);
-
-    // Register timer in epoll
-    raild_event *event = raild_epoll_add(fd, type);
-    event->timer = true;
+    raild_event *event = raild_event_alloc();
+    event->fd       = -1;
+    event->type     = type;
+    event->priority = raild_event_priority(type);
+    event->timer    = true;
+    event->times    = 0;
+    event->n        = 0;
+    event->ptr      = 0;
+    event->purge    = false;
+    event->readable = false;
+    event->writable = false;
+    event->interval = 0;
+    if(interval > 0) {
+        // A repeating timer never becomes a one-time one
+        event->interval = _delay_ns(interval);
+        if(event->interval == 0) event->interval = 1;
+    }
+    event->deadline = _now() + _delay_ns(initial);
 
+    _schedule(event);
     return event;
 }
 
 /**
  * Delete the timer associated with the event
+ * A timer currently being dispatched is only marked for purge and will be
+ * collected by raild_timer_autodelete() once its handler returns.
  */
 void raild_timer_delete(raild_event *event) {
-    close(event->fd);
-    raild_epoll_rem(event);
+    if(event->slot < 0) {
+        event->purge = true;
+    } else {
+        _unschedule(event);
+        raild_event_free(event);
+    }
 }
 
 /**
- * Check if the timer need to be automatically deleted and delete it
+ * Called once the timer event has been dispatched
+ * Collects purged and one-time timers and reschedules the others.
  */
 void raild_timer_autodelete(raild_event *event) {
-    struct itimerspec timer;
-    if(timerfd_gettime(event->fd, &timer) < 0) {
-        perror("timerfd_gettime");
-        exit(1);
+    if(event->purge) {
+        raild_event_free(event);
+    } else if(event->interval == 0) {
+        if(event->type == RAILD_EV_LUA_TIMER) {
+            lua_delete_timer((void *) event);
+        }
+        raild_event_free(event);
+    } else {
+        _schedule(event);
     }
+}
 
-    if(timer.it_interval.tv_sec == 0 && timer.it_interval.tv_nsec == 0) {
-        lua_delete_timer((void *) event);
-        raild_timer_delete(event);
+/**
+ * Returns the number of milliseconds before the next timer expires,
+ * bounded to `max`
+ */
+int raild_timer_timeout(int max) {
+    if(heap_len == 0) return max;
+
+    uint64_t now = _now();
+    uint64_t deadline = heap[0]->deadline;
+    if(deadline <= now) return 0;
+
+    // Round up to avoid waking up just before the deadline
+    uint64_t delay = (deadline - now + 999999ULL) / 1000000ULL;
+    return (delay < (uint64_t) max) ? (int) delay : max;
+}
+
+/**
+ * Returns the next timer expired at time `now`, removed from the heap,
+ * or NULL if every remaining timer expires later.
+ *
+ * The `times` field of the event is set to the number of times the timer
+ * ticked since the last dispatch. Repeating timers get their next deadline
+ * computed here but are put back in the heap only after being dispatched.
+ */
+raild_event *raild_timer_next(const struct timespec *now) {
+    if(heap_len == 0) return NULL;
+
+    raild_event *event = heap[0];
+    uint64_t now_ns = _to_ns(now);
+    if(event->deadline > now_ns) return NULL;
+
+    _unschedule(event);
+
+    if(event->interval > 0) {
+        uint64_t interval = event->interval;
+        uint64_t times = (now_ns - event->deadline) / interval + 1;
+        event->deadline += times * interval;
+        event->times = (int) times;
+    } else {
+        event->times = 1;
     }
+
+    return event;
 }
@@ -0,0 +1,201 @@
+#include "raild.h"
+#include <fcntl.h>
+#include <termios.h>
+#include <train_opcodes.h>
+
+/**
+ * Speed commands of trains
+ *
+ * Trains listen on a serial channel of their own, separate from RailHubs,
+ * and receive addressed frames described in train_opcodes.h. Commands only
+ * update the requested speed and direction of a train: they are coalesced
+ * and sent once per event loop iteration by train_flush(), so that a
+ * script adjusting the speed of a following train on every sensor edge
+ * does not flood the channel.
+ *
+ * Frames are written from an output buffer, like RailHub commands: if the
+ * tty cannot accept everything, the remaining bytes are sent once epoll
+ * reports it as writable. Requests made meanwhile stay coalesced in the
+ * trains table and follow once the buffer is empty.
+ *
+ * The link has no acknowledgement. Every known train is sent its state
+ * again every TRAIN_REFRESH ms, a lost frame is thus corrected quickly.
+ *
+ * This is not a safety mechanism: power cutoffs still go through RailHub
+ * and the interlocking engine.
+ */
+
+// Interval between two refreshes of every trains state (ms)
+#ifndef TRAIN_REFRESH
+#define TRAIN_REFRESH 500
+#endif
+
+typedef struct {
+    bool  known;    // A speed was requested for this train
+    bool  dirty;    // State not sent yet
+    rbyte pwm;
+    bool  backward; // Sent along with the first speed if set before
+} train;
+
+static train trains[TRAINS_MAX + 1];
+static int   fd = -1;
+
+// Output buffer, large enough for the state of every trains
+static rbyte output[TRAINS_MAX * 2 * TRAIN_FRAME_LEN];
+static int   output_len = 0;
+
+// The epoll event of the channel and whether we are waiting for EPOLLOUT
+static raild_event *channel = NULL;
+static bool         output_blocked = false;
+
+/**
+ * Opens the trains channel at `path`
+ * Without this call, train commands are accepted and discarded.
+ */
+void setup_train(const char *path) {
+    char msg[128];
+    snprintf(msg, 128, "Init trains channel on %s", path);
+    logger("TRAIN", msg);
+
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fd == -1) {
+        logger_error("Unable to open the trains channel");
+        exit(1);
+    }
+
+    // Same settings as RailHub links, see uart.c
+    struct termios options;
+    tcgetattr(fd, &options);
+    options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
+    options.c_iflag = IGNPAR;
+    options.c_oflag = 0;
+    options.c_lflag = 0;
+    tcflush(fd, TCIFLUSH);
+    tcsetattr(fd, TCSANOW, &options);
+
+    channel = raild_epoll_add(fd, RAILD_EV_TRAIN);
+    raild_timer_create(TRAIN_REFRESH, TRAIN_REFRESH, RAILD_EV_TRAIN_TIMER);
+}
+
+/**
+ * Requests a speed for a train (1 to TRAINS_MAX)
+ */
+void train_set_speed(int id, rbyte pwm) {
+    train *t = &trains[id];
+    if(t->known && t->pwm == pwm) return;
+
+    t->known = true;
+    t->dirty = true;
+    t->pwm   = pwm;
+}
+
+/**
+ * Requests a direction for a train (1 to TRAINS_MAX)
+ * Kept until a speed is requested if there is none yet, sending a speed
+ * of 0 along with it would stop the train.
+ */
+void train_set_direction(int id, bool backward) {
+    train *t = &trains[id];
+    if(t->backward == backward) return;
+
+    t->backward = backward;
+    if(t->known) t->dirty = true;
+}
+
+/**
+ * Returns the last requested state of a train, false if no speed was
+ */
+bool train_get(int id, rbyte *pwm, bool *backward) {
+    train *t = &trains[id];
+    *pwm      = t->pwm;
+    *backward = t->backward;
+    return t->known;
+}
+
+static rbyte *put_frame(rbyte *out, rbyte opcode, rbyte id, rbyte arg) {
+    *out++ = TRAIN_SYNC;
+    *out++ = opcode;
+    *out++ = id;
+    *out++ = arg;
+    *out++ = TRAIN_CHECK(opcode, id, arg);
+    return out;
+}
+
+/**
+ * Queues the state of every dirty trains
+ */
+static void queue_dirty() {
+    rbyte *out = output;
+
+    for(int id = 1; id <= TRAINS_MAX; id++) {
+        train *t = &trains[id];
+        if(!t->dirty) continue;
+
+        out = put_frame(out, TRAIN_SET_DIRECTION, id, t->backward ? TRAIN_BACKWARD : TRAIN_FORWARD);
+        out = put_frame(out, TRAIN_SET_SPEED, id, t->pwm);
+        t->dirty = false;
+    }
+
+    output_len = out - output;
+}
+
+/**
+ * Sends the state of every dirty trains
+ * Called at the end of every event loop iteration.
+ */
+void train_flush() {
+    // Output still waiting from a previous iteration goes first
+    if(output_len == 0) queue_dirty();
+    if(output_len == 0 || output_blocked) return;
+
+    // Nothing to send to without a channel
+    if(fd < 0) {
+        output_len = 0;
+        return;
+    }
+
+    ssize_t len = write(fd, output, output_len);
+    if(len < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("(train) write");
+            exit(1);
+        }
+        len = 0;
+    }
+
+    output_len -= len;
+    memmove(output, output + len, output_len);
+
+    // The tty is full, wait for it to become writable again
+    if(output_len > 0) {
+        output_blocked = true;
+        raild_epoll_want_write(channel, true);
+    }
+}
+
+/**
+ * Trains channel event handler
+ * Trains do not send anything, input is discarded.
+ */
+void train_handle_event(raild_event *event) {
+    // The tty accepts data again, the flush at the end of this
+    // iteration will send the remaining output
+    if(event->writable && output_blocked) {
+        output_blocked = false;
+        raild_epoll_want_write(event, false);
+    }
+
+    if(event->readable) {
+        rbyte buffer[64];
+        while(read(fd, buffer, sizeof(buffer)) > 0);
+    }
+}
+
+/**
+ * Refresh timer handler
+ */
+void train_handle_timer(raild_event *event) {
+    for(int id = 1; id <= TRAINS_MAX; id++) {
+        if(trains[id].known) trains[id].dirty = true;
+    }
+}
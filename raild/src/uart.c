@@ -1,50 +1,228 @@
 #include "raild.h"
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/uio.h>
 #include <hub_opcodes.h>
 
 /**
  * Handle UART communication between Raild and RailHub
+ *
+ * Multiple RailHubs can be connected, each on its own UART. Every UART
+ * link registers a hub in the state table, in the order they were added,
+ * and keeps its own protocol state.
+ *
+ * Output to RailHub is not written immediately but queued in a ring buffer
+ * flushed once per event loop iteration by uart_flush(). Every opcodes
+ * produced while handling a batch of events thus go on the wire with a
+ * single write(). If the tty cannot accept everything, the remaining bytes
+ * are kept and sent once epoll reports the fd as writable.
  */
 
-#ifndef UART_DEBUG
-#define UART_DEBUG  0
+// Default UART device, can be overridden with the -u option
+#ifndef UART_PATH
+#define UART_PATH   "/dev/ttyAMA0"
 #endif
 
-#if UART_DEBUG
-#define TRACE(msg) logger("UART", "trace: " msg);
-#else
-#define TRACE(msg)
-#endif
+// Protocol tracing, enabled at runtime with the TRACE log level
+#define TRACE(msg) if(LOG_ENABLED(LOG_TRACE)) logger_log(LOG_TRACE, "UART", "trace: " msg);
 
-static int   uart0_filestream = -1;
 static rbyte buffer[256];
 
-static bool keep_alive_missing = false;
+// Output ring buffer
+// Must be a power of two
+#define OUTPUT_SIZE 1024
 
 typedef enum {
     UART_PROCESS_DISPATCH,
-    UART_PROCESS_SENSORS1,
-    UART_PROCESS_SENSORS2,
-    UART_PROCESS_SENSORS3,
-    UART_PROCESS_SWITCHES
+    UART_PROCESS_PORT,
+    UART_PROCESS_FULL_STATE
 } uart_process_state;
 
-static uart_process_state state = UART_PROCESS_DISPATCH;
+typedef struct {
+    int hub; // Index of the hub in the state table
+    int fd;  // The UART fd, -1 when replaying a journal
+
+    // Output ring buffer
+    rbyte output[OUTPUT_SIZE];
+    int   output_head; // Index of the next byte to send
+    int   output_len;  // Number of bytes waiting to be sent
+
+    // The epoll event of the UART fd and whether we are waiting for EPOLLOUT
+    raild_event *event;
+    bool         output_blocked;
+
+    // Queued bytes up to the end of the last switch command, 0 if it was
+    // written already, for the edge to switch latency statistics
+    int switch_bytes;
+
+    bool ready; // READY received from this RailHub
+    bool keep_alive_missing;
+
+    uart_process_state state;
+
+    // Payload of the state frame being received, and its opcode
+    rbyte frame[FULL_STATE_LEN];
+    int   frame_len;
+    rbyte frame_opcode;
+
+    // Sequence number expected for the next state frame
+    rbyte next_seq;
+    bool  seq_known;
+
+    // Number of state frames lost, detected by sequence gaps
+    unsigned int lost_frames;
+
+    // Last switches state requested from RailHub
+    // Used to build SET_SWITCHES commands while single switch commands
+    // are still waiting to be reflected in the hub state
+    rbyte switches_target;
+} uart_link;
+
+// Links, indexed by hub
+static uart_link *links[HUBS_MAX];
+static int        links_count = 0;
+
+/**
+ * Queues a frame to be sent to RailHub
+ * A frame is either queued entirely or dropped, to never send a truncated
+ * opcode / payload pair. Returns false if it was dropped.
+ */
+static bool uart_send(uart_link *link, const rbyte *frame, int len) {
+    if(link->output_len + len > OUTPUT_SIZE) {
+        logger_error("UART output buffer full, dropping frame");
+        return false;
+    }
+
+    journal_record(JOURNAL_UART_TX, link->hub, frame, len);
+
+    for(int i = 0; i < len; i++) {
+        link->output[(link->output_head + link->output_len++) & (OUTPUT_SIZE - 1)] = frame[i];
+    }
+
+    return true;
+}
 
-static void uart_put(unsigned char data) {
-    static unsigned char buffer[1];
-    buffer[0] = data;
-    write(uart0_filestream, buffer, 1);
+static void uart_put(uart_link *link, rbyte data) {
+    uart_send(link, &data, 1);
 }
 
-void uart_reset() {
-    state = UART_PROCESS_DISPATCH;
-    uart_put(RESET);
+static void uart_put2(uart_link *link, rbyte opcode, rbyte payload) {
+    rbyte frame[2] = { opcode, payload };
+    uart_send(link, frame, 2);
 }
 
-void setup_uart() {
-    logger("UART", "Init UART channel");
+/**
+ * Queues a switch command, its write is recorded in the statistics
+ */
+static void uart_put_switch(uart_link *link, rbyte opcode, rbyte payload) {
+    rbyte frame[2] = { opcode, payload };
+    if(uart_send(link, frame, 2)) {
+        link->switch_bytes = link->output_len;
+    }
+}
+
+/**
+ * Writes as much queued output of a link as the tty accepts
+ */
+static void uart_flush_link(uart_link *link) {
+    if(link->output_len == 0 || link->output_blocked) return;
+
+    // No UART while replaying a journal, output is discarded
+    if(link->fd < 0) {
+        link->output_len = 0;
+        link->switch_bytes = 0;
+        return;
+    }
+
+    // The queued data is at most split in two parts by the end of the ring
+    int first = OUTPUT_SIZE - link->output_head;
+    if(first > link->output_len) first = link->output_len;
+
+    struct iovec iov[2];
+    iov[0].iov_base = link->output + link->output_head;
+    iov[0].iov_len  = first;
+    iov[1].iov_base = link->output;
+    iov[1].iov_len  = link->output_len - first;
+
+    ssize_t len = writev(link->fd, iov, (link->output_len > first) ? 2 : 1);
+    if(len < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("(uart) write");
+            exit(1);
+        }
+        len = 0;
+    }
+
+    link->output_head = (link->output_head + len) & (OUTPUT_SIZE - 1);
+    link->output_len -= len;
+
+    if(link->switch_bytes > 0) {
+        if(len >= link->switch_bytes) {
+            link->switch_bytes = 0;
+            stats_switch_command();
+        } else {
+            link->switch_bytes -= len;
+        }
+    }
+
+    // The tty is full, wait for it to become writable again
+    if(link->output_len > 0) {
+        link->output_blocked = true;
+        raild_epoll_want_write(link->event, true);
+    }
+}
+
+/**
+ * Writes queued output of every links
+ * Called at the end of every event loop iteration.
+ */
+void uart_flush() {
+    for(int i = 0; i < links_count; i++) {
+        uart_flush_link(links[i]);
+    }
+}
+
+static void uart_reset(uart_link *link) {
+    link->state = UART_PROCESS_DISPATCH;
+    uart_put(link, RESET);
+}
+
+/**
+ * Creates a link and registers its hub
+ */
+static uart_link *uart_create(int fd) {
+    int hub = hub_register(RHUB_SENSOR_PORTS, RHUB_SWITCH_PORTS);
+    if(hub < 0) {
+        logger_error("Too many hubs");
+        exit(1);
+    }
+
+    uart_link *link = calloc(1, sizeof(uart_link));
+    if(!link) {
+        perror("calloc");
+        exit(1);
+    }
+
+    link->hub   = hub;
+    link->fd    = fd;
+    link->state = UART_PROCESS_DISPATCH;
+
+    links[hub] = link;
+    links_count++;
+
+    return link;
+}
+
+/**
+ * Opens the UART device at `path`, or UART_PATH if NULL, for a new hub
+ * Any tty can be used, such as the pty of the RailHub simulator.
+ */
+void uart_add(const char *path) {
+    if(!path) path = UART_PATH;
+
+    char msg[128];
+    snprintf(msg, 128, "Init UART channel on %s", path);
+    logger("UART", msg);
 
     //OPEN THE UART
     //The flags (defined in fcntl.h):
@@ -58,8 +236,8 @@ void setup_uart() {
     //                                            immediately with a failure status if the output can't be written immediately.
     //
     //    O_NOCTTY - When set and path identifies a terminal device, open() shall not cause the terminal device to become the controlling terminal for the process.
-    uart0_filestream = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY | O_NONBLOCK);        //Open in non blocking read/write mode
-    if(uart0_filestream == -1) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);        //Open in non blocking read/write mode
+    if(fd == -1) {
         //ERROR - CAN'T OPEN SERIAL PORT
         logger_error("Unable to open UART.  Ensure it is not in use by another application");
         exit(1);
@@ -76,72 +254,159 @@ void setup_uart() {
     //    PARENB - Parity enable
     //    PARODD - Odd parity (else even)
     struct termios options;
-    tcgetattr(uart0_filestream, &options);
+    tcgetattr(fd, &options);
     options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;        //<Set baud rate
     options.c_iflag = IGNPAR;
     options.c_oflag = 0;
     options.c_lflag = 0;
-    tcflush(uart0_filestream, TCIFLUSH);
-    tcsetattr(uart0_filestream, TCSANOW, &options);
+    tcflush(fd, TCIFLUSH);
+    tcsetattr(fd, TCSANOW, &options);
+
+    uart_link *link = uart_create(fd);
+    link->event = raild_epoll_add(fd, RAILD_EV_UART);
+    link->event->ptr = link;
+}
 
-    raild_epoll_add(uart0_filestream, RAILD_EV_UART);
+/**
+ * Adds a hub without UART, fed by uart_feed()
+ * Used to replay journals.
+ */
+void uart_add_offline() {
+    uart_create(-1);
+}
+
+/**
+ * Starts the keep-alive timer and resets every RailHubs
+ * Called once every links are added.
+ */
+void setup_uart() {
     raild_timer_create(500, 500, RAILD_EV_UART_TIMER);
 
-    uart_reset();
+    for(int i = 0; i < links_count; i++) {
+        uart_reset(links[i]);
+    }
+}
+
+/**
+ * Checks the sequence number of a state frame
+ * Returns false if frames were lost since the previous one.
+ */
+static bool uart_check_seq(uart_link *link, rbyte seq) {
+    bool in_sequence = !link->seq_known || seq == link->next_seq;
+    if(!in_sequence) {
+        rbyte lost = seq - link->next_seq;
+        link->lost_frames += lost;
+        logger_log(LOG_WARN, "UART", "Lost %d state frame(s) from RailHub %d", lost, link->hub + 1);
+    }
+
+    link->seq_known = true;
+    link->next_seq = seq + 1;
+    return in_sequence;
 }
 
-static void uart_process(rbyte *buffer, int len) {
+/**
+ * Applies a complete FULL_STATE frame
+ * Payload is [seq] [sensors1] [sensors2] [sensors3] [switches]
+ */
+static void uart_full_state(uart_link *link, double time) {
+    // Since each frame holds the whole state, applying this one is
+    // enough to resynchronize after a gap
+    uart_check_seq(link, link->frame[0]);
+    set_hub_full_state(link->hub, link->frame + 1, time);
+}
+
+/**
+ * Applies a complete single port frame
+ * Payload is [seq] [value]
+ */
+static void uart_port_state(uart_link *link, double time) {
+    rbyte value = link->frame[1];
+
+    switch(link->frame_opcode) {
+        case SENSORS_1: set_hub_sensors(link->hub, RHUB_SENSORS1, value, time); break;
+        case SENSORS_2: set_hub_sensors(link->hub, RHUB_SENSORS2, value, time); break;
+        case SENSORS_3: set_hub_sensors(link->hub, RHUB_SENSORS3, value, time); break;
+        default:        set_hub_switches(link->hub, 0, value, time); break;
+    }
+
+    // The lost frames may have changed other ports, ask for them again
+    if(!uart_check_seq(link, link->frame[0])) {
+        uart_put(link, GET_SENSORS_1);
+        uart_put(link, GET_SENSORS_2);
+        uart_put(link, GET_SENSORS_3);
+        uart_put(link, GET_SWITCHES);
+    }
+}
+
+/**
+ * Process data received from RailHub
+ * `time` is the timestamp of the read, passed along with state changes
+ */
+static void uart_process(uart_link *link, const rbyte *buffer, int len, double time) {
+    int hub = link->hub;
+
     for(int i = 0; i < len; i++) {
         rbyte c = buffer[i];
-        switch(state) {
+        switch(link->state) {
             case UART_PROCESS_DISPATCH:
                 switch(c) {
                     case HELLO:
                         TRACE("HELLO");
-                        set_hub_readiness(false);
-                        uart_put(SET_SWITCHES);
-                        uart_put(get_hub_state(RHUB_SWITCHES));
+                        link->ready = false;
+                        set_hub_readiness(hub, false);
+                        link->seq_known = false;
+                        link->switches_target = get_hub_switches(hub, 0);
+                        uart_put2(link, SET_SWITCHES, link->switches_target);
                     break;
 
                     case READY:
                         TRACE("READY");
-                        set_hub_readiness(true);
+                        link->ready = true;
+                        link->keep_alive_missing = false;
+                        set_hub_readiness(hub, true);
+                    break;
+
+                    case SENSORS_1:
+                    case SENSORS_2:
+                    case SENSORS_3:
+                    case SWITCHES:
+                        TRACE("PORT_STATE");
+                        link->frame_opcode = c;
+                        link->frame_len = 0;
+                        link->state = UART_PROCESS_PORT;
                     break;
 
-                    case SENSORS_1: TRACE("SENSORS_1"); state = UART_PROCESS_SENSORS1; break;
-                    case SENSORS_2: TRACE("SENSORS_2"); state = UART_PROCESS_SENSORS2; break;
-                    case SENSORS_3: TRACE("SENSORS_3"); state = UART_PROCESS_SENSORS3; break;
-                    case SWITCHES:  TRACE("SENSORS_4"); state = UART_PROCESS_SWITCHES; break;
+                    case FULL_STATE:
+                        TRACE("FULL_STATE");
+                        link->frame_len = 0;
+                        link->state = UART_PROCESS_FULL_STATE;
+                    break;
 
                     case KEEP_ALIVE:
                         TRACE("KEEP_ALIVE");
-                        keep_alive_missing = false;
-                        uart_put(KEEP_ALIVE);
+                        link->keep_alive_missing = false;
+                        uart_put(link, KEEP_ALIVE);
                     break;
 
                     default:
-                        printf("Unknown opcode from RailHub: 0x%02x\n", (unsigned char) c);
+                        logger_log(LOG_WARN, "UART", "Unknown opcode from RailHub: 0x%02x", (unsigned char) c);
                 }
                 break;
 
-            case UART_PROCESS_SENSORS1:
-                set_hub_state(RHUB_SENSORS1, c);
-                state = UART_PROCESS_DISPATCH;
-                break;
-
-            case UART_PROCESS_SENSORS2:
-                set_hub_state(RHUB_SENSORS2, c);
-                state = UART_PROCESS_DISPATCH;
-                break;
-
-            case UART_PROCESS_SENSORS3:
-                set_hub_state(RHUB_SENSORS3, c);
-                state = UART_PROCESS_DISPATCH;
+            case UART_PROCESS_PORT:
+                link->frame[link->frame_len++] = c;
+                if(link->frame_len == PORT_STATE_LEN) {
+                    uart_port_state(link, time);
+                    link->state = UART_PROCESS_DISPATCH;
+                }
                 break;
 
-            case UART_PROCESS_SWITCHES:
-                set_hub_state(RHUB_SWITCHES, c);
-                state = UART_PROCESS_DISPATCH;
+            case UART_PROCESS_FULL_STATE:
+                link->frame[link->frame_len++] = c;
+                if(link->frame_len == FULL_STATE_LEN) {
+                    uart_full_state(link, time);
+                    link->state = UART_PROCESS_DISPATCH;
+                }
                 break;
 
             default:
@@ -152,45 +417,110 @@ static void uart_process(rbyte *buffer, int len) {
 }
 
 void uart_handle_timer(raild_event *event) {
-    if(get_hub_readiness()) {
-        if(!keep_alive_missing) {
-            keep_alive_missing = true;
+    for(int i = 0; i < links_count; i++) {
+        uart_link *link = links[i];
+        if(link->fd < 0) continue;
+
+        if(link->ready) {
+            if(!link->keep_alive_missing) {
+                link->keep_alive_missing = true;
+            } else {
+                logger_log(LOG_INFO, "UART", "RailHub %d gone!", link->hub + 1);
+                link->ready = false;
+                set_hub_readiness(link->hub, false);
+            }
         } else {
-            logger("UART", "RailHub gone!");
-            set_hub_readiness(false);
+            uart_reset(link);
         }
-    } else {
-        uart_reset();
     }
 }
 
 void uart_handle_event(raild_event *event) {
-    int len = read(uart0_filestream, (void *) buffer, 256);
+    uart_link *link = (uart_link *) event->ptr;
+
+    // The tty accepts data again, the flush at the end of this
+    // iteration will send the remaining output
+    if(event->writable && link->output_blocked) {
+        link->output_blocked = false;
+        raild_epoll_want_write(event, false);
+    }
+
+    if(!event->readable) {
+        return;
+    }
 
-    if(len == EAGAIN || len == 0) {
+    int len = read(link->fd, (void *) buffer, 256);
+
+    if(len == 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
         return;
     } else if(len < 0) {
         perror("(uart) read");
         exit(1);
     } else {
-        uart_process(buffer, len);
+        double time = event->time.tv_sec + event->time.tv_nsec / 1e9;
+        journal_record(JOURNAL_UART_RX, link->hub, buffer, len);
+        uart_process(link, buffer, len, time);
     }
 }
 
-void uart_setswitch_on(rbyte sid) {
-    uart_put(SET_SWITCH_ON);
-    uart_put(sid);
+/**
+ * Feeds data to the input processor of a hub as if received from RailHub
+ * Used to replay journals.
+ */
+void uart_feed(int hub, const rbyte *data, int len, double time) {
+    if(hub < links_count) {
+        uart_process(links[hub], data, len, time);
+    }
 }
 
-void uart_setswitch_off(rbyte sid) {
-    uart_put(SET_SWITCH_OFF);
-    uart_put(sid);
-}
+/**
+ * Sets a switch (1-based global id)
+ */
+void uart_setswitch(int sid, bool state) {
+    int port, bit;
+    uart_link *link = links[hub_locate_switch(sid, &port, &bit)];
 
-void uart_setpower(bool state) {
     if(state) {
-        uart_put(POWER_ON);
+        link->switches_target |= (1 << bit);
+        uart_put_switch(link, SET_SWITCH_ON, bit);
     } else {
-        uart_put(POWER_OFF);
+        link->switches_target &= ~(1 << bit);
+        uart_put_switch(link, SET_SWITCH_OFF, bit);
     }
 }
+
+/**
+ * Sets multiple switches of a hub with a single SET_SWITCHES command
+ * Switches in `mask` are set to their bit in `values`, others are kept
+ * in their last requested state.
+ */
+void uart_setswitches(int hub, rbyte mask, rbyte values) {
+    uart_link *link = links[hub];
+
+    link->switches_target = (link->switches_target & ~mask) | (values & mask);
+    uart_put_switch(link, SET_SWITCHES, link->switches_target);
+}
+
+/**
+ * Returns the number of state frames detected as lost
+ */
+unsigned int uart_lost_frames() {
+    unsigned int lost = 0;
+    for(int i = 0; i < links_count; i++) {
+        lost += links[i]->lost_frames;
+    }
+    return lost;
+}
+
+void uart_setpower(bool state) {
+    for(int i = 0; i < links_count; i++) {
+        uart_put(links[i], state ? POWER_ON : POWER_OFF);
+    }
+}
+
+/**
+ * Sends the power state to a single hub
+ */
+void uart_sethubpower(int hub, bool state) {
+    uart_put(links[hub], state ? POWER_ON : POWER_OFF);
+}
@@ -0,0 +1,579 @@
+#include "raild.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <luajit-2.0/lua.h>
+#include <luajit-2.0/lualib.h>
+#include <luajit-2.0/lauxlib.h>
+#include <luajit-2.0/luajit.h>
+#include <raild_shm.h>
+
+/**
+ * API worker
+ *
+ * Lua chunks sent by API clients are not evaluated by the event loop but
+ * by a worker thread, each client having its own isolated Lua state. A
+ * slow or looping client script thus never delays UART handling and the
+ * control logic reacting to sensors.
+ *
+ * Client states only see the circuit through the shared-memory snapshot
+ * (see shm.c), which is read-only. Everything else goes back to the event
+ * loop as messages: output to the client, and chunks given to Control(),
+ * which are evaluated by the control state in the client context. This is
+ * how clients send commands and subscribe to events.
+ *
+ * Every client shares the worker thread, so a chunk only gets a time
+ * budget: a count hook raises an error in chunks running longer than
+ * WORKER_CHUNK_BUDGET. Count hooks are not called from JIT-compiled code,
+ * the JIT is thus disabled in client states. Compiled chunks are kept in a
+ * cache of each client state, see chunks.c.
+ *
+ * The worker and the event loop exchange messages through two rings with a
+ * single producer and a single consumer each, only synchronized by their
+ * head and tail counters. The worker is woken up by a semaphore and the
+ * event loop by an eventfd. Close messages are never dropped: when the
+ * ring is full, they wait in a list shared under a mutex.
+ */
+
+// Embedded worker.lua, loaded in every client state
+extern char _binary_src_worker_lua_start;
+extern char _binary_src_worker_lua_size;
+
+// Number of messages in each ring
+// Must be a power of two
+#define WORKER_QUEUE 256
+
+// Time budget of a client chunk (ms)
+#ifndef WORKER_CHUNK_BUDGET
+#define WORKER_CHUNK_BUDGET 200
+#endif
+
+// Instructions between two checks of the time budget
+#define WORKER_HOOK_COUNT 10000
+
+typedef enum {
+    WORKER_EVAL,    // Chunk to evaluate in the client state
+    WORKER_CLOSE,   // The client is gone
+    WORKER_OUTPUT,  // Data to send to the client
+    WORKER_CONTROL, // Chunk to evaluate in the control state
+    WORKER_ERROR    // Error raised by a client chunk
+} worker_msg_type;
+
+typedef struct {
+    worker_msg_type type;
+    int             fd;
+    unsigned int    session;
+    char           *data;
+    size_t          length;
+} worker_msg;
+
+typedef struct {
+    worker_msg   slots[WORKER_QUEUE];
+    unsigned int head; // Next slot to fill, written by the producer
+    unsigned int tail; // Next slot to read, written by the consumer
+} worker_queue;
+
+// Lua state of an API client
+typedef struct {
+    lua_State   *L;
+    int          fd;
+    unsigned int session;
+    chunk_cache *cache;
+    uint64_t     deadline; // End of the budget of the running chunk (ns)
+} worker_client;
+
+// A close message waiting for room in the ring
+typedef struct close_msg {
+    int               fd;
+    unsigned int      session;
+    struct close_msg *next;
+} close_msg;
+
+static worker_queue to_worker;
+static worker_queue to_loop;
+
+static pthread_t worker_thread;
+static sem_t     pending;
+static int       notify_fd = -1;
+
+// Close messages which did not fit in the ring
+static pthread_mutex_t closes_lock = PTHREAD_MUTEX_INITIALIZER;
+static close_msg      *closes      = NULL;
+
+// Client states indexed by fd, only used by the worker thread
+static worker_client **clients      = NULL;
+static int             clients_size = 0;
+
+/**
+ * Queues a message, returns false if the ring is full
+ */
+static bool queue_push(worker_queue *q, const worker_msg *msg) {
+    unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if(q->head - tail >= WORKER_QUEUE) return false;
+
+    q->slots[q->head & (WORKER_QUEUE - 1)] = *msg;
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Takes the next message, returns false if the ring is empty
+ */
+static bool queue_pop(worker_queue *q, worker_msg *msg) {
+    unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if(q->tail == head) return false;
+
+    *msg = q->slots[q->tail & (WORKER_QUEUE - 1)];
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Builds a message holding a copy of `data`
+ */
+static worker_msg message(worker_msg_type type, int fd, unsigned int session, const char *data, size_t length) {
+    worker_msg msg = { type, fd, session, NULL, length };
+    if(length > 0) {
+        msg.data = malloc(length);
+        memcpy(msg.data, data, length);
+    }
+    return msg;
+}
+
+//---------------------------------------------------------------------------//
+// Worker thread
+//---------------------------------------------------------------------------//
+
+/**
+ * Sends a message to the event loop
+ * The worker waits for room in the ring, it is never the one in a hurry.
+ */
+static void send_loop(worker_msg_type type, worker_client *client, const char *data, size_t length) {
+    worker_msg msg = message(type, client->fd, client->session, data, length);
+    while(!queue_push(&to_loop, &msg)) {
+        struct timespec delay = { 0, 1000000 };
+        nanosleep(&delay, NULL);
+    }
+
+    uint64_t one = 1;
+    if(write(notify_fd, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, the loop will be woken up anyway
+    }
+}
+
+/**
+ * Returns the client owning a Lua state
+ */
+static worker_client *client_of(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "raild_client");
+    worker_client *client = (worker_client *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return client;
+}
+
+/**
+ * Reads the current snapshot of the circuit state
+ */
+static void snapshot(lua_State *L, raild_shm *out) {
+    if(!raild_shm_read(shm_snapshot(), out)) {
+        luaL_error(L, "unable to read the circuit state");
+    }
+}
+
+/**
+ * Checks a sensor or switch id against the snapshot
+ */
+static int check_id(lua_State *L, int count, const char *what) {
+    int id = luaL_checknumber(L, 1);
+    if(id < 1 || id > count) {
+        luaL_error(L, "out of bounds %s id", what);
+    }
+    return id;
+}
+
+/**
+ * __rd_output(data)
+ * Sends data to the client
+ */
+static int lualib_output(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    if(len > 0) send_loop(WORKER_OUTPUT, client_of(L), data, len);
+    return 0;
+}
+
+/**
+ * Control(code)
+ * Evaluates code in the control state, in the context of this client
+ */
+static int lualib_Control(lua_State *L) {
+    size_t len;
+    const char *code = luaL_checklstring(L, 1, &len);
+    if(len > 0) send_loop(WORKER_CONTROL, client_of(L), code, len);
+    return 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t) tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/**
+ * Now()
+ * Returns the monotonic time in seconds
+ */
+static int lualib_Now(lua_State *L) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    lua_pushnumber(L, tp.tv_sec + tp.tv_nsec / 1e9);
+    return 1;
+}
+
+/**
+ * IsHubReady()
+ */
+static int lualib_IsHubReady(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    lua_pushboolean(L, state.flags & RAILD_SHM_READY);
+    return 1;
+}
+
+/**
+ * IsPowered()
+ */
+static int lualib_IsPowered(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    lua_pushboolean(L, state.flags & RAILD_SHM_POWER);
+    return 1;
+}
+
+/**
+ * SensorsCount()
+ */
+static int lualib_SensorsCount(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    lua_pushnumber(L, state.sensors);
+    return 1;
+}
+
+/**
+ * SwitchesCount()
+ */
+static int lualib_SwitchesCount(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    lua_pushnumber(L, state.switches);
+    return 1;
+}
+
+/**
+ * GetSensor(sid)
+ */
+static int lualib_GetSensor(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    int sid = check_id(L, state.sensors, "sensor");
+    lua_pushboolean(L, raild_shm_bit(state.sensors_state, sid));
+    return 1;
+}
+
+/**
+ * GetSwitch(sid)
+ */
+static int lualib_GetSwitch(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    int sid = check_id(L, state.switches, "switch");
+    lua_pushboolean(L, raild_shm_bit(state.switches_state, sid));
+    return 1;
+}
+
+/**
+ * IsSwitchLocked(sid)
+ */
+static int lualib_IsSwitchLocked(lua_State *L) {
+    raild_shm state;
+    snapshot(L, &state);
+    int sid = check_id(L, state.switches, "switch");
+    lua_pushboolean(L, raild_shm_bit(state.locks, sid));
+    return 1;
+}
+
+static const luaL_Reg worker_api[] = {
+    { "__rd_output",    lualib_output },
+    { "Control",        lualib_Control },
+    { "Now",            lualib_Now },
+    { "IsHubReady",     lualib_IsHubReady },
+    { "IsPowered",      lualib_IsPowered },
+    { "SensorsCount",   lualib_SensorsCount },
+    { "SwitchesCount",  lualib_SwitchesCount },
+    { "GetSensor",      lualib_GetSensor },
+    { "GetSwitch",      lualib_GetSwitch },
+    { "IsSwitchLocked", lualib_IsSwitchLocked },
+    { NULL, NULL }
+};
+
+/**
+ * Reports the error on top of the stack of a client state
+ */
+static void report(worker_client *client) {
+    size_t len;
+    const char *error = lua_tolstring(client->L, -1, &len);
+    if(!error) {
+        error = "(error object is not a string)";
+        len = strlen(error);
+    }
+    send_loop(WORKER_ERROR, client, error, len);
+    lua_pop(client->L, 1);
+}
+
+/**
+ * Count hook, enforces the time budget of the running chunk
+ * Once the budget is exceeded, the error is raised again on every check,
+ * so that a chunk catching it with pcall() still ends.
+ */
+static void budget_hook(lua_State *L, lua_Debug *ar) {
+    worker_client *client = client_of(L);
+    if(now_ns() > client->deadline) {
+        luaL_error(L, "chunk exceeded its time budget of %d ms", WORKER_CHUNK_BUDGET);
+    }
+}
+
+/**
+ * Runs the function on top of the stack of a client state within the time
+ * budget, reporting errors
+ */
+static void client_call(worker_client *client) {
+    client->deadline = now_ns() + WORKER_CHUNK_BUDGET * 1000000ULL;
+    if(lua_pcall(client->L, 0, 0, 0) != 0) {
+        report(client);
+    }
+}
+
+/**
+ * Creates the Lua state of a client
+ */
+static worker_client *client_open(int fd, unsigned int session) {
+    worker_client *client = malloc(sizeof(worker_client));
+    client->fd      = fd;
+    client->session = session;
+    client->L       = luaL_newstate();
+    client->cache   = chunk_cache_create();
+
+    lua_State *L = client->L;
+    luaL_openlibs(L);
+
+    // Count hooks are only called by the interpreter
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+    lua_sethook(L, budget_hook, LUA_MASKCOUNT, WORKER_HOOK_COUNT);
+
+    lua_pushlightuserdata(L, client);
+    lua_setfield(L, LUA_REGISTRYINDEX, "raild_client");
+
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    luaL_register(L, NULL, worker_api);
+    lua_pop(L, 1);
+
+    if(luaL_loadbuffer(L, &_binary_src_worker_lua_start, (size_t) &_binary_src_worker_lua_size, "worker") != 0) {
+        report(client);
+    } else {
+        client_call(client);
+    }
+
+    return client;
+}
+
+/**
+ * Destroys the Lua state of a client
+ */
+static void client_close(int fd) {
+    if(fd >= clients_size || !clients[fd]) return;
+    lua_close(clients[fd]->L);
+    chunk_cache_free(clients[fd]->cache);
+    free(clients[fd]);
+    clients[fd] = NULL;
+}
+
+/**
+ * Returns the state of a client, creating it if needed
+ */
+static worker_client *client_get(int fd, unsigned int session) {
+    if(fd >= clients_size) {
+        int size = clients_size ? clients_size : 16;
+        while(size <= fd) size *= 2;
+        clients = realloc(clients, size * sizeof(worker_client *));
+        memset(clients + clients_size, 0, (size - clients_size) * sizeof(worker_client *));
+        clients_size = size;
+    }
+
+    // A previous client of this fd may not have been closed yet
+    if(clients[fd] && clients[fd]->session != session) {
+        client_close(fd);
+    }
+
+    if(!clients[fd]) {
+        clients[fd] = client_open(fd, session);
+    }
+
+    return clients[fd];
+}
+
+/**
+ * Evaluates a chunk in the state of its client
+ */
+static void client_eval(worker_msg *msg) {
+    worker_client *client = client_get(msg->fd, msg->session);
+
+    if(!chunk_cache_load(client->L, client->cache, msg->data, msg->length, "API")) {
+        report(client);
+    } else {
+        client_call(client);
+    }
+}
+
+/**
+ * Closes the state of a client, unless its fd has a new client already
+ */
+static void client_release(int fd, unsigned int session) {
+    if(fd < clients_size && clients[fd] && clients[fd]->session == session) {
+        client_close(fd);
+    }
+}
+
+/**
+ * Handles close messages which did not fit in the ring
+ * Called once the ring is empty, after every message queued before them.
+ */
+static void release_closes() {
+    pthread_mutex_lock(&closes_lock);
+    close_msg *list = closes;
+    closes = NULL;
+    pthread_mutex_unlock(&closes_lock);
+
+    while(list) {
+        close_msg *next = list->next;
+        client_release(list->fd, list->session);
+        free(list);
+        list = next;
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_msg msg;
+    while(1) {
+        sem_wait(&pending);
+        while(queue_pop(&to_worker, &msg)) {
+            switch(msg.type) {
+                case WORKER_EVAL:
+                    client_eval(&msg);
+                    break;
+
+                case WORKER_CLOSE:
+                    client_release(msg.fd, msg.session);
+                    break;
+
+                default:
+                    break;
+            }
+            free(msg.data);
+        }
+        release_closes();
+    }
+    return NULL;
+}
+
+//---------------------------------------------------------------------------//
+// Event loop side
+//---------------------------------------------------------------------------//
+
+void setup_worker() {
+    logger("API", "Starting API worker");
+
+    notify_fd = eventfd(0, EFD_NONBLOCK);
+    if(notify_fd < 0) {
+        perror("(worker) eventfd");
+        exit(1);
+    }
+
+    sem_init(&pending, 0, 0);
+    if(pthread_create(&worker_thread, NULL, worker_main, NULL) != 0) {
+        perror("(worker) pthread_create");
+        exit(1);
+    }
+
+    raild_epoll_add(notify_fd, RAILD_EV_WORKER);
+}
+
+/**
+ * Sends a message to the worker thread
+ */
+static void send_worker(worker_msg *msg) {
+    if(!queue_push(&to_worker, msg)) {
+        logger_log(LOG_WARN, "API", "Worker queue full, dropping client chunk");
+        free(msg->data);
+        return;
+    }
+    sem_post(&pending);
+}
+
+/**
+ * Evaluates a chunk sent by an API client in its own Lua state
+ */
+void worker_eval(int fd, unsigned int session, const char *chunk, size_t length) {
+    worker_msg msg = message(WORKER_EVAL, fd, session, chunk, length);
+    send_worker(&msg);
+}
+
+/**
+ * Destroys the Lua state of a disconnected API client
+ */
+void worker_close(int fd, unsigned int session) {
+    worker_msg msg = message(WORKER_CLOSE, fd, session, NULL, 0);
+    if(queue_push(&to_worker, &msg)) {
+        sem_post(&pending);
+        return;
+    }
+
+    // Dropping it would leak the client state, it waits on the side
+    close_msg *close = malloc(sizeof(close_msg));
+    close->fd      = fd;
+    close->session = session;
+
+    pthread_mutex_lock(&closes_lock);
+    close->next = closes;
+    closes = close;
+    pthread_mutex_unlock(&closes_lock);
+
+    sem_post(&pending);
+}
+
+/**
+ * Handles messages from the worker thread
+ * Messages for a client already gone are dropped.
+ */
+void worker_handle_event(raild_event *event) {
+    uint64_t count;
+    if(read(event->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("(worker) read");
+    }
+
+    worker_msg msg;
+    while(queue_pop(&to_loop, &msg)) {
+        if(msg.type == WORKER_ERROR) {
+            logger_log(LOG_ERROR, "API", "%.*s", (int) msg.length, msg.data);
+        } else if(socket_session_alive(msg.fd, msg.session)) {
+            if(msg.type == WORKER_OUTPUT) {
+                socket_send(msg.fd, msg.data, msg.length);
+            } else if(msg.type == WORKER_CONTROL) {
+                lua_switch_context(msg.fd);
+                lua_eval(msg.data, msg.length);
+                lua_restore_context();
+            }
+        }
+        free(msg.data);
+    }
+}
@@ -0,0 +1,64 @@
+-- StdLib of API clients states, see worker.c
+--
+-- These states only read the circuit state. Commands and event handlers
+-- are given to Control(), which evaluates them in the control state.
+
+-- void output(data)
+-- Sends data to the client
+local output = __rd_output
+__rd_output = nil
+
+-------------------------------------------------------------------------------
+-- Output
+-------------------------------------------------------------------------------
+do
+    -- Builds a string from every arguments
+    local function concat(sep, ...)
+        local n = select("#", ...)
+        local a = {...}
+
+        local buffer = {}
+        for i = 1, n do
+            buffer[#buffer + 1] = tostring(a[i])
+        end
+
+        return table.concat(buffer, sep)
+    end
+
+    -- Print sends data to the client
+    function print(...)
+        output(concat("\t", ...) .. "\r\n")
+    end
+
+    -- Raw send function
+    function send(...)
+        output(concat("", ...))
+    end
+end
+
+-------------------------------------------------------------------------------
+-- Commands
+-------------------------------------------------------------------------------
+do
+    local format = string.format
+
+    function SetSwitch(id, state)
+        Control(format("SetSwitch(%d, %s)", id, tostring(state and true)))
+    end
+
+    function SetSwitchLock(id, locked)
+        Control(format("SetSwitchLock(%d, %s)", id, tostring(locked and true)))
+    end
+
+    function SetPower(state)
+        Control(format("SetPower(%s)", tostring(state and true)))
+    end
+
+    function SetTrainSpeed(id, pwm, backward)
+        if backward == nil then
+            Control(format("SetTrainSpeed(%d, %d)", id, pwm))
+        else
+            Control(format("SetTrainSpeed(%d, %d, %s)", id, pwm, tostring(backward and true)))
+        end
+    end
+end
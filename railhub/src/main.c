@@ -8,21 +8,113 @@ uint8  keepalive_timeout = 0;
 
 #define WATCHDOG WDTCN = 0xA5;
 
+// Sequence number of the next state frame
+uint8 state_seq = 0;
+
+// Sends a single port state frame
 #define SEND_DATA(opcode, payload) \
 	WATCHDOG; \
 	putchar_raw(opcode); \
+	putchar_raw(state_seq++); \
 	putchar_raw(payload);
 
+//-----------------------------------------------------------------------------
+// Interrupt-driven UART0
+//-----------------------------------------------------------------------------
+//
+// Bytes are sent and received by the UART0 interrupt through two small
+// ring buffers, so the sensors scanning loop never waits for the serial
+// line. Sizes must be powers of two.
+//
+#define RX_SIZE 16
+#define TX_SIZE 32
+
+uint8 idata rx_buffer[RX_SIZE];
+uint8 idata tx_buffer[TX_SIZE];
+
+volatile uint8 rx_head = 0; // Next byte to read, owned by the main loop
+volatile uint8 rx_tail = 0; // Next free slot, owned by the interrupt
+volatile uint8 tx_head = 0; // Next byte to send, owned by the interrupt
+volatile uint8 tx_tail = 0; // Next free slot, owned by the main loop
+volatile uint8 tx_busy = false;
+
+void UART0_ISR() interrupt 4 {
+	if(RI0) {
+		RI0 = 0;
+		// Drop the byte if the buffer is full
+		if(((rx_tail + 1) & (RX_SIZE - 1)) != rx_head) {
+			rx_buffer[rx_tail] = SBUF0;
+			rx_tail = (rx_tail + 1) & (RX_SIZE - 1);
+		}
+	}
+
+	if(TI0) {
+		TI0 = 0;
+		if(tx_head != tx_tail) {
+			SBUF0 = tx_buffer[tx_head];
+			tx_head = (tx_head + 1) & (TX_SIZE - 1);
+		} else {
+			tx_busy = false;
+		}
+	}
+}
+
 char putchar_raw(char c)  {
-	while (!TI0);
-	TI0 = 0;
-	return (SBUF0 = c);
+	// Only waits if the transmit buffer is full
+	while(((tx_tail + 1) & (TX_SIZE - 1)) == tx_head) {
+		WATCHDOG;
+	}
+
+	tx_buffer[tx_tail] = c;
+
+	ES0 = 0;
+	tx_tail = (tx_tail + 1) & (TX_SIZE - 1);
+	if(!tx_busy) {
+		// Start the transmission, the interrupt will send the byte
+		tx_busy = true;
+		TI0 = 1;
+	}
+	ES0 = 1;
+
+	return c;
+}
+
+bool rx_available() {
+	return rx_head != rx_tail;
+}
+
+uint8 rx_get() {
+	uint8 c = rx_buffer[rx_head];
+	rx_head = (rx_head + 1) & (RX_SIZE - 1);
+	return c;
 }
 
 sbit led = P1^6;
 
-void handle_input() {
-	switch(_getkey()) {
+// Opcode waiting for its argument byte, 0 if none
+uint8 pending_opcode = 0;
+
+void handle_input(uint8 c) {
+	// Argument of a previous opcode
+	if(pending_opcode) {
+		switch(pending_opcode) {
+			case SET_SWITCHES:
+				P2 = ~c;
+				break;
+
+			case SET_SWITCH_ON:
+				P2 &= ~(1 << c);
+				break;
+
+			case SET_SWITCH_OFF:
+				P2 |= (1 << c);
+				break;
+		}
+		pending_opcode = 0;
+		return;
+	}
+
+	switch(c) {
 		//
 		// Sensors
 		//
@@ -32,19 +124,14 @@ void handle_input() {
 
 		//
 		// Switches manipulation
+		// These opcodes are followed by an argument byte
 		//
 		case GET_SWITCHES: SEND_DATA(SWITCHES, ~P2); break;
 
 		case SET_SWITCHES:
-			P2 = ~_getkey();
-			break;
-
 		case SET_SWITCH_ON:
-			P2 &= ~(1 << _getkey());
-			break;
-
 		case SET_SWITCH_OFF:
-			P2 |= (1 << _getkey());
+			pending_opcode = c;
 			break;
 
 		//
@@ -69,6 +156,7 @@ void handle_input() {
 		// Reset
 		//
 		case RESET:
+			EA = 0;
 			((void (code *)(void)) 0x0000)();
 	}
 }
@@ -78,44 +166,63 @@ void dead() {
 
 	while(1) {
 		WATCHDOG;
-		if(RI0 == 1) {
-			handle_input();
+		if(rx_available()) {
+			handle_input(rx_get());
 		}
 	}
 }
 
 void watch_sensors() {
 	uint8 _shadow;
+	uint8 changed;        // Number of ports changed during the scan
+	uint8 changed_opcode; // Opcode and value of the last one
+	uint8 changed_value;
 	uint8 switches = ~P2;
 	uint8 sensors1 = ~P4;
 	uint8 sensors2 = ~P5;
 	uint8 sensors3 = ~P6;
 
-	SEND_DATA(SWITCHES, ~P2);
-	SEND_DATA(SENSORS_1, ~P4);
-	SEND_DATA(SENSORS_2, ~P5);
-	SEND_DATA(SENSORS_3, ~P6);
+	// Send every ports in a single frame
+	#define SEND_STATE() \
+		WATCHDOG; \
+		putchar_raw(FULL_STATE); \
+		putchar_raw(state_seq++); \
+		putchar_raw(sensors1); \
+		putchar_raw(sensors2); \
+		putchar_raw(sensors3); \
+		putchar_raw(switches);
+
+	SEND_STATE();
 
 	putchar_raw(READY);
 
-	#define DO_SHADOW(shadow, port, opcode, action) \
+	#define DO_SHADOW(shadow, port, opcode) \
 		if(_shadow = (port), _shadow != shadow) { \
 			shadow = _shadow; \
-			action; \
-			WATCHDOG; \
-			SEND_DATA(opcode, shadow); \
+			changed++; \
+			changed_opcode = opcode; \
+			changed_value = _shadow; \
 		}
 
 	while(1) {
 		WATCHDOG;
 
-		DO_SHADOW(switches, ~P2, SWITCHES,);
-		DO_SHADOW(sensors1, ~P4, SENSORS_1,);
-		DO_SHADOW(sensors2, ~P5, SENSORS_2,);
-		DO_SHADOW(sensors3, ~P6, SENSORS_3,);
+		// A single changed port is sent with its own opcode, ports
+		// changed during the same scan are sent together
+		changed = 0;
+		DO_SHADOW(switches, ~P2, SWITCHES);
+		DO_SHADOW(sensors1, ~P4, SENSORS_1);
+		DO_SHADOW(sensors2, ~P5, SENSORS_2);
+		DO_SHADOW(sensors3, ~P6, SENSORS_3);
+
+		if(changed == 1) {
+			SEND_DATA(changed_opcode, changed_value);
+		} else if(changed) {
+			SEND_STATE();
+		}
 
-		if(RI0 == 1) {
-			handle_input();
+		if(rx_available()) {
+			handle_input(rx_get());
 		}
 
 		if(--keepalive == 0) {
@@ -140,6 +247,9 @@ void main() {
 	PORT_Init();   // initialize crossbar and GPIO
 	UART0_Init();  // initialize UART0
 
+	ES0 = 1;       // enable UART0 interrupt
+	EA  = 1;       // enable interrupts
+
 	led = 1;
 	P2  = 0xFF;
 
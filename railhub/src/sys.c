@@ -51,5 +51,5 @@ void UART0_Init() {
 	CKCON |= 0x10;               // Timer1 uses SYSCLK as time base
 	PCON |= 0x80;                // SMOD00 = 1 (disable baud rate
 	                             // divide-by-two)
-	TI0 = 1;                     // Indicate TX0 ready
+	TI0 = 0;                     // TX0 is driven by the interrupt
 }
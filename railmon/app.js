@@ -2,9 +2,7 @@
 // Raild Socket
 //----------------------------------------------------------------------------//
 var net = require("net");
-var EventEmitter = require("events").EventEmitter;
 
-var emitter = new EventEmitter();
 var sock_lock = false;
 var online = false;
 var sync;
@@ -16,12 +14,14 @@ function socketConnect() {
     // Open socket to Raild
     var socket = net.connect(9000, "localhost", function() {
         online = true;
-        emitter.emit("event", { type: "online" });
+        broadcast(frame({ type: "online" }));
 
-        socket.write("RailMon.Bind()\fRailMon.Sync()\f");
+        // API scripts run in an isolated state, RailMon lives in the
+        // control state
+        socket.write("Control('RailMon.Bind() RailMon.Sync()')\f");
 
         sync = function() {
-            socket.write("RailMon.Sync()\f");
+            socket.write("Control('RailMon.Sync()')\f");
         };
 
         // Buffers list
@@ -36,16 +36,15 @@ function socketConnect() {
             // Search for \n
             for(var i = from; i < len; ++i) {
                 if(buf[i] == 10) {
-                    buffers.push(buf.slice(from, i + 1));
-                    try {
-                        var json = JSON.parse(Buffer.concat(buffers).toString("ascii"));
-                    } catch(e) {
-                        console.error("Unable to parse JSON message");
-                        console.error(e);
-                        process.exit();
+                    // Only concat lines split across several chunks
+                    var line = buf.toString("ascii", from, i);
+                    if(buffers.length) {
+                        buffers.push(buf.slice(from, i));
+                        line = Buffer.concat(buffers).toString("ascii");
+                        buffers = [];
                     }
-                    emitter.emit("event", { type: "raild", payload: json });
-                    buffers = [];
+
+                    relay(line);
                     from = i + 1;
                 }
             }
@@ -63,7 +62,7 @@ function socketConnect() {
 
         if(online) {
             online = false;
-            emitter.emit("event", { type: "offline" });
+            broadcast(frame({ type: "offline" }));
         }
 
         sock_lock = false;
@@ -79,6 +78,34 @@ function socketConnect() {
 
 socketConnect();
 
+//----------------------------------------------------------------------------//
+// Shared-memory state snapshot
+//----------------------------------------------------------------------------//
+// Optional native addon, see shm/raild_shm.c. When available, the current
+// state is read directly from Raild memory instead of asking Raild to
+// build a Sync message.
+var shm = null;
+try {
+    shm = require("./shm");
+} catch(e) {
+    console.log("Shared-memory addon not available, using RailMon.Sync()");
+}
+
+// Builds a Sync message from the shared-memory snapshot, or null
+function shmSync() {
+    var state = shm && shm.read();
+    if(!state || !state.alive) return null;
+
+    return {
+        event: "Sync",
+        sensors: state.sensors.slice(1),
+        switches: state.switches.slice(1),
+        locks: state.locks.slice(1),
+        ready: state.ready,
+        power: state.power
+    };
+}
+
 //----------------------------------------------------------------------------//
 // Express app
 //----------------------------------------------------------------------------//
@@ -92,6 +119,16 @@ app.get("/", function(req, res) {
     res.redirect("/app.html");
 });
 
+// Current state, polled by local tools
+app.get("/state", function(req, res) {
+    var state = shmSync();
+    if(state) {
+        res.json(state);
+    } else {
+        res.status(503).end();
+    }
+});
+
 app.use(directory(__dirname + '/static'))
 app.use(express.static(__dirname + '/static'))
 
@@ -109,18 +146,112 @@ server.listen(80);
 var WebSocketServer = require("ws").Server;
 var wss = new WebSocketServer({server: server});
 
-wss.on("connection", function(ws) {
-    var listener = function(event) {
-        ws.send(JSON.stringify(event), function() { /* ignore errors */ });
+// Every message is serialized once and the same string is sent to every
+// client. A client with more than MAX_INFLIGHT messages not yet written
+// gets the next ones queued instead, and only the latest state of each
+// sensor and switch is kept in this queue.
+var MAX_INFLIGHT = 32;
+
+// Events only carrying the new state of one element, by kind of state
+var STATE_EVENTS = {
+    "SensorChange": "Sensor",
+    "SwitchChange": "Switch",
+    "SwitchLock": "Lock",
+    "SwitchUnlock": "Lock"
+};
+
+var clients = [];
+
+// Serializes a message for WebSocket clients
+function frame(msg) {
+    return JSON.stringify(msg);
+}
+
+// Returns the key of messages superseding each other, or null
+function stateKey(event) {
+    var kind = STATE_EVENTS[event.event];
+    return kind ? kind + ":" + event.id : null;
+}
+
+// Relays a line received from Raild, parsed once for its state key
+function relay(line) {
+    try {
+        var json = JSON.parse(line);
+    } catch(e) {
+        console.error("Unable to parse JSON message");
+        console.error(e);
+        process.exit();
+    }
+
+    broadcast('{"type":"raild","payload":' + line + '}', stateKey(json));
+}
+
+function Client(ws) {
+    this.ws = ws;
+    this.inflight = 0;
+    this.queue = [];     // Messages waiting for the socket to drain
+    this.states = {};    // Index in queue of the latest message of each key
+
+    var self = this;
+    this.written = function() {
+        self.inflight--;
+        self.drain();
     };
+}
+
+// Sends a message, or queues it if the client is behind
+Client.prototype.send = function(data, key) {
+    if(this.inflight < MAX_INFLIGHT && this.queue.length == 0) {
+        this.inflight++;
+        this.ws.send(data, this.written);
+    } else if(key && key in this.states) {
+        // Stale state, replaced by the new one
+        this.queue[this.states[key]].data = data;
+    } else {
+        if(key) {
+            this.states[key] = this.queue.length;
+        } else {
+            // States queued before a Sync, Ready or Disconnect must not be
+            // replaced by newer ones, they would be applied before it
+            this.states = {};
+        }
+        this.queue.push({ data: data, key: key });
+    }
+};
 
-    emitter.on("event", listener);
+// Sends queued messages once the socket caught up
+Client.prototype.drain = function() {
+    if(this.queue.length == 0 || this.inflight >= MAX_INFLIGHT) return;
+
+    var queue = this.queue;
+    this.queue = [];
+    this.states = {};
+    for(var i = 0; i < queue.length; i++) {
+        this.send(queue[i].data, queue[i].key);
+    }
+};
+
+function broadcast(data, key) {
+    for(var i = 0; i < clients.length; i++) {
+        clients[i].send(data, key);
+    }
+}
+
+wss.on("connection", function(ws) {
+    var client = new Client(ws);
+
+    clients.push(client);
     if(online) {
-        sync();
-        listener({ type: "online" });
+        var state = shmSync();
+        if(state) {
+            client.send(frame({ type: "raild", payload: state }));
+        } else {
+            sync();
+        }
+        client.send(frame({ type: "online" }));
     }
 
     ws.on("close", function() {
-        emitter.removeListener("event", listener);
+        clients.splice(clients.indexOf(client), 1);
     });
 });
@@ -0,0 +1,10 @@
+{
+    "targets": [
+        {
+            "target_name": "raild_shm",
+            "sources": [ "raild_shm.c" ],
+            "include_dirs": [ "../../shared" ],
+            "libraries": [ "-lrt" ]
+        }
+    ]
+}
@@ -0,0 +1,98 @@
+#include <node_api.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <raild_shm.h>
+
+/**
+ * Node binding for the Raild shared-memory state snapshot
+ *
+ *   var shm = require("./shm");
+ *   var state = shm.read();
+ *
+ * read() returns null if Raild never ran, or an object:
+ *   { alive, ready, power, sensors: [...], switches: [...], locks: [...] }
+ * Arrays are indexed by global ids, starting at 1 like in Lua scripts.
+ */
+
+static const raild_shm *shm = NULL;
+
+/**
+ * Maps the segment, returns false if it does not exist yet
+ */
+static bool map() {
+    if(shm) return true;
+
+    int fd = shm_open(RAILD_SHM_NAME, O_RDONLY, 0);
+    if(fd < 0) return false;
+
+    void *addr = mmap(NULL, sizeof(raild_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) return false;
+
+    shm = addr;
+    if(shm->magic != RAILD_SHM_MAGIC || shm->version != RAILD_SHM_VERSION) {
+        munmap(addr, sizeof(raild_shm));
+        shm = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static napi_value boolean(napi_env env, bool value) {
+    napi_value result;
+    napi_get_boolean(env, value, &result);
+    return result;
+}
+
+/**
+ * Builds an array from a bitset, with a null element at index 0
+ */
+static napi_value bitset(napi_env env, const uint64_t *set, int count) {
+    napi_value array, null;
+    napi_create_array_with_length(env, count + 1, &array);
+    napi_get_null(env, &null);
+    napi_set_element(env, array, 0, null);
+
+    for(int i = 1; i <= count; i++) {
+        napi_set_element(env, array, i, boolean(env, raild_shm_bit(set, i)));
+    }
+    return array;
+}
+
+static napi_value read_state(napi_env env, napi_callback_info info) {
+    napi_value result;
+    raild_shm state;
+
+    if(!map() || !raild_shm_read(shm, &state)) {
+        napi_get_null(env, &result);
+        return result;
+    }
+
+    // The segment outlives raild, check it is still running
+    bool alive = state.pid && (kill(state.pid, 0) == 0 || errno == EPERM);
+
+    int sensors  = state.sensors  <= RAILD_SHM_SENSORS  ? state.sensors  : RAILD_SHM_SENSORS;
+    int switches = state.switches <= RAILD_SHM_SWITCHES ? state.switches : RAILD_SHM_SWITCHES;
+
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "alive", boolean(env, alive));
+    napi_set_named_property(env, result, "ready", boolean(env, alive && (state.flags & RAILD_SHM_READY)));
+    napi_set_named_property(env, result, "power", boolean(env, alive && (state.flags & RAILD_SHM_POWER)));
+    napi_set_named_property(env, result, "sensors",  bitset(env, state.sensors_state, sensors));
+    napi_set_named_property(env, result, "switches", bitset(env, state.switches_state, switches));
+    napi_set_named_property(env, result, "locks",    bitset(env, state.locks, switches));
+    return result;
+}
+
+static napi_value init(napi_env env, napi_value exports) {
+    napi_value fn;
+    napi_create_function(env, "read", NAPI_AUTO_LENGTH, read_state, NULL, &fn);
+    napi_set_named_property(env, exports, "read", fn);
+    return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, init)
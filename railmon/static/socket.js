@@ -1,7 +1,24 @@
 var sock_timeout;
 
+// Redraws the map once per animation frame, whatever the number of
+// updates received meanwhile
+var redraw = (function() {
+    var pending = false;
+
+    function draw() {
+        pending = false;
+        drawMap();
+    }
+
+    return function() {
+        if(pending) return;
+        pending = true;
+        requestAnimationFrame(draw);
+    };
+})();
+
 function connect() {
-    var ws = new WebSocket("ws://rail-pi");
+    var ws = new WebSocket("ws://" + location.host);
 
     function updateSwitchState(id, state) {
         if(!switches[id]) return;
@@ -32,7 +49,6 @@ function connect() {
 
             case "raild":
                 var msg = msg.payload;
-                console.log(msg);
                 switch(msg.event) {
                     case "Round":
                         $("#round").text(msg.count);
@@ -40,18 +56,18 @@ function connect() {
 
                     case "SwitchChange":
                         updateSwitchState(msg.id, msg.state);
-                        drawMap();
+                        redraw();
                         break;
 
                     case "SwitchLock":
                     case "SwitchUnlock":
                         updateSwitchLock(msg.id, msg.event == "SwitchLock");
-                        drawMap();
+                        redraw();
                         break;
 
                     case "SensorChange":
                         updateSensorActive(msg.id, msg.state);
-                        drawMap();
+                        redraw();
                         break;
 
                     case "Ready":
@@ -95,7 +111,7 @@ function connect() {
                             $("#statusReady").removeClass("on").addClass("off");
                         }
 
-                        drawMap();
+                        redraw();
                         break;
                 }
                 break;
@@ -1,5 +1,6 @@
 #include <c8051f330.h>
 #include <stdio.h>
+#include <train_opcodes.h>
 
 typedef unsigned char uint8;
 typedef unsigned int  uint16;
@@ -14,6 +15,17 @@ sbit HBR2 = P0^2;
 #define pwm_ctl(state) PCA0CN = (state) ? 0x40 : 0x00
 #define sleep()        PCON |= 0x01
 
+// Id of this train, set for each locomotive
+#ifndef TRAIN_ID
+#define TRAIN_ID       1
+#endif
+
+// PWM value until raild sends a speed
+#define DEFAULT_SPEED  64
+
+// Main loop iterations between two PWM steps, smooths speed changes
+#define RAMP_TICKS     2048
+
 void init_clock() {
 	CLKSEL = 0x00;
 	OSCICN = 0x83;
@@ -32,47 +44,135 @@ void init_ports() {
 	P0 = 0x00;
 }
 
-/*void init_uart() {
+// 115200 bauds from the 24.5 MHz internal oscillator
+void init_uart() {
 	SCON0 = 0x50;
-	TMOD = 0x20; 
+	TMOD = 0x20;
 	TH1 = 0x96;
 	TR1 = 1;
 	CKCON |= 0x08;
-	TI0 = 1;
-}*/
+	ES0 = 1;
+	EA = 1;
+}
+
+//-----------------------------------------------------------------------------
+// Commands from raild, see train_opcodes.h
+//-----------------------------------------------------------------------------
+//
+// Bytes are received by the UART0 interrupt in a small ring buffer and
+// parsed by the main loop. Size must be a power of two.
+//
+#define RX_SIZE 16
+
+uint8 idata rx_buffer[RX_SIZE];
+
+volatile uint8 rx_head = 0; // Next byte to read, owned by the main loop
+volatile uint8 rx_tail = 0; // Next free slot, owned by the interrupt
+
+void UART0_ISR() interrupt 4 {
+	if(RI0) {
+		RI0 = 0;
+		// Drop the byte if the buffer is full
+		if(((rx_tail + 1) & (RX_SIZE - 1)) != rx_head) {
+			rx_buffer[rx_tail] = SBUF0;
+			rx_tail = (rx_tail + 1) & (RX_SIZE - 1);
+		}
+	}
+	if(TI0) {
+		TI0 = 0;
+	}
+}
+
+uint8 target = DEFAULT_SPEED;
+
+// Frame being received, without its sync byte
+uint8 frame[TRAIN_FRAME_LEN - 1];
+uint8 frame_len = 0;
+bit   in_frame = false;
+
+// Direction driven by the bridge, and the one requested by raild
+bit backward = false;
+bit wanted_backward = false;
+
+void drive_bridge() {
+	// Never drive both sides of the bridge
+	HBR1 = 0;
+	HBR2 = 0;
+	if(backward) {
+		HBR2 = 1;
+	} else {
+		HBR1 = 1;
+	}
+}
+
+void handle_frame() {
+	if(frame[3] != TRAIN_CHECK(frame[0], frame[1], frame[2])) return;
+	if(frame[1] != TRAIN_ID && frame[1] != TRAIN_ALL) return;
+
+	switch(frame[0]) {
+		case TRAIN_SET_SPEED:
+			target = frame[2];
+			break;
+
+		// Applied by the main loop once the train is stopped
+		case TRAIN_SET_DIRECTION:
+			wanted_backward = (frame[2] == TRAIN_BACKWARD);
+			break;
+	}
+}
+
+void handle_input(uint8 c) {
+	if(!in_frame) {
+		if(c == TRAIN_SYNC) {
+			in_frame = true;
+			frame_len = 0;
+		}
+		return;
+	}
+
+	frame[frame_len++] = c;
+	if(frame_len == TRAIN_FRAME_LEN - 1) {
+		in_frame = false;
+		handle_frame();
+	}
+}
 
 void main() {
-	uint16 i = 0;
-	uint8  j = 0;
-	
+	uint16 ticks = 0;
+
 	init_clock();
 	init_pwm();
 	init_ports();
-	//init_uart();
-	
+	init_uart();
+
 	pwm = 0;
 	pwm_ctl(true);
-	
-	HBR1 = 1;
-	HBR2 = 0;
-	
+
+	drive_bridge();
+
 	while(1) {
-		while(pwm > 0) {
-			for(j = 0; j < 16; j++)
-			for(i = 1; i; i++);
-			pwm -= 2;
+		while(rx_head != rx_tail) {
+			handle_input(rx_buffer[rx_head]);
+			rx_head = (rx_head + 1) & (RX_SIZE - 1);
 		}
-		while(pwm < 64) {
-			for(j = 0; j < 16; j++)
-			for(i = 1; i; i++);
-			pwm += 2;
+
+		// Move the PWM towards the requested speed, one step at a time
+		// To reverse, the train slows down to 0 first, then the bridge is
+		// flipped and the train speeds up again.
+		if(++ticks == RAMP_TICKS) {
+			ticks = 0;
+			if(wanted_backward != backward) {
+				if(pwm > 0) {
+					pwm--;
+				} else {
+					backward = wanted_backward;
+					drive_bridge();
+				}
+			} else if(pwm < target) {
+				pwm++;
+			} else if(pwm > target) {
+				pwm--;
+			}
 		}
-		/*if(HBR1) {
-			HBR1 = 0;
-			HBR2 = 1;
-		} else {
-			HBR2 = 0;
-			HBR1 = 1;
-		}*/
 	}
-}
\ No newline at end of file
+}
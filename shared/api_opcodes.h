@@ -0,0 +1,33 @@
+// Binary API protocol between raild and monitoring clients
+//
+// A client selects this protocol by sending API_BINARY as the very first
+// byte of the connection. Every following frame, in both directions, is
+//   [length] [opcode] [payload...]
+// where length is the number of bytes after itself (opcode + payload).
+
+#define API_BINARY      0x00
+
+// Client -> raild
+#define API_SUBSCRIBE   0x01 // [classes mask], answered with API_SYNC
+
+// raild -> client
+// Sensors and switches are grouped in ports of 8, numbered from 1 across
+// every hubs. API_SYNC holds S sensors ports then W switches ports and
+// W switches locks ports.
+#define API_SYNC        0x10 // [S] [W] [sensors...] [switches...] [locks...] [flags]
+#define API_SENSORS     0x11 // [port] [changed mask] [value]
+#define API_SWITCHES    0x12 // [port] [changed mask] [value]
+#define API_LOCK        0x13 // [switch id] [locked]
+#define API_POWER       0x14 // [state]
+#define API_READY       0x15 // [state]
+
+// Subscription classes
+#define API_SUB_SENSOR  0x01
+#define API_SUB_SWITCH  0x02
+#define API_SUB_LOCK    0x04
+#define API_SUB_POWER   0x08
+#define API_SUB_READY   0x10
+
+// API_SYNC flags
+#define API_FLAG_READY  0x01
+#define API_FLAG_POWER  0x02
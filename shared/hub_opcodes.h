@@ -3,12 +3,24 @@
 #define POWER_ON        0x31
 #define POWER_OFF       0x32
 
+// A single port
+// [seq] [value]
 #define SENSORS_1       0x41
 #define SENSORS_2       0x42
 #define SENSORS_3       0x43
 #define SWITCHES        0x44
+#define PORT_STATE_LEN  2
+
 #define READY           0x45
 
+// Every ports in a single frame
+// [seq] [sensors1] [sensors2] [sensors3] [switches]
+#define FULL_STATE      0x46
+#define FULL_STATE_LEN  5
+
+// seq is shared by every state frames, single port or full, and is
+// incremented by one for each of them
+
 #define GET_SENSORS_1   0x61
 #define GET_SENSORS_2   0x62
 #define GET_SENSORS_3   0x63
@@ -0,0 +1,69 @@
+// Shared-memory snapshot of the circuit state published by raild
+//
+// raild maps a POSIX shared-memory object named RAILD_SHM_NAME and updates
+// it at the end of every event loop iteration where something changed.
+// Local tools can map it read-only and poll it at any rate without any
+// interaction with raild.
+//
+// The segment is protected by a seqlock: raild makes `seq` odd while
+// writing and even again once done. Readers copy the segment and retry if
+// `seq` was odd or changed meanwhile, see raild_shm_read().
+//
+// Sensors, switches and locks are bitsets, bit i of word i / 64 being the
+// state of the element of global id i + 1.
+
+#ifndef RAILD_SHM_H
+#define RAILD_SHM_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define RAILD_SHM_NAME     "/raild"
+#define RAILD_SHM_MAGIC    0x4D485352 // "RSHM"
+#define RAILD_SHM_VERSION  1
+
+#define RAILD_SHM_SENSORS  512
+#define RAILD_SHM_SWITCHES 128
+
+// Flags
+#define RAILD_SHM_READY    0x01
+#define RAILD_SHM_POWER    0x02
+
+typedef struct raild_shm_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;       // Odd while raild is writing
+    uint32_t pid;       // pid of raild
+    uint32_t flags;
+    uint16_t sensors;   // Number of sensors
+    uint16_t switches;  // Number of switches
+    uint64_t updated;   // Monotonic time of the last update (ns)
+    uint64_t sensors_state[RAILD_SHM_SENSORS / 64];
+    uint64_t switches_state[RAILD_SHM_SWITCHES / 64];
+    uint64_t locks[RAILD_SHM_SWITCHES / 64];
+} raild_shm;
+
+// Reads a consistent snapshot of the segment in `out`
+// Returns false if raild kept writing during every attempt.
+static inline bool raild_shm_read(const raild_shm *shm, raild_shm *out) {
+    for(int tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+
+        memcpy(out, shm, sizeof(raild_shm));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the state of an element (1-based id) in a bitset
+static inline bool raild_shm_bit(const uint64_t *set, int id) {
+    return (set[(id - 1) / 64] >> ((id - 1) % 64)) & 1;
+}
+
+#endif
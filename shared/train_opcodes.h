@@ -0,0 +1,25 @@
+// Commands sent by raild to railtrain firmwares
+//
+// Trains share a single serial channel (a radio link on the layout), so
+// every frame is addressed and protected by a check byte:
+//
+//   [TRAIN_SYNC] [opcode] [train id] [argument] [check]
+//
+// check is opcode ^ id ^ argument ^ 0xFF. Receivers drop frames with a
+// bad check and wait for the next TRAIN_SYNC byte.
+// Train ids start at 1, TRAIN_ALL addresses every trains.
+
+#define TRAIN_SYNC          0xA5
+#define TRAIN_FRAME_LEN     5
+
+#define TRAIN_ALL           0x00
+
+// [pwm] motor PWM value, the train ramps smoothly towards it
+#define TRAIN_SET_SPEED     0x53
+
+// [direction] TRAIN_FORWARD or TRAIN_BACKWARD
+#define TRAIN_SET_DIRECTION 0x44
+#define TRAIN_FORWARD       0x00
+#define TRAIN_BACKWARD      0x01
+
+#define TRAIN_CHECK(opcode, id, arg) ((opcode) ^ (id) ^ (arg) ^ 0xFF)